@@ -0,0 +1,122 @@
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "binary.h"
+#include "dbg_dwarf.h"
+#include "utils.h"
+
+
+// The ELF side only: symbols and call frame information. The DWARF index
+// is built separately, see binary_get and profile_main.
+binary_t *binary_open(const char *path) {
+    struct stat st;
+
+    if (elf_version(EV_CURRENT) == EV_NONE) {
+        printf("ELF library initialization failed: %s\n", elf_errmsg(elf_errno()));
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        printf(" opening \"%s\" failed\n", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
+    if (elf == NULL) {
+        printf(" elf_begin () failed: %s\n", elf_errmsg(elf_errno()));
+        close(fd);
+        return NULL;
+    }
+    if (elf_kind(elf) != ELF_K_ELF) {
+        printf("Error: file is not an ELF object\n");
+        elf_end(elf);
+        close(fd);
+        return NULL;
+    }
+
+    binary_t *bin = calloc(1, sizeof(binary_t));
+    bin->path = strdup(path);
+    bin->dev = st.st_dev;
+    bin->ino = st.st_ino;
+    bin->refs = 1;
+    bin->elf = elf;
+    bin->elf_fd = fd;
+    bin->is_pie = bin_is_pie(elf);
+    sym_index_load(&bin->sym_index, elf);
+    func_index_init(&bin->func_index);
+    func_index_init(&bin->inline_index);
+    line_table_init(&bin->line_table);
+    source_cache_init(&bin->source_cache);
+    unwind_init(&bin->unwinder);
+
+    return bin;
+}
+
+void binary_free(binary_t *bin) {
+    wait_dwarf_index(bin);
+    for (size_t i = 0; i < bin->num_early_cus; ++i) {
+        cu_lines_free(bin->early_cus[i]);
+        free(bin->early_cus[i]);
+    }
+    free(bin->early_cus);
+    func_index_free(&bin->func_index);
+    func_index_free(&bin->inline_index);
+    line_table_free(&bin->line_table);
+    index_cache_free(&bin->index_cache);
+    source_cache_free(&bin->source_cache);
+    unwind_free(&bin->unwinder);
+    if (bin->dwarf)
+        dwarf_finish(bin->dwarf);
+    sym_index_free(&bin->sym_index);
+    elf_end(bin->elf);
+    close(bin->elf_fd);
+    free(bin->path);
+    free(bin);
+}
+
+// Inferiors running the same file, by whatever path, share one binary.
+// A new one starts indexing in the background straight away.
+binary_t *binary_get(binary_t **list, const char *path) {
+    struct stat st;
+
+    if (stat(path, &st) == 0) {
+        for (binary_t *bin = *list; bin; bin = bin->next) {
+            if (bin->dev == st.st_dev && bin->ino == st.st_ino) {
+                bin->refs++;
+                return bin;
+            }
+        }
+    }
+
+    binary_t *bin = binary_open(path);
+    if (bin == NULL)
+        return NULL;
+
+    dwarf_init(&bin->dwarf, bin->path);
+    start_dwarf_index(bin);
+
+    bin->next = *list;
+    *list = bin;
+    return bin;
+}
+
+void binary_put(binary_t **list, binary_t *bin) {
+    if (--bin->refs > 0)
+        return;
+
+    for (binary_t **p = list; *p; p = &(*p)->next) {
+        if (*p == bin) {
+            *p = bin->next;
+            break;
+        }
+    }
+    binary_free(bin);
+}
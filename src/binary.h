@@ -0,0 +1,55 @@
+#ifndef BINARY_H
+#define BINARY_H
+
+#include <sys/types.h>
+
+#include <libdwarf-0/dwarf.h>
+#include <libdwarf-0/libdwarf.h>
+#include <libelf.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "func_index.h"
+#include "sym_index.h"
+#include "line_table.h"
+#include "source_cache.h"
+#include "index_cache.h"
+#include "unwind.h"
+
+
+// One executable file: its symbols, debug info index, sources and call
+// frame tables. Loaded once and shared by every inferior running it; none
+// of it depends on where a process has it mapped. Only the caches that
+// fill in on demand change after indexing, and only on the command loop.
+typedef struct binary {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    int refs;
+    Elf *elf;
+    int elf_fd;
+    bool is_pie;
+    Dwarf_Debug dwarf;
+    func_index_t func_index;
+    func_index_t inline_index;
+    sym_index_t sym_index;
+    line_table_t line_table;
+    index_cache_t index_cache;
+    pthread_t index_thread;
+    bool index_pending;     // index_thread owns the three indexes until joined
+    bool index_done;        // set by index_thread as it finishes
+    cu_lines_t **early_cus; // decoded on demand while the index was pending
+    size_t num_early_cus;
+    source_cache_t source_cache;
+    unwinder_t unwinder;
+    struct binary *next;
+} binary_t;
+
+
+binary_t *binary_open(const char *path);
+void binary_free(binary_t *bin);
+
+binary_t *binary_get(binary_t **list, const char *path);
+void binary_put(binary_t **list, binary_t *bin);
+
+#endif
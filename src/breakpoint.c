@@ -1,42 +1,416 @@
 #include <sys/ptrace.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "breakpoint.h"
+#include "memory.h"
 #include <stdio.h>
 
-void enable_breakpoint(breakpoint_t *bp) {
-    long saved_data = ptrace(PTRACE_PEEKDATA, bp->pid, bp->addr, NULL);
-    // save lower half, the data that will be replaced by the trap instruction
-    bp->saved_data = saved_data & 0xFFFFFFFF;
-    long trap = 0xD4200000;
+#define BP_TABLE_MIN_CAP 64
 
-    // writing 64 bits, so writing both trap in lower half and next instruction in upper half
-    long data_to_write = ((saved_data >> 32) << 32) | trap;
-    
-    ptrace(PTRACE_POKEDATA, bp->pid, bp->addr, data_to_write);
 
+static const uint32_t trap_insn = BP_TRAP_INSN;
+
+void insert_bp_site(pid_t pid, bp_site_t *site) {
+    uint32_t insn;
+
+    if (read_memory_range(pid, site->addr, &insn, sizeof(insn)) != sizeof(insn) ||
+        write_text_range(pid, site->addr, &trap_insn, sizeof(trap_insn)) != sizeof(trap_insn)) {
+        printf("Cannot insert breakpoint at 0x%lx\n", site->addr);
+        return;
+    }
+
+    site->saved_insn = insn;
+    site->inserted = true;
+}
+
+void remove_bp_site(pid_t pid, bp_site_t *site) {
+    if (write_text_range(pid, site->addr, &site->saved_insn, sizeof(site->saved_insn)) != sizeof(site->saved_insn)) {
+        printf("Cannot remove breakpoint at 0x%lx\n", site->addr);
+        return;
+    }
+
+    site->inserted = false;
+}
+
+void bp_table_init(bp_table_t *table, pid_t pid) {
+    memset(table, 0, sizeof(*table));
+    table->pid = pid;
+    table->next_num = 1;
+    table->next_internal_num = -1;
+
+    pool_init(&table->bp_pool, sizeof(breakpoint_t));
+    pool_init(&table->loc_pool, sizeof(bp_location_t));
+    pool_init(&table->site_pool, sizeof(bp_site_t));
+}
+
+// Traps are left in place, the inferior is expected to be gone
+void bp_table_free(bp_table_t *table) {
+    for (breakpoint_t *bp = table->head; bp; bp = bp->next) {
+        bp_set_condition(bp, NULL, NULL);
+        bp_action_free(bp->action);
+        free(bp->pending);
+        free(bp->deferred);
+    }
+
+    free(table->sites);
+    free(table->pending);
+    pool_destroy(&table->bp_pool);
+    pool_destroy(&table->loc_pool);
+    pool_destroy(&table->site_pool);
+    memset(table, 0, sizeof(*table));
+}
+
+// Put back the original instruction at every trap, e.g. before
+// detaching. The breakpoints themselves are kept.
+void bp_table_remove_traps(bp_table_t *table) {
+    bp_table_sync(table);
+
+    for (size_t i = 0; i < table->sites_cap; ++i) {
+        if (table->sites[i] && table->sites[i]->inserted)
+            remove_bp_site(table->pid, table->sites[i]);
+    }
+}
+
+// Put back the original instructions in another process with a copy of
+// the inferior's text, e.g. a forked child. The inferior keeps its traps.
+void bp_table_restore_text(const bp_table_t *table, pid_t pid) {
+    for (size_t i = 0; i < table->sites_cap; ++i) {
+        const bp_site_t *site = table->sites[i];
+        if (site && site->inserted)
+            write_text_range(pid, site->addr, &site->saved_insn, sizeof(site->saved_insn));
+    }
+    // removed sites whose trap is still there
+    for (size_t i = 0; i < table->num_pending; ++i) {
+        const bp_site_t *site = table->pending[i];
+        if (site->orphan && site->inserted)
+            write_text_range(pid, site->addr, &site->saved_insn, sizeof(site->saved_insn));
+    }
+}
+
+static size_t hash_addr(uint64_t addr, size_t cap) {
+    // instructions are 4 byte aligned
+    return ((addr >> 2) * 0x9E3779B97F4A7C15ULL) >> 32 & (cap - 1);
+}
+
+static void site_table_put(bp_site_t **sites, size_t cap, bp_site_t *site) {
+    size_t slot = hash_addr(site->addr, cap);
+    while (sites[slot] != NULL)
+        slot = (slot + 1) & (cap - 1);
+    sites[slot] = site;
+}
+
+static void site_table_grow(bp_table_t *table) {
+    size_t new_cap = table->sites_cap ? table->sites_cap * 2 : BP_TABLE_MIN_CAP;
+    bp_site_t **new_sites = calloc(new_cap, sizeof(bp_site_t *));
+
+    for (size_t i = 0; i < table->sites_cap; ++i) {
+        if (table->sites[i])
+            site_table_put(new_sites, new_cap, table->sites[i]);
+    }
+
+    free(table->sites);
+    table->sites = new_sites;
+    table->sites_cap = new_cap;
+}
+
+bp_site_t *bp_site_lookup(const bp_table_t *table, uint64_t addr) {
+    if (table->num_sites == 0)
+        return NULL;
+
+    size_t slot = hash_addr(addr, table->sites_cap);
+    while (table->sites[slot] != NULL) {
+        if (table->sites[slot]->addr == addr)
+            return table->sites[slot];
+        slot = (slot + 1) & (table->sites_cap - 1);
+    }
+
+    return NULL;
+}
+
+static bp_site_t *get_or_create_site(bp_table_t *table, uint64_t addr) {
+    bp_site_t *site = bp_site_lookup(table, addr);
+    if (site)
+        return site;
+
+    // keep the load factor at or below 1/2
+    if ((table->num_sites + 1) * 2 > table->sites_cap)
+        site_table_grow(table);
+
+    site = pool_alloc(&table->site_pool);
+    site->addr = addr;
+    site_table_put(table->sites, table->sites_cap, site);
+    table->num_sites++;
+
+    return site;
+}
+
+static void queue_site(bp_table_t *table, bp_site_t *site) {
+    if (site->pending)
+        return;
+
+    if (table->num_pending == table->pending_cap) {
+        table->pending_cap = table->pending_cap ? table->pending_cap * 2 : 64;
+        table->pending = realloc(table->pending, table->pending_cap * sizeof(bp_site_t *));
+    }
+
+    site->pending = true;
+    table->pending[table->num_pending++] = site;
+}
+
+static void remove_site_from_table(bp_table_t *table, bp_site_t *site) {
+    size_t cap = table->sites_cap;
+    size_t slot = hash_addr(site->addr, cap);
+
+    while (table->sites[slot] != site)
+        slot = (slot + 1) & (cap - 1);
+    table->sites[slot] = NULL;
+
+    // backward shift the rest of the probe run so lookups never need tombstones
+    size_t next = (slot + 1) & (cap - 1);
+    while (table->sites[next] != NULL) {
+        bp_site_t *moved = table->sites[next];
+        size_t home = hash_addr(moved->addr, cap);
+        if (((next - home) & (cap - 1)) >= ((next - slot) & (cap - 1))) {
+            table->sites[slot] = moved;
+            table->sites[next] = NULL;
+            slot = next;
+        }
+        next = (next + 1) & (cap - 1);
+    }
+
+    table->num_sites--;
+
+    // an inserted trap must be restored before its shadow can go away
+    site->orphan = true;
+    if (site->inserted)
+        queue_site(table, site);
+    else if (!site->pending)
+        pool_free(&table->site_pool, site);
+}
+
+static void site_ref(bp_table_t *table, bp_site_t *site) {
+    if (site->enabled_locs++ == 0)
+        queue_site(table, site);
+}
+
+static void site_unref(bp_table_t *table, bp_site_t *site) {
+    if (--site->enabled_locs == 0)
+        queue_site(table, site);
+}
+
+static int cmp_site_addr(const void *a, const void *b) {
+    const bp_site_t *sa = *(bp_site_t * const *)a, *sb = *(bp_site_t * const *)b;
+    if (sa->addr < sb->addr) return -1;
+    if (sa->addr > sb->addr) return 1;
+    return 0;
+}
+
+static bool site_wants_trap(const bp_site_t *site) {
+    return !site->orphan && site->enabled_locs > 0;
+}
+
+// Patch all queued sites on one page with a single read and a single write.
+// Removals go first so a new site at a just freed address shadows the
+// original instruction rather than the old trap.
+static void sync_page(bp_table_t *table, bp_site_t **sites, size_t count) {
+    uint64_t lo = sites[0]->addr;
+    size_t len = sites[count - 1]->addr + sizeof(uint32_t) - lo;
+    unsigned char *buf = malloc(len);
+
+    if (read_memory_range(table->pid, lo, buf, len) != (ssize_t)len) {
+        for (size_t i = 0; i < count; ++i) {
+            if (site_wants_trap(sites[i]) != sites[i]->inserted)
+                printf("Cannot access memory for breakpoint at 0x%lx\n", sites[i]->addr);
+        }
+        free(buf);
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (sites[i]->inserted && !site_wants_trap(sites[i])) {
+            memcpy(buf + (sites[i]->addr - lo), &sites[i]->saved_insn, sizeof(uint32_t));
+            sites[i]->inserted = false;
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (!sites[i]->inserted && site_wants_trap(sites[i])) {
+            memcpy(&sites[i]->saved_insn, buf + (sites[i]->addr - lo), sizeof(uint32_t));
+            memcpy(buf + (sites[i]->addr - lo), &trap_insn, sizeof(uint32_t));
+            sites[i]->inserted = true;
+        }
+    }
+
+    if (write_text_range(table->pid, lo, buf, len) != (ssize_t)len)
+        printf("Cannot write breakpoints at 0x%lx\n", lo);
+
+    free(buf);
+}
+
+// Apply every queued insertion and removal, grouped by page.
+// Must run before the inferior resumes.
+void bp_table_sync(bp_table_t *table) {
+    static uint64_t page_mask = 0;
+
+    if (table->num_pending == 0)
+        return;
+    if (page_mask == 0)
+        page_mask = ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+
+    qsort(table->pending, table->num_pending, sizeof(bp_site_t *), cmp_site_addr);
+
+    size_t first = 0;
+    for (size_t i = 1; i <= table->num_pending; ++i) {
+        if (i == table->num_pending ||
+            (table->pending[i]->addr & page_mask) != (table->pending[first]->addr & page_mask)) {
+            sync_page(table, table->pending + first, i - first);
+            first = i;
+        }
+    }
+
+    for (size_t i = 0; i < table->num_pending; ++i) {
+        bp_site_t *site = table->pending[i];
+        site->pending = false;
+        if (site->orphan)
+            pool_free(&table->site_pool, site);
+    }
+    table->num_pending = 0;
+}
+
+static breakpoint_t *new_breakpoint(bp_table_t *table, int num, bp_kind_t kind) {
+    breakpoint_t *bp = pool_alloc(&table->bp_pool);
+
+    bp->num = num;
+    bp->kind = kind;
     bp->enabled = true;
+
+    if (table->tail)
+        table->tail->next = bp;
+    else
+        table->head = bp;
+    table->tail = bp;
+
+    return bp;
 }
 
-void disable_breakpoint(breakpoint_t *bp) {
-    // reading current data in case breakpoint has been set at next instruction
-    long prev_data = ptrace(PTRACE_PEEKDATA, bp->pid, bp->addr, NULL);
-    // data to restore is saved instruction to replace trap and current next instruction
-    long data_to_restore = ((prev_data >> 32) << 32) | bp->saved_data;
-    
-    ptrace(PTRACE_POKEDATA, bp->pid, bp->addr, data_to_restore);
+breakpoint_t *bp_create(bp_table_t *table) {
+    return new_breakpoint(table, table->next_num++, BP_USER);
+}
 
-    bp->enabled = false;
+breakpoint_t *bp_create_internal(bp_table_t *table, bp_kind_t kind) {
+    return new_breakpoint(table, table->next_internal_num--, kind);
 }
 
-breakpoint_t *new_breakpoint(pid_t pid, int active_breakpoints, uint64_t addr) {
-    breakpoint_t *new_bp = malloc(sizeof(breakpoint_t));
+bp_location_t *bp_add_location(bp_table_t *table, breakpoint_t *bp, uint64_t addr) {
+    bp_site_t *site = get_or_create_site(table, addr);
+    bp_location_t *loc = pool_alloc(&table->loc_pool);
+
+    loc->owner = bp;
+    loc->site = site;
+    loc->next_in_site = site->locs;
+    site->locs = loc;
+    loc->next_in_bp = bp->locs;
+    bp->locs = loc;
+    bp->num_locs++;
+
+    if (bp->enabled)
+        site_ref(table, site);
+
+    return loc;
+}
 
-    new_bp->pid = pid;
-    new_bp->addr = (intptr_t)addr;
-    new_bp->enabled = false;
-    new_bp->saved_data = 0;
-    new_bp->num = active_breakpoints;
+static void unlink_location(bp_table_t *table, bp_location_t *loc) {
+    bp_site_t *site = loc->site;
+    bp_location_t **link = &site->locs;
 
-    return new_bp;
-}
\ No newline at end of file
+    while (*link != loc)
+        link = &(*link)->next_in_site;
+    *link = loc->next_in_site;
+
+    if (loc->owner->enabled)
+        site_unref(table, site);
+    if (site->locs == NULL)
+        remove_site_from_table(table, site);
+
+    pool_free(&table->loc_pool, loc);
+}
+
+void bp_remove_location(bp_table_t *table, bp_location_t *loc) {
+    breakpoint_t *bp = loc->owner;
+    bp_location_t **link = &bp->locs;
+
+    while (*link != loc)
+        link = &(*link)->next_in_bp;
+    *link = loc->next_in_bp;
+    bp->num_locs--;
+
+    unlink_location(table, loc);
+}
+
+// For a location whose code is no longer mapped, e.g. in a dlclosed
+// library: there is no original instruction left to put back
+void bp_drop_location(bp_table_t *table, bp_location_t *loc) {
+    loc->site->inserted = false;
+    bp_remove_location(table, loc);
+}
+
+void bp_delete(bp_table_t *table, breakpoint_t *bp) {
+    bp_location_t *loc = bp->locs;
+    while (loc) {
+        bp_location_t *next = loc->next_in_bp;
+        unlink_location(table, loc);
+        loc = next;
+    }
+
+    breakpoint_t *prev = NULL;
+    for (breakpoint_t *it = table->head; it != bp; it = it->next)
+        prev = it;
+
+    if (prev)
+        prev->next = bp->next;
+    else
+        table->head = bp->next;
+    if (table->tail == bp)
+        table->tail = prev;
+
+    bp_set_condition(bp, NULL, NULL);
+    bp_action_free(bp->action);
+    free(bp->pending);
+    free(bp->deferred);
+    pool_free(&table->bp_pool, bp);
+}
+
+void bp_set_enabled(bp_table_t *table, breakpoint_t *bp, bool enabled) {
+    if (bp->enabled == enabled)
+        return;
+
+    bp->enabled = enabled;
+    for (bp_location_t *loc = bp->locs; loc; loc = loc->next_in_bp) {
+        if (enabled)
+            site_ref(table, loc->site);
+        else
+            site_unref(table, loc->site);
+    }
+}
+
+// Takes ownership of cond, NULL makes the breakpoint unconditional
+void bp_set_condition(breakpoint_t *bp, expr_t *cond, const char *text) {
+    expr_free(bp->cond);
+    free(bp->cond_text);
+
+    bp->cond = cond;
+    bp->cond_text = cond ? strdup(text) : NULL;
+}
+
+// Only user breakpoints can be found by number
+breakpoint_t *bp_find(const bp_table_t *table, int num) {
+    if (num <= 0)
+        return NULL;
+
+    for (breakpoint_t *bp = table->head; bp; bp = bp->next) {
+        if (bp->num == num)
+            return bp;
+    }
+
+    return NULL;
+}
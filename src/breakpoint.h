@@ -5,18 +5,108 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "pool.h"
+#include "expr.h"
+#include "trace.h"
 
+#define BP_TRAP_INSN    0xD4200000
+
+
+typedef struct breakpoint breakpoint_t;
+typedef struct bp_location bp_location_t;
+typedef struct bp_site bp_site_t;
+
+// One trap instruction in the inferior, shared by all locations at its address.
+// saved_insn shadows the original instruction while the trap is inserted.
+struct bp_site {
+    uint64_t addr;
+    bool inserted;
+    bool pending;       // queued for the next bp_table_sync
+    bool orphan;        // no locations left, freed once the trap is gone
+    uint32_t saved_insn;
+    int enabled_locs;
+    bp_location_t *locs;
+};
+
+// One address a user breakpoint is set at
+struct bp_location {
+    breakpoint_t *owner;
+    bp_site_t *site;
+    bp_location_t *next_in_site;
+    bp_location_t *next_in_bp;
+};
+
+// Internal breakpoints are set by the debugger itself, they have negative
+// numbers and are not listed or touched by the breakpoint commands
+typedef enum {
+    BP_USER,
+    BP_FTRACE_ENTRY,
+    BP_FTRACE_EXIT,
+    BP_STEP,            // temporary, set by next/step/finish/until
+    BP_SOLIB,           // the dynamic linker's _dl_debug_state
+} bp_kind_t;
+
+struct breakpoint {
+    int num;
+    bp_kind_t kind;
+    bool enabled;
+    unsigned long hit_count;
+    unsigned long ignore_count; // hits left to skip once the condition holds
+    expr_t *cond;
+    char *cond_text;
+    bp_action_t *action;        // dprintf or tracepoint, resumes after capturing
+    void *data;                 // owned by whoever set an internal breakpoint
+    char *pending;              // function to look up when a library is loaded
+    char *deferred;             // function found before the debug info index was built
+    int num_locs;
+    bp_location_t *locs;
+    breakpoint_t *next;
+};
+
+// Sites are kept in an open addressing hash table keyed by address,
+// user breakpoints in a list ordered by number. Trap insertion and
+// removal is queued and applied in bulk by bp_table_sync.
 typedef struct {
     pid_t pid;
-    intptr_t addr;
-    bool enabled;
-    uint64_t saved_data;
-    int num;
-} breakpoint_t;
 
+    bp_site_t **sites;
+    size_t num_sites;
+    size_t sites_cap;
+
+    bp_site_t **pending;
+    size_t num_pending;
+    size_t pending_cap;
+
+    breakpoint_t *head;
+    breakpoint_t *tail;
+    int next_num;
+    int next_internal_num;
+
+    pool_t bp_pool;
+    pool_t loc_pool;
+    pool_t site_pool;
+} bp_table_t;
+
+
+void bp_table_init(bp_table_t *table, pid_t pid);
+void bp_table_free(bp_table_t *table);
+void bp_table_sync(bp_table_t *table);
+void bp_table_remove_traps(bp_table_t *table);
+void bp_table_restore_text(const bp_table_t *table, pid_t pid);
+
+breakpoint_t *bp_create(bp_table_t *table);
+breakpoint_t *bp_create_internal(bp_table_t *table, bp_kind_t kind);
+bp_location_t *bp_add_location(bp_table_t *table, breakpoint_t *bp, uint64_t addr);
+void bp_remove_location(bp_table_t *table, bp_location_t *loc);
+void bp_drop_location(bp_table_t *table, bp_location_t *loc);
+void bp_delete(bp_table_t *table, breakpoint_t *bp);
+void bp_set_enabled(bp_table_t *table, breakpoint_t *bp, bool enabled);
+void bp_set_condition(breakpoint_t *bp, expr_t *cond, const char *text);
+
+breakpoint_t *bp_find(const bp_table_t *table, int num);
+bp_site_t *bp_site_lookup(const bp_table_t *table, uint64_t addr);
 
-void enable_breakpoint(breakpoint_t *bp);
-void disable_breakpoint(breakpoint_t *bp);
-breakpoint_t *new_breakpoint(pid_t pid, int active_breakpoints, uint64_t addr);
+void insert_bp_site(pid_t pid, bp_site_t *site);
+void remove_bp_site(pid_t pid, bp_site_t *site);
 
 #endif
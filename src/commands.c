@@ -5,20 +5,67 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
 
 #include "debugger.h"
 #include "commands.h"
 #include "registers.h"
 #include "utils.h"
 #include "dbg_dwarf.h"
+#include "trace.h"
+#include "record.h"
+#include "step.h"
+#include "inferior.h"
 
 
-static bool handle_continue_command(dbg_ctx *ctx) {
+// "continue &" leaves the prompt up while the inferior runs
+static bool handle_continue_command(dbg_ctx *ctx, const char *arg) {
+    if (ctx->thread->state == THREAD_RUNNING) {
+        printf("The program is already running.\n");
+        return true;
+    }
+
     printf("Continuing...\n");
-    return continue_execution(ctx);
+    if (!resume_execution(ctx))
+        return false;
+    ctx->foreground = arg == NULL || strcmp(arg, "&") != 0;
+    return true;
+}
+
+// Commands that need the selected thread's registers or run it themselves
+static bool selected_thread_stopped(dbg_ctx *ctx) {
+    if (ctx->thread->state == THREAD_STOPPED)
+        return true;
+    printf("Cannot execute this command while the selected thread is running.\n");
+    return false;
+}
+
+// Text after a standalone "if" token, e.g. "b main if x0 == 3"
+static const char *find_condition(const char *command)
+{
+    for (const char *p = command; (p = strstr(p, "if")) != NULL; p += 2)
+    {
+        if (p > command && isspace(p[-1]) && (p[2] == '\0' || isspace(p[2])))
+        {
+            p += 2;
+            while (isspace(*p))
+                p++;
+            return p;
+        }
+    }
+    return NULL;
 }
 
-static void handle_breakpoint_command(dbg_ctx *ctx, const char *loc)
+// breakpoint can be specified by function symbol or address (prefixed with *)
+static breakpoint_t *set_bp_at_loc(dbg_ctx *ctx, const char *loc)
+{
+    if (is_symbol(loc))
+        return set_bp_at_func(ctx, loc);
+    return set_bp_at_addr(ctx, convert_val_radix(loc + 1));
+}
+
+static void handle_breakpoint_command(dbg_ctx *ctx, const char *loc, const char *cond)
 {
     // If no address is specified, list currently active breakpoints
     if (!loc) {
@@ -26,15 +73,197 @@ static void handle_breakpoint_command(dbg_ctx *ctx, const char *loc)
         return;
     }
 
-    // breakpoint can be specified by function symbol or address (prefixed with *)
-    if (is_symbol(loc))
-        set_bp_at_func(ctx, loc);
-    else {
-        set_bp_at_addr(ctx, convert_val_radix(loc + 1));
+    breakpoint_t *bp = set_bp_at_loc(ctx, loc);
+
+    // a bad condition does not leave an unconditional breakpoint behind
+    if (bp && cond && !set_bp_condition(bp, cond))
+        bp_delete(&ctx->breakpoints, bp);
+}
+
+// Text after the first n words of the command
+static const char *skip_words(const char *command, int n)
+{
+    const char *p = command;
+    for (int word = 0; word < n; ++word)
+    {
+        while (*p && !isspace(*p))
+            p++;
+        while (isspace(*p))
+            p++;
+    }
+    return p;
+}
+
+// Run one command in every inferior in turn, e.g. to arm the same
+// tracepoint across the worker processes of a service
+static bool apply_all_inferiors(dbg_ctx *ctx, const char *command) {
+    inferior_table_t *table = ctx->inferiors;
+    dbg_ctx *current = table->current;
+    bool ret = true;
+
+    for (size_t i = 0; i < table->num_inferiors && ret; ++i) {
+        char *line = strdup(command);
+        table->current = table->inferiors[i];
+        printf("\nInferior %d (process %d):\n", table->current->num, table->current->pid);
+        ret = handle_command(table->current, line);
+        free(line);
+    }
+
+    table->current = current;
+    return ret;
+}
+
+static bool handle_inferior_command(dbg_ctx *ctx, char **args, const char *command) {
+    if (args[1] && strcmp(args[1], "add") == 0)
+        add_inferior(ctx->inferiors, args + 2);
+    else if (args[1] && strcmp(args[1], "apply") == 0 && args[2] && strcmp(args[2], "all") == 0)
+        return apply_all_inferiors(ctx, skip_words(command, 3));
+    else
+        select_inferior(ctx->inferiors, args[1]);
+    return true;
+}
+
+static void attach_action(dbg_ctx *ctx, const char *loc, bp_action_t *action)
+{
+    breakpoint_t *bp = set_bp_at_loc(ctx, loc);
+    if (bp == NULL)
+    {
+        bp_action_free(action);
+        return;
+    }
+    bp->action = action;
+}
+
+static void handle_ftrace_command(dbg_ctx *ctx, char **args)
+{
+    if (args[1] == NULL)
+    {
+        printf("Usage: ftrace <regex>|report|stop|json <file>\n");
+        return;
+    }
+
+    if (strcmp(args[1], "report") == 0)
+        ftrace_report(&ctx->ftrace);
+    else if (strcmp(args[1], "stop") == 0)
+    {
+        ftrace_report(&ctx->ftrace);
+        ftrace_stop(&ctx->ftrace, &ctx->breakpoints);
+    }
+    else if (strcmp(args[1], "json") == 0)
+    {
+        if (args[2] == NULL)
+            printf("Usage: ftrace json <file>\n");
+        else if (ftrace_set_json(&ctx->ftrace, args[2]))
+            printf("Writing trace events to %s\n", args[2]);
+    }
+    else
+        ftrace_functions(ctx, args[1]);
+}
+
+static void handle_dprintf_command(dbg_ctx *ctx, const char *loc, const char *command)
+{
+    if (loc == NULL)
+    {
+        printf("Usage: dprintf <location> \"format\", args...\n");
+        return;
+    }
+
+    const char *error;
+    bp_action_t *action = parse_dprintf_action(skip_words(command, 2), &error);
+    if (action == NULL)
+    {
+        printf("Invalid dprintf: %s\n", error);
+        return;
+    }
+    attach_action(ctx, loc, action);
+}
+
+static void handle_trace_command(dbg_ctx *ctx, char **args, const char *command)
+{
+    if (args[1] != NULL && strcmp(args[1], "output") == 0)
+    {
+        if (trace_set_output(args[2]))
+            printf("Trace output to %s\n", args[2] ? args[2] : "stdout");
+        return;
+    }
+    if (args[1] != NULL && strcmp(args[1], "dump") == 0)
+    {
+        record_dump(ctx, args[2] ? strtoul(args[2], NULL, 10) : 0);
+        return;
+    }
+    if (args[1] != NULL && strcmp(args[1], "stats") == 0)
+    {
+        record_stats(ctx);
+        return;
+    }
+
+    if (args[1] == NULL || args[2] == NULL || !is_prefix(args[2], "collect"))
+    {
+        printf("Usage: trace <location> collect x0, *(sp+16)@32, ...\n");
+        printf("       trace output [file]\n");
+        printf("       trace dump [N]|stats\n");
+        return;
+    }
+
+    const char *error;
+    bp_action_t *action = parse_collect_action(skip_words(command, 3), &error);
+    if (action == NULL)
+    {
+        printf("Invalid tracepoint: %s\n", error);
+        return;
+    }
+    attach_action(ctx, args[1], action);
+}
+
+// record [N|until <location>] [regs], record file <path>
+static bool handle_record_command(dbg_ctx *ctx, char **args)
+{
+    uint64_t max_steps = 0, until_addr = 0;
+    bool with_regs = false;
+
+    if (args[1] != NULL && strcmp(args[1], "file") == 0)
+    {
+        if (args[2] == NULL)
+            printf("Usage: record file <path>\n");
+        else
+            record_set_path(args[2]);
+        return true;
+    }
+
+    for (int i = 1; args[i] != NULL; ++i)
+    {
+        if (strcmp(args[i], "regs") == 0)
+            with_regs = true;
+        else if (strcmp(args[i], "until") == 0 && args[i + 1] != NULL)
+        {
+            const char *loc = args[++i];
+            if (is_symbol(loc))
+            {
+                Dwarf_Addr addr = get_func_addr(ctx, loc);
+                if (addr == 0)
+                {
+                    printf("Function %s not found\n", loc);
+                    return true;
+                }
+                until_addr = add_load_addr(ctx, addr);
+            }
+            else
+                until_addr = convert_val_radix(loc + 1);
+        }
+        else if (isdigit(args[i][0]))
+            max_steps = strtoull(args[i], NULL, 10);
+        else
+        {
+            printf("Usage: record [N|until <location>] [regs]\n");
+            printf("       record file <path>\n");
+            return true;
+        }
     }
+
+    return record_execution(ctx, max_steps, until_addr, with_regs);
 }
 
-static void handle_register_command(const pid_t pid,
+static void handle_register_command(reg_cache_t *regs,
                                     const char *action,
                                     const char *reg_name,
                                     const char *val)
@@ -47,7 +276,7 @@ static void handle_register_command(const pid_t pid,
 
     if (is_prefix(action, "dump"))
     {
-        dump_registers(pid);
+        dump_registers(regs);
         return;
     }
 
@@ -65,7 +294,7 @@ static void handle_register_command(const pid_t pid,
     }
     if (is_prefix(action, "read"))
     {
-        uint64_t reg_val = get_register_value(pid, regnum);
+        uint64_t reg_val = get_register_value(regs, regnum);
         printf("$%d = %lu\n", regnum, reg_val);
     }
     else if (is_prefix(action, "write"))
@@ -75,7 +304,7 @@ static void handle_register_command(const pid_t pid,
             printf("Register value needed for write operation\n");
             return;
         }
-        set_register_value(pid, regnum, convert_val_radix(val));
+        set_register_value(regs, regnum, convert_val_radix(val));
         printf("$%d = %s\n", regnum, val);
     }
 }
@@ -95,7 +324,19 @@ void handle_memory_command(const pid_t pid,
     uint64_t addr = strtoul(address, NULL, 16);
     if (is_prefix(action, "read"))
     {
-        long mem_val = read_memory(pid, addr);
+        // with a length, hexdump the whole range
+        if (val != NULL)
+        {
+            hexdump_memory(pid, addr, strtoul(val, NULL, 0));
+            return;
+        }
+
+        long mem_val;
+        if (read_memory_range(pid, addr, &mem_val, sizeof(mem_val)) != sizeof(mem_val))
+        {
+            printf("Error: cannot access memory at 0x%lx\n", addr);
+            return;
+        }
         printf("%ld\n", mem_val);
     }
     else if (is_prefix(action, "write"))
@@ -106,13 +347,31 @@ void handle_memory_command(const pid_t pid,
             return;
         }
         uint64_t write_val = convert_val_radix(val);
-        write_memory(pid, addr, write_val);
+        if (write_memory_range(pid, addr, &write_val, sizeof(write_val)) != sizeof(write_val))
+        {
+            printf("Error: cannot access memory at 0x%lx\n", addr);
+            return;
+        }
         printf("*%s = %s\n", address, val);
     }
 }
 
+static void handle_dump_command(const pid_t pid, char **args)
+{
+    if (args[1] == NULL || !is_prefix(args[1], "memory") ||
+        args[2] == NULL || args[3] == NULL || args[4] == NULL)
+    {
+        printf("Usage: dump memory <file> <start> <end>\n");
+        return;
+    }
+
+    dump_memory_to_file(pid, args[2], strtoul(args[3], NULL, 16), strtoul(args[4], NULL, 16));
+}
+
 bool handle_command(dbg_ctx *ctx, char *command)
 {
+    resolve_indexed_breakpoints(ctx);
+
     // remove leading and trailing whitespace
     trim_ends(&command);
 
@@ -125,22 +384,121 @@ bool handle_command(dbg_ctx *ctx, char *command)
 
     if (is_prefix(cmd, "continue"))
     {
-        ret = handle_continue_command(ctx);
+        ret = handle_continue_command(ctx, args[1]);
     }
+
     else if (is_prefix(cmd, "breakpoint"))
     {
-        handle_breakpoint_command(ctx, args[1]);
+        handle_breakpoint_command(ctx, args[1], find_condition(command));
     }
     else if (is_prefix(cmd, "register"))
     {
-        handle_register_command(ctx->pid, args[1], args[2], args[3]);
+        if (selected_thread_stopped(ctx))
+            handle_register_command(&ctx->thread->regs, args[1], args[2], args[3]);
+    }
+    else if (is_prefix(cmd, "record"))
+    {
+        if (selected_thread_stopped(ctx))
+            ret = handle_record_command(ctx, args);
     }
     else if (is_prefix(cmd, "memory"))
     {
         handle_memory_command(ctx->pid, args[1], args[2], args[3]);
     }
+    else if (is_prefix(cmd, "delete")) {
+        delete_breakpoints(ctx, args[1]);
+    }
+    else if (is_prefix(cmd, "disable")) {
+        disable_breakpoints(ctx, args[1]);
+    }
+    else if (is_prefix(cmd, "enable")) {
+        enable_breakpoints(ctx, args[1]);
+    }
+    else if (is_prefix(cmd, "condition")) {
+        condition_breakpoint(ctx, args[1], skip_words(command, 2));
+    }
+    else if (is_prefix(cmd, "ignore")) {
+        ignore_breakpoint(ctx, args[1], args[2]);
+    }
+    else if (is_prefix(cmd, "watch")) {
+        if (args[1] == NULL)
+            list_watchpoints(ctx);
+        else if (!is_symbol(args[1]) && args[2] == NULL)
+            printf("Usage: watch <variable> [len] | watch *<addr> <len>\n");
+        else
+            set_watchpoint(ctx, args[1], args[2]);
+    }
+    else if (is_prefix(cmd, "info") && args[1] && is_prefix(args[1], "sharedlibrary")) {
+        list_solibs(ctx);
+    }
+    else if (is_prefix(cmd, "info") && args[1] && is_prefix(args[1], "threads")) {
+        list_threads(ctx);
+    }
+    else if (is_prefix(cmd, "info") && args[1] && is_prefix(args[1], "inferiors")) {
+        list_inferiors(ctx->inferiors);
+    }
+    else if (is_prefix(cmd, "inferior")) {
+        ret = handle_inferior_command(ctx, args, command);
+    }
+    else if (is_prefix(cmd, "detach")) {
+        detach_inferior(ctx);
+    }
+    else if (is_prefix(cmd, "interrupt")) {
+        interrupt_inferior(ctx);
+    }
+    else if (is_prefix(cmd, "dprintf")) {
+        handle_dprintf_command(ctx, args[1], command);
+    }
+    else if (is_prefix(cmd, "ftrace")) {
+        handle_ftrace_command(ctx, args);
+    }
+    else if (is_prefix(cmd, "trace")) {
+        handle_trace_command(ctx, args, command);
+    }
+    else if (is_prefix(cmd, "thread")) {
+        select_thread(ctx, args[1]);
+    }
+    else if (is_prefix(cmd, "set") && args[1] && strcmp(args[1], "non-stop") == 0) {
+        if (args[2] && (strcmp(args[2], "on") == 0 || strcmp(args[2], "off") == 0))
+            set_non_stop(ctx, strcmp(args[2], "on") == 0);
+        else
+            printf("Usage: set non-stop on|off\n");
+    }
+    else if (is_prefix(cmd, "dump")) {
+        handle_dump_command(ctx->pid, args);
+    }
+    else if (is_prefix(cmd, "list")) {
+        list_source(ctx, args[1] ? strtoul(args[1], NULL, 10) : 0);
+    }
+    else if (is_prefix(cmd, "backtrace") || strcmp(cmd, "bt") == 0) {
+        if (selected_thread_stopped(ctx))
+            print_backtrace(ctx, args[1] ? strtoul(args[1], NULL, 10) : 0);
+    }
+    else if (is_prefix(cmd, "next")) {
+        if (selected_thread_stopped(ctx))
+            ret = step_source(ctx, STEP_OVER);
+    }
+    else if (is_prefix(cmd, "step")) {
+        if (selected_thread_stopped(ctx))
+            ret = step_source(ctx, STEP_INTO);
+    }
+    else if (is_prefix(cmd, "finish")) {
+        if (selected_thread_stopped(ctx))
+            ret = finish_frame(ctx);
+    }
+    else if (is_prefix(cmd, "until")) {
+        if (selected_thread_stopped(ctx))
+            ret = args[1] ? advance_to(ctx, args[1], true) : step_source(ctx, STEP_UNTIL);
+    }
+    else if (is_prefix(cmd, "advance")) {
+        if (args[1] == NULL)
+            printf("Usage: advance <location>\n");
+        else if (selected_thread_stopped(ctx))
+            ret = advance_to(ctx, args[1], false);
+    }
     else if (is_prefix(cmd, "si")) {
-        single_step(ctx);
+        if (selected_thread_stopped(ctx))
+            single_step(ctx);
     }
     else if (is_prefix(cmd, "quit")) {
         ret = false;
@@ -152,5 +510,9 @@ bool handle_command(dbg_ctx *ctx, char *command)
 
     free_args(args);
 
+    // running threads are not resumed again to pick up breakpoint changes
+    if (ret)
+        bp_table_sync(&ctx->breakpoints);
+
     return ret;
 }
\ No newline at end of file
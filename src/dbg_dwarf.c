@@ -5,6 +5,9 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
 
 #include "dbg_dwarf.h"
 #include "utils.h"
@@ -35,158 +38,449 @@ void dwarf_init(Dwarf_Debug *dbg, const char *program_name) {
     }
 }
 
-static bool pc_in_die(Dwarf_Die die, Dwarf_Addr pc) {
-    int ret;
-    Dwarf_Addr cu_lowpc, cu_highpc;
+static bool get_die_pc_range(Dwarf_Die die, Dwarf_Addr *low_pc, Dwarf_Addr *high_pc) {
     enum Dwarf_Form_Class highpc_cls;
-    Dwarf_Error err;
 
-    ret = dwarf_lowpc(die, &cu_lowpc, &err);
-    if (ret == DW_DLV_OK) {
-        if (pc == cu_lowpc) {
-            return true;
+    if (dwarf_lowpc(die, low_pc, NULL) != DW_DLV_OK)
+        return false;
+    if (dwarf_highpc_b(die, high_pc, NULL, &highpc_cls, NULL) != DW_DLV_OK)
+        return false;
+    if (highpc_cls == DW_FORM_CLASS_CONSTANT)
+        *high_pc += *low_pc;
+
+    return true;
+}
+
+// Out of line and inlined instances carry their name on the abstract
+// origin, C++ definitions on the declaration they specify
+static bool get_die_name(Dwarf_Debug dbg, Dwarf_Die die, char **name) {
+    static const Dwarf_Half ref_attrs[] = { DW_AT_abstract_origin, DW_AT_specification };
+    Dwarf_Attribute attr;
+    Dwarf_Off ref_off;
+    Dwarf_Die ref_die;
+    bool found = false;
+
+    if (dwarf_diename(die, name, NULL) == DW_DLV_OK)
+        return true;
+
+    for (size_t i = 0; i < sizeof(ref_attrs) / sizeof(ref_attrs[0]) && !found; ++i) {
+        if (dwarf_attr(die, ref_attrs[i], &attr, NULL) != DW_DLV_OK)
+            continue;
+        if (dwarf_global_formref(attr, &ref_off, NULL) == DW_DLV_OK &&
+            dwarf_offdie_b(dbg, ref_off, 1, &ref_die, NULL) == DW_DLV_OK) {
+            found = get_die_name(dbg, ref_die, name);
+            dwarf_dealloc(dbg, ref_die, DW_DLA_DIE);
+        }
+        dwarf_dealloc(dbg, attr, DW_DLA_ATTR);
+    }
+
+    return found;
+}
+
+// Per-thread indexing state. Each worker owns its Dwarf_Debug, libdwarf
+// handles are not safe to share between threads.
+typedef struct {
+    Dwarf_Debug dwarf;
+    Dwarf_Addr cu_base;         // DW_AT_low_pc of the CU being indexed
+    func_index_t funcs;
+    func_index_t inlines;
+} index_worker_t;
+
+typedef struct {
+    Dwarf_Off *cu_offsets;
+    cu_range_t *cu_ranges;      // one per CU, written only by the worker that took it
+    cu_lines_t *lines;          // likewise, when the line programs are decoded up front
+    size_t num_cus;
+    size_t next_cu;             // shared, claimed with an atomic increment
+} index_job_t;
+
+typedef struct {
+    index_job_t *job;
+    index_worker_t *worker;
+} index_arg_t;
+
+typedef struct {
+    Dwarf_Addr low_pc;
+    Dwarf_Addr high_pc;
+} pc_range_t;
+
+typedef struct {
+    pc_range_t *ranges;
+    size_t num_ranges;
+    size_t cap;
+} pc_ranges_t;
+
+static void add_range(pc_ranges_t *list, Dwarf_Addr lo, Dwarf_Addr hi) {
+    if (lo >= hi)
+        return;
+    if (list->num_ranges == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 4;
+        list->ranges = realloc(list->ranges, list->cap * sizeof(pc_range_t));
+    }
+    list->ranges[list->num_ranges++] = (pc_range_t){ lo, hi };
+}
+
+// Code split into several pieces, e.g. hot and cold parts, is described
+// by DW_AT_ranges instead of a low and high pc. DWARF 5 keeps the lists
+// in .debug_rnglists, older versions in .debug_ranges relative to the CU
+// base address.
+static void get_die_ranges(index_worker_t *worker, Dwarf_Die die, pc_ranges_t *list) {
+    Dwarf_Attribute attr;
+    Dwarf_Half version, offset_size, form;
+    Dwarf_Addr low_pc, high_pc;
+
+    if (get_die_pc_range(die, &low_pc, &high_pc)) {
+        add_range(list, low_pc, high_pc);
+        return;
+    }
+    if (dwarf_attr(die, DW_AT_ranges, &attr, NULL) != DW_DLV_OK)
+        return;
+
+    if (dwarf_get_version_of_die(die, &version, &offset_size) == DW_DLV_OK && version >= 5) {
+        Dwarf_Rnglists_Head head;
+        Dwarf_Unsigned val, count, set_off;
+        Dwarf_Off off;
+        int res = DW_DLV_ERROR;
+
+        if (dwarf_whatform(attr, &form, NULL) == DW_DLV_OK) {
+            if (form == DW_FORM_rnglistx)
+                res = dwarf_formudata(attr, &val, NULL);
+            else if ((res = dwarf_global_formref(attr, &off, NULL)) == DW_DLV_OK)
+                val = off;
         }
-        ret = dwarf_highpc_b(die, &cu_highpc, NULL, &highpc_cls, &err);
-        if (ret == DW_DLV_OK) {
-            if (highpc_cls == DW_FORM_CLASS_CONSTANT) {
-                cu_highpc += cu_lowpc;
+
+        if (res == DW_DLV_OK &&
+            dwarf_rnglists_get_rle_head(attr, form, val, &head, &count, &set_off, NULL) == DW_DLV_OK) {
+            for (Dwarf_Unsigned i = 0; i < count; ++i) {
+                unsigned entry_len, code;
+                Dwarf_Unsigned raw1, raw2, lo, hi;
+                Dwarf_Bool unavailable;
+
+                if (dwarf_get_rnglists_entry_fields_a(head, i, &entry_len, &code, &raw1, &raw2,
+                                                      &unavailable, &lo, &hi, NULL) != DW_DLV_OK ||
+                    unavailable || code == DW_RLE_end_of_list ||
+                    code == DW_RLE_base_address || code == DW_RLE_base_addressx)
+                    continue;
+                add_range(list, lo, hi);
             }
-            if (pc >= cu_lowpc && pc < cu_highpc) {
-                return true;
+            dwarf_dealloc_rnglists_head(head);
+        }
+    }
+    else {
+        Dwarf_Off off, actual_off;
+        Dwarf_Ranges *ranges;
+        Dwarf_Signed count;
+        Dwarf_Unsigned bytes;
+        Dwarf_Addr base = worker->cu_base;
+
+        if (dwarf_global_formref(attr, &off, NULL) == DW_DLV_OK &&
+            dwarf_get_ranges_b(worker->dwarf, off, die, &actual_off, &ranges, &count, &bytes, NULL) == DW_DLV_OK) {
+            for (Dwarf_Signed i = 0; i < count && ranges[i].dwr_type != DW_RANGES_END; ++i) {
+                if (ranges[i].dwr_type == DW_RANGES_ADDRESS_SELECTION)
+                    base = ranges[i].dwr_addr2;
+                else
+                    add_range(list, base + ranges[i].dwr_addr1, base + ranges[i].dwr_addr2);
             }
+            dwarf_dealloc_ranges(worker->dwarf, ranges, count);
         }
     }
-    return false;
+
+    dwarf_dealloc(worker->dwarf, attr, DW_DLA_ATTR);
+}
+
+static bool is_constant_form(Dwarf_Half form) {
+    switch (form) {
+        case DW_FORM_data1:
+        case DW_FORM_data2:
+        case DW_FORM_data4:
+        case DW_FORM_data8:
+        case DW_FORM_udata:
+        case DW_FORM_sdata:
+        case DW_FORM_implicit_const:
+            return true;
+        default:
+            return false;
+    }
 }
 
-static bool cmp_die_subprog_name(Dwarf_Die subprogram, const char *symbol) {
-    char *subprogram_name;
-    if (dwarf_diename(subprogram, &subprogram_name, NULL) == DW_DLV_OK) {
-        if (strncmp(subprogram_name, symbol, strlen(symbol)) == 0) {
-           return true;
+// The piece of a DIE's code holding its entry, and the entry itself (0
+// if the DIE has none). DW_AT_entry_pc is an address, or in DWARF 5 a
+// constant offset from the DIE's lowest address; without it the entry
+// is taken to be in the first range listed.
+static bool get_die_entry_range(index_worker_t *worker, Dwarf_Die die, Dwarf_Addr *entry_pc,
+                                Dwarf_Addr *low_pc, Dwarf_Addr *high_pc) {
+    Dwarf_Attribute attr;
+    Dwarf_Half form;
+    Dwarf_Unsigned offset = 0;
+    bool is_offset = false;
+    pc_ranges_t list = {};
+
+    *entry_pc = 0;
+    if (dwarf_attr(die, DW_AT_entry_pc, &attr, NULL) == DW_DLV_OK) {
+        if (dwarf_whatform(attr, &form, NULL) == DW_DLV_OK && is_constant_form(form) &&
+            dwarf_formudata(attr, &offset, NULL) == DW_DLV_OK)
+            is_offset = true;
+        else
+            dwarf_formaddr(attr, entry_pc, NULL);
+        dwarf_dealloc(worker->dwarf, attr, DW_DLA_ATTR);
+    }
+
+    get_die_ranges(worker, die, &list);
+    if (list.num_ranges == 0) {
+        free(list.ranges);
+        return false;
+    }
+
+    if (is_offset) {
+        Dwarf_Addr lowest = list.ranges[0].low_pc;
+        for (size_t i = 1; i < list.num_ranges; ++i) {
+            if (list.ranges[i].low_pc < lowest)
+                lowest = list.ranges[i].low_pc;
+        }
+        *entry_pc = lowest + offset;
+    }
+
+    const pc_range_t *entry = &list.ranges[0];
+    for (size_t i = 0; i < list.num_ranges; ++i) {
+        if (*entry_pc >= list.ranges[i].low_pc && *entry_pc < list.ranges[i].high_pc) {
+            entry = &list.ranges[i];
+            break;
         }
     }
+    *low_pc = entry->low_pc;
+    *high_pc = entry->high_pc;
+
+    free(list.ranges);
+    return true;
+}
+
+static void index_subprog_die(index_worker_t *worker, Dwarf_Die die, uint32_t cu) {
+    char *name;
+    Dwarf_Addr entry_pc, low_pc, high_pc;
+
+    // declarations and inlined-only instances have no code of their own
+    if (!get_die_entry_range(worker, die, &entry_pc, &low_pc, &high_pc))
+        return;
+    if (!get_die_name(worker->dwarf, die, &name))
+        return;
+
+    func_index_add(&worker->funcs, name, cu, low_pc, high_pc);
+}
+
+static void index_inlined_die(index_worker_t *worker, Dwarf_Die die, uint32_t cu) {
+    char *name;
+    Dwarf_Addr entry_pc, low_pc, high_pc = 0;
 
-    return false;
+    if (get_die_entry_range(worker, die, &entry_pc, &low_pc, &high_pc) && entry_pc == 0)
+        entry_pc = low_pc;
+
+    if (entry_pc == 0 || !get_die_name(worker->dwarf, die, &name))
+        return;
+
+    func_index_add(&worker->inlines, name, cu, entry_pc, high_pc > entry_pc ? high_pc : entry_pc);
 }
 
-// If symbol is NULL, get subprogram die based on PC
-// Else, get subprogram die based on symbol
-static Dwarf_Die find_subprog_die(dbg_ctx *ctx, Dwarf_Die die, Dwarf_Bool is_info, const char *symbol, uint64_t pc) {
-    static Dwarf_Die ret_die = NULL;
+static void index_die_children(index_worker_t *worker, Dwarf_Die parent, Dwarf_Bool is_info, uint32_t cu) {
     Dwarf_Die child_die, sibling_die;
     Dwarf_Half tag;
     int ret;
 
-    if (dwarf_tag(die, &tag, NULL) != DW_DLV_OK) {
-        printf("Error in dwarf_tag\n");
+    ret = dwarf_child(parent, &child_die, NULL);
+    if (ret == DW_DLV_ERROR) {
+        printf("Error in dwarf_child\n");
         exit(1);
     }
-    if (tag == DW_TAG_subprogram) {
-        if (symbol != NULL && cmp_die_subprog_name(die, symbol)) {
-            ret_die = die;
-            return ret_die;
+
+    while (ret == DW_DLV_OK) {
+        if (dwarf_tag(child_die, &tag, NULL) != DW_DLV_OK) {
+            printf("Error in dwarf_tag\n");
+            exit(1);
         }
-        else if (pc_in_die(die, pc)) {
-            ret_die = die;
-            return ret_die;
+        if (tag == DW_TAG_subprogram)
+            index_subprog_die(worker, child_die, cu);
+        else if (tag == DW_TAG_inlined_subroutine)
+            index_inlined_die(worker, child_die, cu);
+
+        index_die_children(worker, child_die, is_info, cu);
+
+        ret = dwarf_siblingof_b(worker->dwarf, child_die, is_info, &sibling_die, NULL);
+        if (ret == DW_DLV_ERROR) {
+            printf("Error in dwarf_siblingof_b\n");
+            exit(1);
         }
-    } 
+        dwarf_dealloc(worker->dwarf, child_die, DW_DLA_DIE);
+        child_die = sibling_die;
+    }
+}
 
-    ret = dwarf_child(die, &child_die, NULL);
-    if (ret == DW_DLV_ERROR) {
-        printf("Error in dwarf_child\n");
-        exit(1);
+static void decode_cu_files(Dwarf_Debug dbg, Dwarf_Die cu_die, cu_lines_t *cu, Dwarf_Unsigned line_version) {
+    char **src_files;
+    Dwarf_Signed filecount = 0;
+    size_t strtab_size = 0;
+
+    if (dwarf_srcfiles(cu_die, &src_files, &filecount, NULL) != DW_DLV_OK)
+        return;
+
+    for (Dwarf_Signed i = 0; i < filecount; ++i)
+        strtab_size += strlen(src_files[i]) + 1;
+
+    cu->files = malloc(filecount * sizeof(uint32_t));
+    cu->strtab = malloc(strtab_size);
+    cu->num_files = filecount;
+
+    size_t off = 0;
+    for (Dwarf_Signed i = 0; i < filecount; ++i) {
+        size_t len = strlen(src_files[i]) + 1;
+        memcpy(cu->strtab + off, src_files[i], len);
+        cu->files[i] = off;
+        off += len;
+        dwarf_dealloc(dbg, src_files[i], DW_DLA_STRING);
     }
-    else if (ret == DW_DLV_OK) {
-        find_subprog_die(ctx, child_die, is_info, symbol, pc);
-        if (ret_die && ret_die != child_die)
-            dwarf_dealloc(ctx->dwarf, child_die, DW_DLA_DIE);
+    dwarf_dealloc(dbg, src_files, DW_DLA_LIST);
+
+    // DWARF 5 numbers files from 0, earlier versions from 1
+    if (line_version < 5) {
+        for (size_t i = 0; i < cu->num_lines; ++i) {
+            if (cu->lines[i].file > 0)
+                cu->lines[i].file--;
+        }
     }
+}
 
-    ret = dwarf_siblingof_b(ctx->dwarf, die, is_info, &sibling_die, NULL);
-    if (ret == DW_DLV_ERROR) {
-        printf("Error in dwarf_siblingof_b\n");
-        exit(1);
+static void decode_cu_lines(Dwarf_Debug dbg, cu_lines_t *cu) {
+    Dwarf_Die cu_die = 0;
+    Dwarf_Unsigned version_out = 0;
+    Dwarf_Small is_single_table = 0;
+    Dwarf_Line_Context context_out = 0;
+    Dwarf_Error err = 0;
+    Dwarf_Line *linebuf = 0;
+    Dwarf_Signed linecount = 0;
+
+    cu->decoded = true;
+
+    if (dwarf_offdie_b(dbg, cu->die_offset, 1, &cu_die, &err) != DW_DLV_OK) {
+        printf("Error in dwarf_offdie_b\n");
+        return;
+    }
+
+    if (dwarf_srclines_b(cu_die, &version_out, &is_single_table, &context_out, &err) != DW_DLV_OK) {
+        dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+        return;
     }
-    else if (ret == DW_DLV_OK) {
-        find_subprog_die(ctx, sibling_die, is_info, symbol, pc);
-        if (ret_die && ret_die != sibling_die)
-            dwarf_dealloc(ctx->dwarf, sibling_die, DW_DLA_DIE);
+
+    if (dwarf_srclines_from_linecontext(context_out, &linebuf, &linecount, &err) == DW_DLV_OK) {
+        cu->lines = malloc(linecount * sizeof(line_entry_t));
+
+        for (Dwarf_Signed i = 0; i < linecount; ++i) {
+            Dwarf_Addr lineaddr = 0;
+            Dwarf_Unsigned lineno = 0, fileno = 0, isa, discriminator;
+            Dwarf_Bool is_stmt = 0, end_sequence = 0, prologue_end = 0, epilogue_begin;
+
+            if (dwarf_lineaddr(linebuf[i], &lineaddr, &err) != DW_DLV_OK)
+                continue;
+            dwarf_lineno(linebuf[i], &lineno, &err);
+            dwarf_line_srcfileno(linebuf[i], &fileno, &err);
+            dwarf_linebeginstatement(linebuf[i], &is_stmt, &err);
+            dwarf_lineendsequence(linebuf[i], &end_sequence, &err);
+            dwarf_prologue_end_etc(linebuf[i], &prologue_end, &epilogue_begin, &isa, &discriminator, &err);
+
+            line_entry_t *line = &cu->lines[cu->num_lines++];
+            line->addr = lineaddr;
+            line->line = lineno;
+            line->file = fileno;
+            line->flags = (is_stmt ? LINE_IS_STMT : 0) |
+                          (prologue_end ? LINE_PROLOGUE_END : 0) |
+                          (end_sequence ? LINE_END_SEQUENCE : 0);
+        }
+
+        cu_lines_sort(cu);
     }
-    
-    return ret_die;
-}
 
+    decode_cu_files(dbg, cu_die, cu, version_out);
 
-static Dwarf_Die get_subprog_die_cu(dbg_ctx *ctx, const char *symbol, uint64_t pc) {
-    int res;
+    dwarf_srclines_dealloc_b(context_out);
+    dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+}
+
+static void index_cu(index_worker_t *worker, index_job_t *job, uint32_t cu) {
     Dwarf_Bool is_info = 1;
-    Dwarf_Unsigned cu_hdr_len = 0;
-    Dwarf_Half version_stamp = 0;
-    Dwarf_Off abbrev_offset = 0;
-    Dwarf_Half address_size = 0;
-    Dwarf_Unsigned next_cu_header = 0;
+    Dwarf_Die cu_die;
     Dwarf_Error err = 0;
-    
-    Dwarf_Die subprog_die;
 
-    while (1) {
-        Dwarf_Die no_die = 0;
-        Dwarf_Die cu_die = 0;
+    if (dwarf_offdie_b(worker->dwarf, job->cu_offsets[cu], is_info, &cu_die, &err) != DW_DLV_OK) {
+        char *em = err ? dwarf_errmsg(err) : "unknown error";
+        printf("Error in dwarf_offdie_b: %s\n", em);
+        exit(EXIT_FAILURE);
+    }
 
-        res = dwarf_next_cu_header_d(ctx->dwarf,
-                is_info,
-                &cu_hdr_len,
-                &version_stamp,
-                &abbrev_offset,
-                &address_size,
-                0,0,0,0,
-                &next_cu_header,
-                0,
-                &err);
-        
-        if (res == DW_DLV_ERROR) {
-            char *em = err ? dwarf_errmsg(err) : "unknown error";
-            printf("Error in dwarf_next_cu_header_d: %s\n", em);
-            exit(1);
-        }
-        else if (res == DW_DLV_NO_ENTRY) {
-            break;
+    if (dwarf_lowpc(cu_die, &worker->cu_base, NULL) != DW_DLV_OK)
+        worker->cu_base = 0;
+
+    size_t first_func = worker->funcs.num_funcs;
+    index_die_children(worker, cu_die, is_info, cu);
+
+    Dwarf_Addr low_pc, high_pc;
+    if (!get_die_pc_range(cu_die, &low_pc, &high_pc)) {
+        // CUs described by DW_AT_ranges: cover the span of their functions
+        low_pc = UINT64_MAX;
+        high_pc = 0;
+        for (size_t i = first_func; i < worker->funcs.num_funcs; ++i) {
+            if (worker->funcs.funcs[i].low_pc < low_pc)
+                low_pc = worker->funcs.funcs[i].low_pc;
+            if (worker->funcs.funcs[i].high_pc > high_pc)
+                high_pc = worker->funcs.funcs[i].high_pc;
         }
+    }
+    job->cu_ranges[cu] = (cu_range_t){ low_pc, high_pc, cu };
 
-        res = dwarf_siblingof_b(ctx->dwarf, no_die, is_info, &cu_die, &err);
-        if (res == DW_DLV_ERROR) {
-            char *em = err ? dwarf_errmsg(err) : "unknown error";
-            printf("Error in dwarf_siblingof_b (level 0): %s\n", em);
-            exit(1);
-        }
-        else if (res == DW_DLV_NO_ENTRY) {
-            printf("No DIE of Compilation Unit\n");
-            exit(EXIT_FAILURE);
-        }
+    dwarf_dealloc(worker->dwarf, cu_die, DW_DLA_DIE);
+
+    if (job->lines)
+        decode_cu_lines(worker->dwarf, &job->lines[cu]);
+}
+
+static void *index_cus(void *arg) {
+    index_arg_t *index_arg = arg;
+    index_job_t *job = index_arg->job;
 
-        subprog_die = find_subprog_die(ctx, cu_die, is_info, symbol, pc);
-        dwarf_dealloc(ctx->dwarf, cu_die, DW_DLA_DIE);
+    while (1) {
+        size_t cu = __atomic_fetch_add(&job->next_cu, 1, __ATOMIC_RELAXED);
+        if (cu >= job->num_cus)
+            break;
+        index_cu(index_arg->worker, job, cu);
     }
 
-    return subprog_die;
+    return NULL;
 }
 
+// Every worker filled its index in increasing CU order. Merging by CU
+// gives the same index a single thread would have built.
+static void merge_indexes(func_index_t *out, index_worker_t *workers, size_t num_workers, bool inlines) {
+    size_t pos[DWARF_INDEX_MAX_THREADS] = { 0 };
 
-char* get_func_symbol_from_pc(dbg_ctx *ctx, uint64_t pc) {
-    Dwarf_Die subprog_die;
-    char *subprog_name;
+    while (1) {
+        const func_index_t *best = NULL;
+        size_t best_worker = 0;
+
+        for (size_t w = 0; w < num_workers; ++w) {
+            const func_index_t *idx = inlines ? &workers[w].inlines : &workers[w].funcs;
+            if (pos[w] < idx->num_funcs &&
+                (best == NULL || idx->funcs[pos[w]].cu < best->funcs[pos[best_worker]].cu)) {
+                best = idx;
+                best_worker = w;
+            }
+        }
+        if (best == NULL)
+            break;
 
-    subprog_die = get_subprog_die_cu(ctx, NULL, pc);
-    if (dwarf_diename(subprog_die, &subprog_name, NULL) == DW_DLV_OK) {
-        return subprog_name;
+        const func_entry_t *func = &best->funcs[pos[best_worker]++];
+        func_index_add(out, func_entry_name(best, func), func->cu, func->low_pc, func->high_pc);
     }
-
-    return NULL;
 }
 
-static Dwarf_Die get_cu_die_by_pc(dbg_ctx *ctx, uint64_t pc) {
+// Collect the offset of every CU in one pass over the unit headers, so
+// the CUs themselves can be handed out to worker threads
+static size_t collect_cu_offsets(Dwarf_Debug dbg, Dwarf_Off **offsets_out) {
     int res;
     Dwarf_Bool is_info = 1;
     Dwarf_Unsigned cu_hdr_len = 0;
@@ -195,14 +489,14 @@ static Dwarf_Die get_cu_die_by_pc(dbg_ctx *ctx, uint64_t pc) {
     Dwarf_Half address_size = 0;
     Dwarf_Unsigned next_cu_header = 0;
     Dwarf_Error err = 0;
-    
-    Dwarf_Die ret_die = 0;
+    Dwarf_Off *offsets = NULL;
+    size_t num_cus = 0, cap = 0;
 
     while (1) {
         Dwarf_Die no_die = 0;
         Dwarf_Die cu_die = 0;
 
-        res = dwarf_next_cu_header_d(ctx->dwarf,
+        res = dwarf_next_cu_header_d(dbg,
                 is_info,
                 &cu_hdr_len,
                 &version_stamp,
@@ -222,7 +516,7 @@ static Dwarf_Die get_cu_die_by_pc(dbg_ctx *ctx, uint64_t pc) {
             break;
         }
 
-        res = dwarf_siblingof_b(ctx->dwarf, no_die, is_info, &cu_die, &err);
+        res = dwarf_siblingof_b(dbg, no_die, is_info, &cu_die, &err);
         if (res == DW_DLV_ERROR) {
             char *em = err ? dwarf_errmsg(err) : "unknown error";
             printf("Error in dwarf_siblingof_b (level 0): %s\n", em);
@@ -233,180 +527,396 @@ static Dwarf_Die get_cu_die_by_pc(dbg_ctx *ctx, uint64_t pc) {
             exit(EXIT_FAILURE);
         }
 
-        if (pc_in_die(cu_die, pc)) {
-            ret_die = cu_die;
+        Dwarf_Off cu_offset = 0;
+        if (dwarf_dieoffset(cu_die, &cu_offset, &err) != DW_DLV_OK) {
+            printf("Error in dwarf_dieoffset\n");
+            exit(EXIT_FAILURE);
         }
-        else {
-            dwarf_dealloc(ctx->dwarf, cu_die, DW_DLA_DIE);
+        dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+
+        if (num_cus == cap) {
+            cap = cap ? cap * 2 : 64;
+            offsets = realloc(offsets, cap * sizeof(Dwarf_Off));
         }
+        offsets[num_cus++] = cu_offset;
     }
 
-    return ret_die;
+    *offsets_out = offsets;
+    return num_cus;
 }
 
-static Dwarf_Line get_pc_line(Dwarf_Die cu_die, uint64_t pc) {
-    Dwarf_Unsigned version_out = 0;
-    Dwarf_Small is_single_table = 0;
-    Dwarf_Line_Context context_out = 0;
-    Dwarf_Error err = 0;
-    Dwarf_Line *linebuf = 0;
-    Dwarf_Signed linecount = 0;
-    Dwarf_Addr lineaddr = 0;
-
-    Dwarf_Addr min_addr = 0;
-    Dwarf_Line min_line = 0;
-
-    if (dwarf_srclines_b(cu_die, &version_out, &is_single_table, &context_out, &err) == DW_DLV_OK) {
-        if (dwarf_srclines_from_linecontext(context_out, &linebuf, &linecount, &err) == DW_DLV_OK) {
-            for (int i = 0; i < linecount; ++i) {
-                if (dwarf_lineaddr(linebuf[i], &lineaddr, &err) == DW_DLV_OK) {
-                    if (pc == lineaddr) return linebuf[i];
-                    else if (pc > lineaddr && pc > min_addr) {
-                        min_line = linebuf[i];
-                        min_addr = lineaddr;
-                    }
-                } 
-            }
+// Index every CU, recording all subprograms with code and the address
+// range of each CU. Line programs are decoded later, on demand, unless
+// the index is to be cached: then each CU's is decoded along with it.
+// The CUs are split between worker threads, each with its own libdwarf
+// handle, and the per-thread results merged afterwards. The result is
+// cached on disk, so later sessions on the same build skip the walk and
+// map the index directly.
+static void index_dwarf(binary_t *bin, Dwarf_Debug dbg, Elf *elf) {
+    if (elf && index_cache_load(&bin->index_cache, elf, bin->path,
+                                &bin->func_index, &bin->inline_index, &bin->line_table))
+        return;
+
+    index_job_t job = {};
+    job.num_cus = collect_cu_offsets(dbg, &job.cu_offsets);
+    job.cu_ranges = calloc(job.num_cus + 1, sizeof(cu_range_t));
+    for (size_t i = 0; i < job.num_cus; ++i)
+        line_table_add_cu(&bin->line_table, job.cu_offsets[i]);
+    if (elf)
+        job.lines = bin->line_table.cus;
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > DWARF_INDEX_MAX_THREADS)
+        num_threads = DWARF_INDEX_MAX_THREADS;
+    if (num_threads > (long)(job.num_cus / DWARF_INDEX_MIN_CUS) + 1)
+        num_threads = job.num_cus / DWARF_INDEX_MIN_CUS + 1;
+
+    // the calling thread works too, on the handle it was given
+    index_worker_t workers[DWARF_INDEX_MAX_THREADS];
+    index_arg_t args[DWARF_INDEX_MAX_THREADS];
+    pthread_t threads[DWARF_INDEX_MAX_THREADS];
+    bool started[DWARF_INDEX_MAX_THREADS] = { false };
+
+    for (long t = 0; t < num_threads; ++t) {
+        memset(&workers[t], 0, sizeof(workers[t]));
+        func_index_init(&workers[t].funcs);
+        func_index_init(&workers[t].inlines);
+        args[t] = (index_arg_t){ &job, &workers[t] };
+
+        if (t == 0) {
+            workers[t].dwarf = dbg;
+            continue;
         }
+        dwarf_init(&workers[t].dwarf, bin->path);
+        if (workers[t].dwarf && pthread_create(&threads[t], NULL, index_cus, &args[t]) == 0)
+            started[t] = true;
+    }
+    index_cus(&args[0]);
+    for (long t = 1; t < num_threads; ++t) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        if (workers[t].dwarf)
+            dwarf_finish(workers[t].dwarf);
+    }
+
+    merge_indexes(&bin->func_index, workers, num_threads, false);
+    merge_indexes(&bin->inline_index, workers, num_threads, true);
+    for (size_t i = 0; i < job.num_cus; ++i) {
+        if (job.cu_ranges[i].low_pc < job.cu_ranges[i].high_pc)
+            line_table_add_range(&bin->line_table, i, job.cu_ranges[i].low_pc, job.cu_ranges[i].high_pc);
     }
 
-    return min_line;
+    for (long t = 0; t < num_threads; ++t) {
+        func_index_free(&workers[t].funcs);
+        func_index_free(&workers[t].inlines);
+    }
+    free(job.cu_offsets);
+    free(job.cu_ranges);
+
+    func_index_finalize(&bin->func_index);
+    func_index_finalize(&bin->inline_index);
+    line_table_finalize(&bin->line_table);
+
+    if (elf)
+        index_cache_save(elf, bin->path, &bin->func_index, &bin->inline_index, &bin->line_table);
 }
 
+void build_dwarf_index(binary_t *bin) {
+    func_index_init(&bin->func_index);
+    func_index_init(&bin->inline_index);
+    line_table_init(&bin->line_table);
+    if (bin->dwarf != NULL)
+        index_dwarf(bin, bin->dwarf, bin->elf);
+}
 
-static Dwarf_Line get_prologue_end_line(Dwarf_Die cu_die, uint64_t prologue_addr) {
-    Dwarf_Unsigned version_out = 0;
-    Dwarf_Small is_single_table = 0;
-    Dwarf_Line_Context context_out = 0;
-    Dwarf_Error err = 0;
-    Dwarf_Line *linebuf = 0;
-    Dwarf_Signed linecount = 0;
-    Dwarf_Addr lineaddr = 0;
-
-    if (dwarf_srclines_b(cu_die, &version_out, &is_single_table, &context_out, &err) == DW_DLV_OK) {
-        if (dwarf_srclines_from_linecontext(context_out, &linebuf, &linecount, &err) == DW_DLV_OK) {
-            for (int i = 0; i < linecount; ++i) {
-                if (dwarf_lineaddr(linebuf[i], &lineaddr, &err) == DW_DLV_OK) {
-                    if (prologue_addr == lineaddr) {
-                        // Second line entry after function prologue
-                        // Note: some compilers might not output PE for line entry
-                        return linebuf[i + 1];
-                    }
-                } 
-            }
-        }
+// Runs on its own libdwarf and libelf handles, bin->dwarf and bin->elf
+// stay with the command loop
+static void *index_thread_main(void *arg) {
+    binary_t *bin = arg;
+    Dwarf_Debug dbg = NULL;
+    Elf *elf = NULL;
+
+    int fd = open(bin->path, O_RDONLY);
+    if (fd >= 0)
+        elf = elf_begin(fd, ELF_C_READ, NULL);
+
+    dwarf_init(&dbg, bin->path);
+    if (dbg) {
+        index_dwarf(bin, dbg, elf);
+        dwarf_finish(dbg);
     }
 
-    return 0;
+    if (elf)
+        elf_end(elf);
+    if (fd >= 0)
+        close(fd);
+
+    __atomic_store_n(&bin->index_done, true, __ATOMIC_RELEASE);
+    return NULL;
 }
 
-struct src_info get_src_info(dbg_ctx *ctx, uint64_t pc) {
-    Dwarf_Unsigned ret_lineno = 0, ret_fileno = 0;
-    Dwarf_Signed filecount = 0;
-    Dwarf_Error err = 0;
-    char *srcfile, *ret_str;
-    char **src_files; 
-    Dwarf_Line pc_line = 0;
+// Build the index on a background thread so the prompt does not wait for
+// it. Until wait_dwarf_index joins the thread nothing else may touch
+// func_index, inline_index or line_table.
+void start_dwarf_index(binary_t *bin) {
+    func_index_init(&bin->func_index);
+    func_index_init(&bin->inline_index);
+    line_table_init(&bin->line_table);
+    if (bin->dwarf == NULL)
+        return;
 
-    struct src_info src_info = {};
-    
-    Dwarf_Die cu_die = get_cu_die_by_pc(ctx, pc);
-    pc_line = get_pc_line(cu_die, pc);
+    bin->index_done = false;
+    if (pthread_create(&bin->index_thread, NULL, index_thread_main, bin) == 0)
+        bin->index_pending = true;
+    else
+        index_dwarf(bin, bin->dwarf, bin->elf);
+}
 
-    if (cu_die == NULL) {
-        printf("Error: Couldn't find CU DIE corresponding to PC\n");
-        exit(EXIT_FAILURE);
-    }
-    if (pc_line == NULL) {
-        printf("Error: Couldn't find Dwarf_Line corresponding to PC\n");
-        exit(EXIT_FAILURE);
-    }
-    if (dwarf_lineno(pc_line, &ret_lineno, &err) != DW_DLV_OK) {
-        printf("Error in dwarf_lineno\n");
-        exit(EXIT_FAILURE);
-    }
+void wait_dwarf_index(binary_t *bin) {
+    if (!bin->index_pending)
+        return;
 
-    src_info.src_line = pc_line;
-    src_info.line_no = ret_lineno;
+    if (!__atomic_load_n(&bin->index_done, __ATOMIC_ACQUIRE))
+        printf("Waiting for the debug info index...\n");
+    pthread_join(bin->index_thread, NULL);
+    bin->index_pending = false;
+}
 
-    if (dwarf_srcfiles(cu_die, &src_files, &filecount, &err) == DW_DLV_OK) {
-        if (dwarf_line_srcfileno(pc_line, &ret_fileno, &err) == DW_DLV_OK) {
-            srcfile = src_files[ret_fileno - 1];
-            ret_str = calloc(strlen(srcfile) + 1, sizeof(char));
-            memcpy(ret_str, srcfile, strlen(srcfile) + 1);
-            src_info.src_file_name = ret_str;
-        }
-        else {
-            printf("Error: Couldn't find src file number corresponding to Dwarf_Line\n");
-            exit(EXIT_FAILURE);
+
+
+// The ELF symbol table answers first, DWARF covers binaries without one
+const char* get_func_symbol_from_pc(dbg_ctx *ctx, uint64_t pc) {
+    const sym_entry_t *sym = sym_index_lookup_pc(&ctx->bin->sym_index, pc);
+    if (sym)
+        return sym_entry_name(&ctx->bin->sym_index, sym);
+
+    wait_dwarf_index(ctx->bin);
+    const func_entry_t *func = func_index_lookup_pc(&ctx->bin->func_index, pc);
+    if (func)
+        return func_entry_name(&ctx->bin->func_index, func);
+
+    return NULL;
+}
+
+// Find the CU holding pc through .debug_aranges and decode just that
+// one. Returns false when the binary has no aranges to search.
+static bool find_early_cu(dbg_ctx *ctx, uint64_t pc, cu_lines_t **cu_out) {
+    Dwarf_Arange *aranges, arange;
+    Dwarf_Signed count;
+    Dwarf_Unsigned segment, segment_size, length;
+    Dwarf_Addr start;
+    Dwarf_Off die_offset;
+
+    *cu_out = NULL;
+    if (dwarf_get_aranges(ctx->bin->dwarf, &aranges, &count, NULL) != DW_DLV_OK)
+        return false;
+
+    bool found = dwarf_get_arange(aranges, count, pc, &arange, NULL) == DW_DLV_OK &&
+                 dwarf_get_arange_info_b(arange, &segment, &segment_size, &start, &length,
+                                         &die_offset, NULL) == DW_DLV_OK;
+
+    for (Dwarf_Signed i = 0; i < count; ++i)
+        dwarf_dealloc(ctx->bin->dwarf, aranges[i], DW_DLA_ARANGE);
+    dwarf_dealloc(ctx->bin->dwarf, aranges, DW_DLA_LIST);
+
+    if (!found)
+        return true;
+
+    for (size_t i = 0; i < ctx->bin->num_early_cus; ++i) {
+        if (ctx->bin->early_cus[i]->die_offset == die_offset) {
+            *cu_out = ctx->bin->early_cus[i];
+            return true;
         }
     }
-    else {
-        printf("Error: Couldn't get src file list from CU DIE\n");
-        exit(EXIT_FAILURE);
-    }
-    
+
+    cu_lines_t *cu = calloc(1, sizeof(cu_lines_t));
+    cu->low_pc = start;
+    cu->high_pc = start + length;
+    cu->die_offset = die_offset;
+    decode_cu_lines(ctx->bin->dwarf, cu);
+
+    ctx->bin->early_cus = realloc(ctx->bin->early_cus, (ctx->bin->num_early_cus + 1) * sizeof(cu_lines_t *));
+    ctx->bin->early_cus[ctx->bin->num_early_cus++] = cu;
+    *cu_out = cu;
+    return true;
+}
+
+// While the index is still being built a lookup decodes the one CU it
+// needs instead of waiting, if the aranges can say which one that is
+static cu_lines_t *get_cu_lines(dbg_ctx *ctx, uint64_t pc) {
+    cu_lines_t *cu;
+
+    if (ctx->bin->index_pending && !__atomic_load_n(&ctx->bin->index_done, __ATOMIC_ACQUIRE) &&
+        find_early_cu(ctx, pc, &cu))
+        return cu;
+
+    wait_dwarf_index(ctx->bin);
+    cu = line_table_find_cu(&ctx->bin->line_table, pc);
+    if (cu && !cu->decoded)
+        decode_cu_lines(ctx->bin->dwarf, cu);
+
+    return cu;
+}
+
+// On failure src_file_name is NULL and line_no is 0
+struct src_info get_src_info(dbg_ctx *ctx, uint64_t pc) {
+    struct src_info src_info = {};
+
+    cu_lines_t *cu = get_cu_lines(ctx, pc);
+    if (cu == NULL)
+        return src_info;
+
+    const line_entry_t *line = cu_lines_lookup(cu, pc);
+    if (line == NULL)
+        return src_info;
+
+    src_info.src_file_name = cu_lines_file_name(cu, line->file);
+    src_info.line_no = line->line;
+    src_info.line_addr = line->addr;
+
     return src_info;
 }
 
-void print_source(struct src_info *src_info) {
-    FILE *f;
-    if ((f = fopen(src_info->src_file_name, "r")) == NULL) {
+static void set_list_position(dbg_ctx *ctx, source_file_t *file, size_t line_no) {
+    ctx->list_file = file;
+    ctx->list_first = line_no > LIST_WINDOW / 2 ? line_no - LIST_WINDOW / 2 : 1;
+}
+
+void print_source(dbg_ctx *ctx, struct src_info *src_info) {
+    if (src_info->src_file_name == NULL)
+        return;
+
+    source_file_t *file = source_cache_get(&ctx->bin->source_cache, src_info->src_file_name);
+    if (file->data == NULL) {
         printf("Failure to open %s\n", src_info->src_file_name);
-        exit(EXIT_FAILURE);
+        return;
     }
 
-    char line[256];
-    Dwarf_Unsigned count = 1;
-    while (fgets(line, sizeof(line), f) != NULL) {
-        if (count == src_info->line_no) {
-            printf("%llu\t%s", src_info->line_no, line);
-            break;
-        }
-        
-        count++;
+    print_source_line(file, src_info->line_no);
+    set_list_position(ctx, file, src_info->line_no);
+}
+
+// List a window of lines around line_no, or continue the previous listing if 0
+void list_source(dbg_ctx *ctx, size_t line_no) {
+    if (ctx->list_file == NULL) {
+        printf("No source file to list\n");
+        return;
+    }
+
+    if (line_no != 0)
+        set_list_position(ctx, ctx->list_file, line_no);
+
+    if (ctx->list_first > ctx->list_file->num_lines) {
+        printf("Line number %zu out of range; \"%s\" has %zu lines.\n",
+            ctx->list_first, ctx->list_file->path, ctx->list_file->num_lines);
+        return;
     }
 
-    fclose(f);
-} 
+    size_t last = ctx->list_first + LIST_WINDOW;
+    for (size_t i = ctx->list_first; i < last && i <= ctx->list_file->num_lines; ++i)
+        print_source_line(ctx->list_file, i);
+
+    ctx->list_first = last;
+}
 
 Dwarf_Addr get_func_addr(dbg_ctx *ctx, const char *symbol) {
-    Dwarf_Die subprog_die;
-    char *subprog_name;
-    Dwarf_Attribute *attrs = 0;
-    Dwarf_Addr brkpoint_addr = 0;
-    Dwarf_Signed attr_count = 0, it = 0;
-    Dwarf_Error err = 0;
+    const sym_entry_t *sym = sym_index_lookup_name(&ctx->bin->sym_index, symbol);
+    if (sym)
+        return sym->addr;
 
-    subprog_die = get_subprog_die_cu(ctx, symbol, 0);
+    wait_dwarf_index(ctx->bin);
+    const func_entry_t *func = func_index_lookup_name(&ctx->bin->func_index, symbol);
+    if (func)
+        return func->low_pc;
 
-    if (dwarf_diename(subprog_die, &subprog_name, &err) == DW_DLV_OK) {
-        if (strncmp(subprog_name, symbol, strlen(subprog_name)) == 0) {
-            if (dwarf_attrlist(subprog_die, &attrs, &attr_count, &err) != DW_DLV_OK) {
-                printf("Error in dwarf_attrlist\n");
-                exit(EXIT_FAILURE);
-            }
-            for (it = 0; it < attr_count; ++it) {
-                Dwarf_Half attr_code;
-                if (dwarf_whatattr(attrs[it], &attr_code, &err) != DW_DLV_OK) {
-                    printf("Error in dwarf_whatattr\n");
-                    exit(EXIT_FAILURE);
-                }
-                if (attr_code == DW_AT_low_pc) {
-                    dwarf_formaddr(attrs[it], &brkpoint_addr, &err);
-                    return brkpoint_addr;
-                }
-            }
-        }
+    return 0;
+}
+
+// First address past the function prologue
+Dwarf_Addr get_func_prologue_end_addr(dbg_ctx *ctx, const func_entry_t *func) {
+    cu_lines_t *cu = get_cu_lines(ctx, func->low_pc);
+    if (cu == NULL)
+        return func->low_pc;
+
+    const line_entry_t *entry = cu_lines_lookup(cu, func->low_pc);
+    if (entry == NULL)
+        return func->low_pc;
+
+    const line_entry_t *end = cu->lines + cu->num_lines;
+    for (const line_entry_t *line = entry; line < end && line->addr < func->high_pc; ++line) {
+        if (line->flags & LINE_PROLOGUE_END)
+            return line->addr;
     }
 
-    return 0;
+    // Note: some compilers might not output PE for line entry,
+    // so use the second line entry after the function entry
+    for (const line_entry_t *line = entry; line < end && line->addr < func->high_pc; ++line) {
+        if (line->addr > func->low_pc && !(line->flags & LINE_END_SEQUENCE))
+            return line->addr;
+    }
+
+    return func->low_pc;
 }
 
-Dwarf_Line get_func_prologue_end_line(dbg_ctx *ctx, const char *symbol) {
-    Dwarf_Addr prologue_addr = get_func_addr(ctx, symbol);
-    Dwarf_Die cu_die = get_cu_die_by_pc(ctx, prologue_addr);
-    Dwarf_Line prologue_end_line = get_prologue_end_line(cu_die, prologue_addr);
-    
-    return prologue_end_line;
+// On failure (no line information at pc) returns false
+bool get_line_range(dbg_ctx *ctx, uint64_t pc, struct line_range *range) {
+    cu_lines_t *cu = get_cu_lines(ctx, pc);
+    if (cu == NULL)
+        return false;
+
+    const line_entry_t *line = cu_lines_lookup(cu, pc);
+    if (line == NULL || line->line == 0)
+        return false;
+
+    const line_entry_t *begin = cu->lines, *end = cu->lines + cu->num_lines;
+    range->at_stmt = false;
+
+    // of several rows at one address the last one describes the code
+    for (; line + 1 < end && line[1].addr == line->addr && !(line[1].flags & LINE_END_SEQUENCE); ++line) {
+        if (line->addr == pc && (line->flags & LINE_IS_STMT))
+            range->at_stmt = true;
+    }
+    if (line->addr == pc && (line->flags & LINE_IS_STMT))
+        range->at_stmt = true;
+
+    const line_entry_t *first = line, *next = line + 1;
+    while (first > begin && !(first[-1].flags & LINE_END_SEQUENCE) &&
+           first[-1].line == line->line && first[-1].file == line->file)
+        first--;
+    while (next < end && !(next->flags & LINE_END_SEQUENCE) &&
+           next->line == line->line && next->file == line->file)
+        next++;
+
+    range->low_pc = first->addr;
+    range->high_pc = next < end ? next->addr : cu->high_pc;
+    range->line_no = line->line;
+    return true;
+}
+
+// Start addresses of line_no in the compilation unit holding pc, or of
+// the first line after it with code
+size_t get_line_addrs(dbg_ctx *ctx, uint64_t pc, size_t line_no, uint64_t *addrs, size_t max) {
+    cu_lines_t *cu = get_cu_lines(ctx, pc);
+    if (cu == NULL)
+        return 0;
+
+    size_t best = 0;
+    for (size_t i = 0; i < cu->num_lines; ++i) {
+        const line_entry_t *line = &cu->lines[i];
+        if ((line->flags & LINE_IS_STMT) && !(line->flags & LINE_END_SEQUENCE) &&
+            line->line >= line_no && (best == 0 || line->line < best))
+            best = line->line;
+    }
+
+    size_t num = 0;
+    for (size_t i = 0; i < cu->num_lines && num < max; ++i) {
+        const line_entry_t *line = &cu->lines[i];
+        if (line->line != best || !(line->flags & LINE_IS_STMT) || (line->flags & LINE_END_SEQUENCE))
+            continue;
+        // only where a run of rows for the line begins
+        if (i > 0 && cu->lines[i - 1].line == best && !(cu->lines[i - 1].flags & LINE_END_SEQUENCE))
+            continue;
+        addrs[num++] = line->addr;
+    }
+    return num;
 }
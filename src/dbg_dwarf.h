@@ -6,16 +6,35 @@
 
 #include "debugger.h"
 
+#define LIST_WINDOW 10
+
+#define DWARF_INDEX_MAX_THREADS 16
+#define DWARF_INDEX_MIN_CUS     32      // CUs per extra indexing thread
+
 struct src_info {
-    char *src_file_name;
-    Dwarf_Line src_line;
+    const char *src_file_name;
+    Dwarf_Unsigned line_no;
+    Dwarf_Addr line_addr;
+};
+
+// Addresses [low_pc, high_pc) of the rows around a pc that share its line
+struct line_range {
+    Dwarf_Addr low_pc;
+    Dwarf_Addr high_pc;
     Dwarf_Unsigned line_no;
+    bool at_stmt;       // pc starts an is_stmt row
 };
 
 void dwarf_init(Dwarf_Debug *dbg, const char *program_name);
+void build_dwarf_index(binary_t *bin);
+void start_dwarf_index(binary_t *bin);
+void wait_dwarf_index(binary_t *bin);
 Dwarf_Addr get_func_addr(dbg_ctx *ctx, const char *symbol);
-char* get_func_symbol_from_pc(dbg_ctx *ctx, uint64_t pc);
+const char* get_func_symbol_from_pc(dbg_ctx *ctx, uint64_t pc);
 struct src_info get_src_info(dbg_ctx *ctx, uint64_t pc);
-void print_source(struct src_info *src_info);
-Dwarf_Line get_func_prologue_end_line(dbg_ctx *ctx, const char *symbol);
+void print_source(dbg_ctx *ctx, struct src_info *src_info);
+void list_source(dbg_ctx *ctx, size_t line_no);
+Dwarf_Addr get_func_prologue_end_addr(dbg_ctx *ctx, const func_entry_t *func);
+bool get_line_range(dbg_ctx *ctx, uint64_t pc, struct line_range *range);
+size_t get_line_addrs(dbg_ctx *ctx, uint64_t pc, size_t line_no, uint64_t *addrs, size_t max);
 #endif
\ No newline at end of file
@@ -11,46 +11,137 @@
 #include <string.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <limits.h>
 
 #include "debugger.h"
 #include "registers.h"
 #include "dbg_dwarf.h"
 #include "utils.h"
+#include "displaced.h"
+#include "trace.h"
 
+extern char **environ;
 
+// Per-process state only, the binary is released by its owner
 void free_debugger(dbg_ctx *ctx) {
-    for (int i = 0; i < ctx->active_breakpoints; ++i) {
-        free(ctx->breakpoints[i]);
-    }
-    dwarf_finish(ctx->dwarf);
-    close_elf(ctx);
+    ftrace_stop(&ctx->ftrace, &ctx->breakpoints);
+    bp_table_free(&ctx->breakpoints);
+    watch_table_free(&ctx->watch);
+    solib_free(&ctx->solibs);
+    close_memory(ctx->pid);
+    thread_table_free(&ctx->threads);
 }
 
-void hit_bp_message(int bp_no, intptr_t addr, const char *func, Dwarf_Unsigned line_no, char *file) {
+void hit_bp_message(int bp_no, intptr_t addr, const char *func, Dwarf_Unsigned line_no, const char *file) {
     printf("Breakpoint %d, " BLU "0x%lx " RESET "in " YEL "%s ()" RESET  " at line %llu of " GRN "%s\n" RESET, bp_no, addr, func, line_no, file);
 }
 
 uint64_t sub_load_addr(dbg_ctx *ctx, uint64_t addr) {
-    if (bin_is_pie(ctx->elf))
+    if (ctx->bin->is_pie)
         return addr - ctx->load_addr;
     return addr;
 }
 
 uint64_t add_load_addr(dbg_ctx *ctx, uint64_t addr) {
-    if (bin_is_pie(ctx->elf))
+    if (ctx->bin->is_pie)
         return addr + ctx->load_addr;
     return addr;
 }
 
+static void solib_event(dbg_ctx *ctx);
+static uint64_t find_solib_symbol(dbg_ctx *ctx, const char *name, module_t **found);
+
+// Decide whether a hit on the site stops. Conditions are checked against
+// the cached registers; a breakpoint whose condition holds uses up its
+// ignore count before it stops. dprintfs, tracepoints and ftrace
+// breakpoints record their data and never stop. The lowest numbered
+// stopping breakpoint reports the hit.
+static breakpoint_t *record_bp_hit(dbg_ctx *ctx, bp_site_t *site) {
+    breakpoint_t *reporter = NULL;
+
+    for (bp_location_t *loc = site->locs; loc; loc = loc->next_in_site) {
+        breakpoint_t *bp = loc->owner;
+        if (!bp->enabled)
+            continue;
+
+        switch (bp->kind) {
+            case BP_FTRACE_ENTRY:
+                ftrace_entry(&ctx->ftrace, &ctx->breakpoints, bp, ctx->thread->tid,
+                             get_register_value(&ctx->thread->regs, AARCH64_LR_REGNUM),
+                             get_register_value(&ctx->thread->regs, AARCH64_SP_REGNUM));
+                continue;
+            case BP_FTRACE_EXIT:
+                ftrace_exit(&ctx->ftrace, ctx->thread->tid, site->addr,
+                            get_register_value(&ctx->thread->regs, AARCH64_SP_REGNUM));
+                continue;
+            case BP_STEP:
+                // the stepping command checks where it stopped itself
+                continue;
+            case BP_SOLIB:
+                solib_event(ctx);
+                continue;
+            default:
+                break;
+        }
+
+        if (bp->cond) {
+            uint64_t val;
+            if (!expr_eval(bp->cond, &ctx->thread->regs, ctx->pid, &val)) {
+                printf("Error in testing condition for breakpoint %d: %s\n", bp->num, bp->cond_text);
+                val = 1;
+            }
+            if (val == 0)
+                continue;
+        }
+
+        bp->hit_count++;
+        if (bp->ignore_count > 0) {
+            bp->ignore_count--;
+            continue;
+        }
+
+        if (bp->action) {
+            run_bp_action(bp->action, &ctx->thread->regs, ctx->pid, bp->num, site->addr);
+            continue;
+        }
+
+        if (reporter == NULL || bp->num < reporter->num)
+            reporter = bp;
+    }
+
+    return reporter;
+}
+
 void bp_info(dbg_ctx *ctx) {
-    breakpoint_t *bp = at_breakpoint(ctx);
-    uint64_t pc = sub_load_addr(ctx, get_pc(ctx->pid));
+    bp_site_t *site = at_breakpoint(ctx);
+
+    if (site == NULL) {
+        // another thread hit a breakpoint that was removed before its stop
+        // was collected; the original instruction is back in place
+        uint32_t insn;
+        if (read_memory_range(ctx->pid, get_pc(ctx), &insn, sizeof(insn)) == sizeof(insn) && insn != BP_TRAP_INSN) {
+            ctx->auto_resume = true;
+            return;
+        }
+        printf("Program received SIGTRAP at " BLU "0x%lx\n" RESET, get_pc(ctx));
+        return;
+    }
+
+    breakpoint_t *bp = record_bp_hit(ctx, site);
+    if (bp == NULL) {
+        // resumed by poll_inferior before anything is symbolized
+        ctx->auto_resume = true;
+        return;
+    }
 
-    char *func = get_func_symbol_from_pc(ctx, pc);
+    uint64_t pc = sub_load_addr(ctx, site->addr);
+    const char *func = symbol_at(ctx, site->addr);
+    if (func == NULL)
+        func = "??";
     struct src_info src_info = get_src_info(ctx, pc);
-    hit_bp_message(bp->num, bp->addr, func, src_info.line_no, loc_last_dir(src_info.src_file_name));
-    print_source(&src_info);
-    free(src_info.src_file_name);
+    const char *file = src_info.src_file_name ? loc_last_dir(src_info.src_file_name) : "??";
+    hit_bp_message(bp->num, site->addr, func, src_info.line_no, file);
+    print_source(ctx, &src_info);
 }
 
 static void handle_sigtrap(dbg_ctx *ctx, siginfo_t info) {
@@ -77,95 +168,496 @@ static siginfo_t get_signal_info(pid_t pid) {
 }
 
 
-breakpoint_t *at_breakpoint(dbg_ctx *ctx) {
-    uint64_t pc = get_pc(ctx->pid);
-    for (int i = 0; i < ctx->active_breakpoints; ++i) {
-        if (ctx->breakpoints[i]->addr == (intptr_t)pc) {
-            return ctx->breakpoints[i];
+bp_site_t *at_breakpoint(dbg_ctx *ctx) {
+    return bp_site_lookup(&ctx->breakpoints, get_pc(ctx));
+}
+
+void list_breakpoints(const dbg_ctx *ctx) {
+    const breakpoint_t *first = ctx->breakpoints.head;
+    while (first && first->kind != BP_USER)
+        first = first->next;
+
+    if (first == NULL) {
+        printf("No breakpoints.\n");
+        return;
+    }
+
+    printf("Num     Enb Address            Hits\n");
+    for (breakpoint_t *bp = ctx->breakpoints.head; bp; bp = bp->next) {
+        if (bp->kind != BP_USER)
+            continue;
+
+        if (bp->pending || bp->num_locs == 0)
+            printf("%-7d %-3c %-18s %lu\n", bp->num, bp->enabled ? 'y' : 'n', "<PENDING>", bp->hit_count);
+        else if (bp->num_locs == 1)
+            printf("%-7d %-3c 0x%016lx %lu\n", bp->num, bp->enabled ? 'y' : 'n', bp->locs->site->addr, bp->hit_count);
+        else
+            printf("%-7d %-3c %-18s %lu\n", bp->num, bp->enabled ? 'y' : 'n', "<MULTIPLE>", bp->hit_count);
+
+        if (bp->pending)
+            printf("        pending on %s\n", bp->pending);
+        if (bp->cond_text)
+            printf("        stop only if %s\n", bp->cond_text);
+        if (bp->ignore_count)
+            printf("        will ignore next %lu hits\n", bp->ignore_count);
+        if (bp->action)
+            printf("        %s %s\n", bp->action->format ? "dprintf" : "collect", bp->action->text);
+
+        if (bp->num_locs <= 1)
+            continue;
+
+        int loc_no = bp->num_locs;
+        for (bp_location_t *loc = bp->locs; loc; loc = loc->next_in_bp)
+            printf("%d.%-5d     0x%016lx\n", bp->num, loc_no--, loc->site->addr);
+    }
+}
+
+static bool bp_has_location(breakpoint_t *bp, uint64_t addr) {
+    for (bp_location_t *loc = bp->locs; loc; loc = loc->next_in_bp) {
+        if (loc->site->addr == addr)
+            return true;
+    }
+    return false;
+}
+
+breakpoint_t *set_bp_at_addr(dbg_ctx *ctx, uint64_t addr) {
+    breakpoint_t *bp = bp_create(&ctx->breakpoints);
+    bp_add_location(&ctx->breakpoints, bp, addr);
+    printf("Breakpoint %d at 0x%lx\n", bp->num, addr);
+
+    return bp;
+}
+
+static bool dwarf_index_ready(const binary_t *bin) {
+    return !bin->index_pending || __atomic_load_n(&bin->index_done, __ATOMIC_ACQUIRE);
+}
+
+// One location per definition of the function and per inlined copy of
+// it, returns how many the index has
+static size_t add_func_locations(dbg_ctx *ctx, breakpoint_t *bp, const char *symbol) {
+    size_t num_funcs = func_index_find_all(&ctx->bin->func_index, symbol, NULL, 0);
+    size_t num_inlines = func_index_find_all(&ctx->bin->inline_index, symbol, NULL, 0);
+    if (num_funcs + num_inlines == 0)
+        return 0;
+
+    const func_entry_t **funcs = malloc((num_funcs + num_inlines) * sizeof(func_entry_t *));
+    func_index_find_all(&ctx->bin->func_index, symbol, funcs, num_funcs);
+    func_index_find_all(&ctx->bin->inline_index, symbol, funcs + num_funcs, num_inlines);
+
+    for (size_t i = 0; i < num_funcs + num_inlines; ++i) {
+        uint64_t addr = i < num_funcs ? get_func_prologue_end_addr(ctx, funcs[i]) : funcs[i]->low_pc;
+        addr = add_load_addr(ctx, addr);
+        if (!bp_has_location(bp, addr))
+            bp_add_location(&ctx->breakpoints, bp, addr);
+    }
+    free(funcs);
+
+    return num_funcs + num_inlines;
+}
+
+// Functions with debug information get a location per definition and
+// inlined copy. Those without are found in the ELF symbol tables of the
+// executable and then the loaded libraries, and get a single location at
+// their entry. A function not defined anywhere yet gets a pending
+// breakpoint, resolved when a library defining it is loaded.
+// While the index is still being built the executable's symbol table
+// answers instead, and resolve_indexed_breakpoints adds the rest later.
+breakpoint_t *set_bp_at_func(dbg_ctx *ctx, const char *symbol) {
+    bool indexed = dwarf_index_ready(ctx->bin);
+
+    if (indexed) {
+        wait_dwarf_index(ctx->bin);
+        if (func_index_find_all(&ctx->bin->func_index, symbol, NULL, 0) +
+            func_index_find_all(&ctx->bin->inline_index, symbol, NULL, 0) > 0) {
+            breakpoint_t *bp = bp_create(&ctx->breakpoints);
+            add_func_locations(ctx, bp, symbol);
+            if (bp->num_locs == 1)
+                printf("Breakpoint %d at 0x%lx\n", bp->num, bp->locs->site->addr);
+            else
+                printf("Breakpoint %d at %s (%d locations)\n", bp->num, symbol, bp->num_locs);
+            return bp;
         }
     }
 
-    return NULL;
+    const sym_entry_t *sym = sym_index_lookup_name(&ctx->bin->sym_index, symbol);
+    if (sym) {
+        breakpoint_t *bp = set_bp_at_addr(ctx, add_load_addr(ctx, sym->addr));
+        if (!indexed)
+            bp->deferred = strdup(symbol);
+        return bp;
+    }
+
+    // it may only be known to the debug info
+    if (!indexed) {
+        wait_dwarf_index(ctx->bin);
+        return set_bp_at_func(ctx, symbol);
+    }
+
+    uint64_t addr = find_solib_symbol(ctx, symbol, NULL);
+    if (addr)
+        return set_bp_at_addr(ctx, addr);
+
+    breakpoint_t *bp = bp_create(&ctx->breakpoints);
+    bp->pending = strdup(symbol);
+    printf("Function \"%s\" not defined yet. Breakpoint %d (%s) pending.\n", symbol, bp->num, symbol);
+    return bp;
 }
 
-void list_breakpoints(const dbg_ctx *ctx) {
-    for (int i = 0; i < ctx->active_breakpoints; ++i) {
-        printf("Breakpoint %d at 0x%lx\n", i + 1, ctx->breakpoints[i]->addr);
+// Move the breakpoints set from the symbol table alone to their debug
+// info locations, once the index is there. Runs before each command and
+// whenever a hit resumes on its own, with the inferior stopped.
+void resolve_indexed_breakpoints(dbg_ctx *ctx) {
+    if (!dwarf_index_ready(ctx->bin))
+        return;
+
+    for (breakpoint_t *bp = ctx->breakpoints.head; bp; bp = bp->next) {
+        if (bp->deferred == NULL)
+            continue;
+
+        wait_dwarf_index(ctx->bin);
+        uint64_t entry = bp->locs->site->addr;
+        while (bp->locs)
+            bp_remove_location(&ctx->breakpoints, bp->locs);
+        if (add_func_locations(ctx, bp, bp->deferred) == 0)
+            bp_add_location(&ctx->breakpoints, bp, entry);
+
+        free(bp->deferred);
+        bp->deferred = NULL;
     }
 }
 
-void set_bp_at_addr(dbg_ctx *ctx, uint64_t addr) {
-    // Set breakpoint if limit has not been exceeded
-    if (ctx->active_breakpoints < MAX_BREAKPOINTS) {
-        breakpoint_t *new_bp = new_breakpoint(ctx->pid, ctx->active_breakpoints + 1, addr);
-        enable_breakpoint(new_bp);
-        ctx->breakpoints[ctx->active_breakpoints++] = new_bp;
-        printf("Breakpoint %d at 0x%lx\n", ctx->active_breakpoints, addr);
+// With no number, apply to every breakpoint
+static void for_each_bp_arg(dbg_ctx *ctx, const char *num, void (*fn)(dbg_ctx *, breakpoint_t *)) {
+    if (num == NULL) {
+        breakpoint_t *bp = ctx->breakpoints.head;
+        while (bp) {
+            breakpoint_t *next = bp->next;
+            if (bp->kind == BP_USER)
+                fn(ctx, bp);
+            bp = next;
+        }
+        return;
     }
-    else {
-        printf("Error: too many breakpoints active\n");
+
+    breakpoint_t *bp = bp_find(&ctx->breakpoints, strtol(num, NULL, 10));
+    if (bp == NULL) {
+        printf("No breakpoint number %s.\n", num);
+        return;
     }
+    fn(ctx, bp);
+}
+
+static void delete_bp(dbg_ctx *ctx, breakpoint_t *bp) {
+    bp_delete(&ctx->breakpoints, bp);
 }
 
-void set_bp_at_func(dbg_ctx *ctx, const char *symbol) {
-    Dwarf_Addr end_prologue_addr = 0;
+static void enable_bp(dbg_ctx *ctx, breakpoint_t *bp) {
+    bp_set_enabled(&ctx->breakpoints, bp, true);
+}
 
-    Dwarf_Line prologue_end_line = get_func_prologue_end_line(ctx, symbol);
+static void disable_bp(dbg_ctx *ctx, breakpoint_t *bp) {
+    bp_set_enabled(&ctx->breakpoints, bp, false);
+}
 
-    if (dwarf_lineaddr(prologue_end_line, &end_prologue_addr, NULL) != DW_DLV_OK) {
-        printf("Error in dwarf_lineaddr\n");
-        exit(EXIT_FAILURE);
+// Compile text once so every hit only runs the bytecode.
+// An empty or NULL text removes the condition.
+bool set_bp_condition(breakpoint_t *bp, const char *text) {
+    if (text == NULL || *text == '\0') {
+        bp_set_condition(bp, NULL, NULL);
+        return true;
     }
 
-    end_prologue_addr = add_load_addr(ctx, end_prologue_addr);
+    const char *error;
+    expr_t *cond = expr_compile(text, &error);
+    if (cond == NULL) {
+        printf("Invalid condition \"%s\": %s\n", text, error);
+        return false;
+    }
 
-    if (end_prologue_addr != 0) 
-        set_bp_at_addr(ctx, end_prologue_addr);
-    
-    else 
-        printf("Unable to set breakpoint at function %s\n", symbol);
-    
+    bp_set_condition(bp, cond, text);
+    return true;
 }
 
-breakpoint_t *get_bp_at_address(dbg_ctx *ctx, uint64_t addr) {
-    for (int i = 0; i < ctx->active_breakpoints; ++i) {
-        if (ctx->breakpoints[i]->addr == (intptr_t)addr)
-            return ctx->breakpoints[i];
+static breakpoint_t *find_bp_arg(dbg_ctx *ctx, const char *num) {
+    if (num == NULL) {
+        printf("Breakpoint number needed\n");
+        return NULL;
     }
 
-    return NULL;
+    breakpoint_t *bp = bp_find(&ctx->breakpoints, strtol(num, NULL, 10));
+    if (bp == NULL)
+        printf("No breakpoint number %s.\n", num);
+    return bp;
 }
 
+void condition_breakpoint(dbg_ctx *ctx, const char *num, const char *text) {
+    breakpoint_t *bp = find_bp_arg(ctx, num);
+    if (bp == NULL)
+        return;
 
-long read_memory(const pid_t pid, const uint64_t address) {
-    long val;
-    val = ptrace(PTRACE_PEEKDATA, pid, address, NULL);
-    if (errno != 0) {
-        perror("PTRACE_PEEKDATA error: ");
-        printf("Errno: %d\n", errno);
-        exit(EXIT_FAILURE);
+    if (set_bp_condition(bp, text) && bp->cond == NULL)
+        printf("Breakpoint %d now unconditional.\n", bp->num);
+}
+
+void ignore_breakpoint(dbg_ctx *ctx, const char *num, const char *count) {
+    breakpoint_t *bp = find_bp_arg(ctx, num);
+    if (bp == NULL)
+        return;
+
+    if (count == NULL) {
+        printf("Ignore count needed\n");
+        return;
     }
 
-    return val;
+    bp->ignore_count = strtoul(count, NULL, 0);
+    if (bp->ignore_count == 0)
+        printf("Will stop next time breakpoint %d is reached.\n", bp->num);
+    else
+        printf("Will ignore next %lu crossings of breakpoint %d.\n", bp->ignore_count, bp->num);
 }
 
-void write_memory(const pid_t pid, const uint64_t address, const long val) {
-    if (ptrace(PTRACE_POKEDATA, pid, address, val) < 0) {
-        perror("Error: ");
-        exit(EXIT_FAILURE);
+void ftrace_functions(dbg_ctx *ctx, const char *pattern) {
+    regex_t re;
+
+    if (regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+        printf("Invalid regular expression: %s\n", pattern);
+        return;
+    }
+
+    wait_dwarf_index(ctx->bin);
+    size_t armed = ftrace_arm(&ctx->ftrace, &ctx->breakpoints, &ctx->bin->func_index, &re, add_load_addr(ctx, 0));
+    printf("Tracing %zu functions matching %s\n", armed, pattern);
+    regfree(&re);
+}
+
+// Watchpoints are numbered along with breakpoints
+void delete_breakpoints(dbg_ctx *ctx, const char *num) {
+    if (num == NULL)
+        delete_watchpoints(ctx);
+    else if (delete_watchpoint(ctx, strtol(num, NULL, 10)))
+        return;
+    for_each_bp_arg(ctx, num, delete_bp);
+}
+
+void enable_breakpoints(dbg_ctx *ctx, const char *num) {
+    for_each_bp_arg(ctx, num, enable_bp);
+}
+
+void disable_breakpoints(dbg_ctx *ctx, const char *num) {
+    for_each_bp_arg(ctx, num, disable_bp);
+}
+
+
+uint64_t get_pc(dbg_ctx *ctx) {
+    return get_register_value(&ctx->thread->regs, AARCH64_PC_REGNUM);
+}
+
+void set_pc(dbg_ctx *ctx, const uint64_t val) {
+    set_register_value(&ctx->thread->regs, AARCH64_PC_REGNUM, val);
+}
+
+// Apply queued breakpoint changes and write back cached registers, then
+// let the selected thread run; the register cache is refilled lazily at
+// the next stop
+long resume_inferior(dbg_ctx *ctx, enum __ptrace_request request) {
+    thread_t *thread = ctx->thread;
+
+    bp_table_sync(&ctx->breakpoints);
+    bool flushed = flush_registers(&thread->regs);
+    invalidate_registers(&thread->regs);
+    if (!flushed)
+        return -1;
+
+    thread->last_request = request;
+    thread->reported = false;
+    long ret = ptrace(request, thread->tid, NULL, (void *)(long)thread->pending_sig);
+    thread->pending_sig = 0;
+    if (ret == 0)
+        thread->state = THREAD_RUNNING;
+    return ret;
+}
+
+static void resume_thread(thread_t *thread, enum __ptrace_request request) {
+    flush_registers(&thread->regs);
+    invalidate_registers(&thread->regs);
+
+    thread->last_request = request;
+    thread->reported = false;
+    if (ptrace(request, thread->tid, NULL, (void *)(long)thread->pending_sig) == 0)
+        thread->state = THREAD_RUNNING;
+    thread->pending_sig = 0;
+}
+
+static void resume_all_threads(dbg_ctx *ctx) {
+    for (size_t i = 0; i < ctx->threads.num_threads; ++i) {
+        thread_t *thread = ctx->threads.threads[i];
+        if (thread != ctx->thread && thread->state == THREAD_STOPPED)
+            resume_thread(thread, PTRACE_CONT);
     }
+    ctx->resumed_all = true;
+}
+
+// Threads that are not waited on run whenever the user let them
+static bool threads_run(dbg_ctx *ctx) {
+    return ctx->non_stop || ctx->resumed_all;
+}
+
+static thread_t *new_thread(dbg_ctx *ctx, pid_t tid) {
+    thread_t *thread = thread_add(&ctx->threads, tid);
+    printf("[New thread %d (LWP %d)]\n", thread->num, tid);
+    return thread;
+}
+
+// The new thread starts with an event stop of its own, which is swallowed
+// when it arrives. It may also have arrived already.
+// Forked children are not debugged. Each is let go at its first stop,
+// with the breakpoints taken out of its copy of the text and the watched
+// pages writable again. vfork children share the parent's memory until
+// they exec, so their forks are not traced at all.
+static void detach_fork(dbg_ctx *ctx, pid_t child) {
+    int wait_status;
+
+    if (waitpid(child, &wait_status, __WALL) < 0 || !WIFSTOPPED(wait_status))
+        return;
+
+    bp_table_restore_text(&ctx->breakpoints, child);
+    unwatch_fork(ctx, child);
+    ptrace(PTRACE_DETACH, child, NULL, NULL);
+}
+
+static void add_clone(dbg_ctx *ctx, thread_t *parent, int wait_status) {
+    unsigned long tid;
+
+    if (ptrace(PTRACE_GETEVENTMSG, parent->tid, NULL, &tid) < 0)
+        return;
+    if (wait_status >> 16 == PTRACE_EVENT_FORK)
+        detach_fork(ctx, tid);
+    else if (thread_find(&ctx->threads, tid) == NULL)
+        new_thread(ctx, tid)->stop_expected = true;
+}
+
+// A new thread, or a forked child
+static bool is_clone_event(int wait_status) {
+    return wait_status >> 8 == (SIGTRAP | (PTRACE_EVENT_CLONE << 8)) ||
+           wait_status >> 8 == (SIGTRAP | (PTRACE_EVENT_FORK << 8));
+}
+
+// PTRACE_INTERRUPT, and the first stop of a new thread of a seized process
+static bool is_event_stop(int wait_status) {
+    return wait_status >> 16 == PTRACE_EVENT_STOP;
+}
+
+static bool is_expected_stop(const thread_t *thread, int wait_status) {
+    return thread->stop_expected && (WSTOPSIG(wait_status) == SIGSTOP || is_event_stop(wait_status));
 }
 
-uint64_t get_pc(const pid_t pid) {
-    return get_register_value(pid, AARCH64_PC_REGNUM);
+// Wait for any thread of this inferior. waitpid(-1) would collect the
+// events of other inferiors too, so each thread is polled in turn, and
+// SIGCHLD, which the session keeps blocked, ends the sleep in between.
+static pid_t wait_threads(dbg_ctx *ctx, int *wait_status, bool block) {
+    struct timespec timeout = { 0, WAIT_POLL_NS };
+    sigset_t sigchld;
+
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+
+    while (1) {
+        bool waitable = false;
+        for (size_t i = 0; i < ctx->threads.num_threads; ++i) {
+            pid_t tid = waitpid(ctx->threads.threads[i]->tid, wait_status, __WALL | WNOHANG);
+            if (tid > 0)
+                return tid;
+            waitable |= tid == 0;
+        }
+        if (!waitable)
+            return -1;
+        if (!block)
+            return 0;
+        sigtimedwait(&sigchld, NULL, &timeout);
+    }
 }
 
-void set_pc(const pid_t pid, const uint64_t val) {
-    set_register_value(pid, AARCH64_PC_REGNUM, val);
+// All-stop: once one thread stops for the user the others are stopped
+// too. Whatever they run into on the way is kept for later. Signals are
+// delivered when they are resumed; breakpoint traps leave the pc at the
+// trap and are simply hit again.
+void stop_all_threads(dbg_ctx *ctx) {
+    ctx->resumed_all = false;
+
+    for (size_t i = 0; i < ctx->threads.num_threads; ++i) {
+        thread_t *thread = ctx->threads.threads[i];
+        if (thread->state == THREAD_RUNNING && !thread->stop_expected &&
+            ptrace(PTRACE_INTERRUPT, thread->tid, NULL, NULL) == 0)
+            thread->stop_expected = true;
+    }
+
+    while (1) {
+        bool running = false;
+        for (size_t i = 0; i < ctx->threads.num_threads; ++i)
+            running |= ctx->threads.threads[i]->state == THREAD_RUNNING;
+        if (!running)
+            break;
+
+        int wait_status;
+        pid_t tid = wait_threads(ctx, &wait_status, true);
+        if (tid < 0)
+            break;
+
+        thread_t *thread = thread_find(&ctx->threads, tid);
+        if (WIFEXITED(wait_status) || WIFSIGNALED(wait_status)) {
+            if (tid == ctx->pid) {
+                // the whole process is gone, the next resume finds out
+                check_if_exit(ctx, wait_status);
+                for (size_t i = 0; i < ctx->threads.num_threads; ++i)
+                    ctx->threads.threads[i]->state = THREAD_STOPPED;
+                break;
+            }
+            if (thread && thread != ctx->thread) {
+                printf("[Thread %d (LWP %d) exited]\n", thread->num, tid);
+                thread_remove(&ctx->threads, thread);
+            }
+            continue;
+        }
+        if (!WIFSTOPPED(wait_status))
+            continue;
+
+        if (thread == NULL) {
+            new_thread(ctx, tid);
+            continue;
+        }
+        thread->state = THREAD_STOPPED;
+
+        int sig = WSTOPSIG(wait_status);
+        if (is_clone_event(wait_status)) {
+            add_clone(ctx, thread, wait_status);
+        }
+        else if (is_expected_stop(thread, wait_status)) {
+            thread->stop_expected = false;
+        }
+        else if (is_event_stop(wait_status)) {
+            // a group stop, or an interrupt that lost the race to another stop
+        }
+        else if (sig == SIGTRAP) {
+            siginfo_t info;
+            ptrace(PTRACE_GETSIGINFO, tid, NULL, &info);
+            if (info.si_code != TRAP_BRKPT)
+                thread->pending_sig = sig;
+        }
+        else if (sig == SIGSEGV) {
+            // a store to a watched page faults again when resumed
+            siginfo_t info = get_signal_info(tid);
+            if (!is_watch_fault(ctx, &info))
+                thread->pending_sig = sig;
+        }
+        else {
+            thread->pending_sig = sig;
+        }
+    }
 }
 
-static bool check_if_exit(dbg_ctx *ctx, int wait_status) {
+bool check_if_exit(dbg_ctx *ctx, int wait_status) {
     if (WIFEXITED(wait_status)) {
+        trace_flush();
         int exit_status = WEXITSTATUS(wait_status);
         if (exit_status) {
             printf("Child %d exited normally with status %d\n", ctx->pid, exit_status);
@@ -173,129 +665,809 @@ static bool check_if_exit(dbg_ctx *ctx, int wait_status) {
         else {
             printf("Child exited with status %d\n", exit_status);
         }
+        ctx->exited = true;
+        return true;
+    }
+    if (WIFSIGNALED(wait_status)) {
+        trace_flush();
+        printf("Child %d terminated by signal %s\n", ctx->pid, strsignal(WTERMSIG(wait_status)));
+        ctx->exited = true;
         return true;
     }
     return false;
 }
 
-bool wait_for_signal(dbg_ctx *ctx) {
+static void print_location(dbg_ctx *ctx) {
+    uint64_t pc = get_pc(ctx);
+    const char *func = symbol_at(ctx, pc);
+    printf(BLU "0x%lx" RESET " in " YEL "%s ()" RESET "\n", pc, func ? func : "??");
+
+    struct src_info src_info = get_src_info(ctx, sub_load_addr(ctx, pc));
+    print_source(ctx, &src_info);
+}
+
+// Wait for a stop worth reporting from wait_tid, or from any thread if
+// it is -1. Thread creation and exit and the stops the debugger asks for
+// itself are dealt with here and never reach the caller. Without block
+// it returns WAIT_NONE as soon as there is nothing more to collect.
+static wait_result_t wait_event(dbg_ctx *ctx, pid_t wait_tid, bool block) {
+    pid_t prev_tid = ctx->thread->tid;
+    thread_t *thread;
+    int wait_status;
+
+    ctx->auto_resume = false;
+
+    while (1) {
+        pid_t tid = wait_tid == -1 ? wait_threads(ctx, &wait_status, block) :
+                    waitpid(wait_tid, &wait_status, __WALL | (block ? 0 : WNOHANG));
+        if (tid == 0)
+            return WAIT_NONE;
+        if (tid < 0) {
+            printf("Child %d is gone\n", ctx->pid);
+            ctx->exited = true;
+            return WAIT_EXITED;
+        }
+        thread = thread_find(&ctx->threads, tid);
+
+        if (WIFEXITED(wait_status) || WIFSIGNALED(wait_status)) {
+            if (tid == ctx->pid) {
+                check_if_exit(ctx, wait_status);
+                return WAIT_EXITED;
+            }
+            if (thread == NULL)
+                continue;
+
+            printf("[Thread %d (LWP %d) exited]\n", thread->num, tid);
+            bool selected = thread == ctx->thread;
+            thread_remove(&ctx->threads, thread);
+            if (!selected)
+                continue;
+
+            // the main thread outlives the others
+            ctx->thread = ctx->threads.threads[0];
+            if (wait_tid == -1)
+                continue;
+            printf("[Switching to thread %d (LWP %d)]\n", ctx->thread->num, ctx->thread->tid);
+            return WAIT_STOPPED;
+        }
+        if (!WIFSTOPPED(wait_status))
+            continue;
+
+        // a new thread's first stop can come before its parent's clone event
+        if (thread == NULL) {
+            thread = new_thread(ctx, tid);
+            if (threads_run(ctx))
+                resume_thread(thread, PTRACE_CONT);
+            continue;
+        }
+        thread->state = THREAD_STOPPED;
+
+        // the event interrupted whatever the thread was resumed for
+        if (is_clone_event(wait_status)) {
+            add_clone(ctx, thread, wait_status);
+            resume_thread(thread, thread->last_request);
+            continue;
+        }
+        if (is_expected_stop(thread, wait_status)) {
+            thread->stop_expected = false;
+            if (tid == wait_tid || threads_run(ctx))
+                resume_thread(thread, thread->last_request);
+            continue;
+        }
+        break;
+    }
+
+    ctx->thread = thread;
+
+    if (is_event_stop(wait_status)) {
+        printf("\nProgram stopped at ");
+        print_location(ctx);
+    }
+    else {
+        siginfo_t siginfo = get_signal_info(thread->tid);
+        switch (siginfo.si_signo) {
+            case SIGTRAP:
+                handle_sigtrap(ctx, siginfo);
+                break;
+            case SIGSEGV:
+                if (!watch_fault(ctx, &siginfo)) {
+                    printf("Segfault: %d\n", siginfo.si_code);
+                    break;
+                }
+                if (ctx->exited)
+                    return WAIT_EXITED;
+                // the stepped store may have brought the thread to a breakpoint
+                if (at_breakpoint(ctx)) {
+                    bool changed = !ctx->auto_resume;
+                    ctx->auto_resume = false;
+                    bp_info(ctx);
+                    ctx->auto_resume &= !changed;
+                }
+                else if (!ctx->auto_resume) {
+                    print_location(ctx);
+                }
+                break;
+            case SIGCHLD:
+                printf("Exiting\n");
+                break;
+            default:
+                printf("Got signal: %s\n", strsignal(siginfo.si_signo));
+                break;
+        }
+    }
+
+    if (!ctx->auto_resume) {
+        thread->reported = true;
+        if (!ctx->non_stop)
+            stop_all_threads(ctx);
+        if (thread->tid != prev_tid)
+            printf("[Switching to thread %d (LWP %d)]\n", thread->num, thread->tid);
+    }
+
+    return WAIT_STOPPED;
+}
+
+// Only the selected thread is waited on. In non-stop mode the others may
+// stop meanwhile; their stops are collected by the event loop.
+// Collect the exit of a thread that can no longer be traced. False if it
+// stopped instead, i.e. it is still there.
+static bool reap_thread_exit(pid_t tid, int *wait_status) {
+    while (waitpid(tid, wait_status, __WALL) == tid) {
+        if (WIFEXITED(*wait_status) || WIFSIGNALED(*wait_status))
+            return true;
+        if (WIFSTOPPED(*wait_status))
+            return false;
+    }
+    return false;
+}
+
+// The selected thread failed a ptrace request. One killed while stopped,
+// by another thread's exit_group or execve, fails them all with ESRCH
+// until its exit is collected; it is dropped then, and the main thread
+// takes over. The main thread only goes with the whole process, and its
+// exit is reported once the other threads' exits have been collected.
+// Returns false if the thread is still there.
+bool drop_vanished_thread(dbg_ctx *ctx) {
+    thread_t *thread = ctx->thread;
     int wait_status;
-    int options = 0;
-    waitpid(ctx->pid, &wait_status, options);
-    if (check_if_exit(ctx, wait_status)) {
+
+    if (errno != ESRCH) {
+        perror("Error: ");
         return false;
     }
 
-    siginfo_t siginfo = get_signal_info(ctx->pid);
-    switch (siginfo.si_signo) {
-        case SIGTRAP:
-            handle_sigtrap(ctx, siginfo);
-            break;
-        case SIGSEGV:
-            printf("Segfault: %d\n", siginfo.si_code);
-            break;
-        case SIGCHLD:
-            printf("Exiting\n");
-            break;
-        default:
-            printf("Got signal: %s\n", strsignal(siginfo.si_signo));
-            break;
+    if (thread->tid != ctx->pid) {
+        if (!reap_thread_exit(thread->tid, &wait_status)) {
+            thread->state = THREAD_STOPPED;
+            return false;
+        }
+        printf("[Thread %d (LWP %d) exited]\n", thread->num, thread->tid);
+        thread_remove(&ctx->threads, thread);
+        ctx->thread = ctx->threads.threads[0];
+        printf("[Switching to thread %d (LWP %d)]\n", ctx->thread->num, ctx->thread->tid);
+        return true;
+    }
+
+    for (size_t i = ctx->threads.num_threads; i-- > 1;) {
+        thread_t *other = ctx->threads.threads[i];
+        if (!reap_thread_exit(other->tid, &wait_status)) {
+            other->state = THREAD_STOPPED;
+            return false;
+        }
+        thread_remove(&ctx->threads, other);
     }
 
+    if (reap_thread_exit(ctx->pid, &wait_status)) {
+        check_if_exit(ctx, wait_status);
+    }
+    else {
+        printf("Child %d is gone\n", ctx->pid);
+        ctx->exited = true;
+    }
     return true;
 }
 
+bool wait_for_signal(dbg_ctx *ctx) {
+    return wait_event(ctx, ctx->thread->tid, true) != WAIT_EXITED;
+}
+
+// Synchronous faults are raised again each time the instruction is retried
+static bool is_fault_signal(int sig) {
+    return sig == SIGSEGV || sig == SIGBUS || sig == SIGILL || sig == SIGFPE;
+}
+
+// Single-step the selected thread for the debugger's own purposes: the
+// stop is not reported and the other threads are left as they are.
+// Signals that come in the way are queued for the thread; one raised by
+// the instruction itself ends the step with the instruction not executed.
+thread_step_t step_thread(dbg_ctx *ctx) {
+    thread_t *thread = ctx->thread;
+    int wait_status;
+
+    bp_table_sync(&ctx->breakpoints);
+    bool flushed = flush_registers(&thread->regs);
+    invalidate_registers(&thread->regs);
+
+    while (1) {
+        if (!flushed || ptrace(PTRACE_SINGLESTEP, thread->tid, NULL, NULL) < 0) {
+            drop_vanished_thread(ctx);
+            return THREAD_GONE;
+        }
+        if (waitpid(thread->tid, &wait_status, __WALL) < 0)
+            return THREAD_GONE;
+
+        if (WIFEXITED(wait_status) || WIFSIGNALED(wait_status)) {
+            if (thread->tid == ctx->pid) {
+                check_if_exit(ctx, wait_status);
+                return THREAD_GONE;
+            }
+            printf("[Thread %d (LWP %d) exited]\n", thread->num, thread->tid);
+            thread_remove(&ctx->threads, thread);
+            ctx->thread = ctx->threads.threads[0];
+            printf("[Switching to thread %d (LWP %d)]\n", ctx->thread->num, ctx->thread->tid);
+            return THREAD_GONE;
+        }
+        if (!WIFSTOPPED(wait_status))
+            continue;
+
+        // the events interrupted the step, which is simply done again
+        if (is_clone_event(wait_status)) {
+            add_clone(ctx, thread, wait_status);
+            continue;
+        }
+        if (is_expected_stop(thread, wait_status)) {
+            thread->stop_expected = false;
+            continue;
+        }
+        if (is_event_stop(wait_status))
+            continue;
+
+        int sig = WSTOPSIG(wait_status);
+        if (sig == SIGTRAP)
+            return THREAD_STEPPED;
+
+        siginfo_t info = get_signal_info(thread->tid);
+        if (is_watch_fault(ctx, &info)) {
+            // the store is stepped there; a changed value is shown, the
+            // step goes on
+            bool auto_resume = ctx->auto_resume;
+            bool handled = watch_fault(ctx, &info);
+            ctx->auto_resume = auto_resume;
+            if (ctx->exited)
+                return THREAD_GONE;
+            if (handled)
+                return THREAD_STEPPED;
+            sig = info.si_signo;
+        }
+
+        thread->pending_sig = sig;
+        if (is_fault_signal(sig))
+            return THREAD_FAULTED;
+    }
+}
+
+// Wait for the selected thread while the others may be running too.
+// Their hits that do not stop, such as those on the breakpoints of a
+// step, are stepped over and resumed; a stop they report ends the wait.
+bool wait_for_selected(dbg_ctx *ctx) {
+    thread_t *selected = ctx->thread;
+
+    if (ctx->non_stop || !ctx->resumed_all)
+        return wait_for_signal(ctx);
+
+    while (1) {
+        if (wait_event(ctx, -1, true) == WAIT_EXITED)
+            return false;
+        if (ctx->thread == selected || !ctx->auto_resume)
+            return true;
+
+        step_over_breakpoint(ctx);
+        if (resume_inferior(ctx, PTRACE_CONT) < 0 && errno != ESRCH)
+            return false;
+        ctx->thread = selected;
+    }
+}
+
 void step_over_breakpoint(dbg_ctx *ctx) {
-    uint64_t possible_bp_loc = get_pc(ctx->pid);
+    // a trap queued at the current pc must be stepped over, not hit
+    bp_table_sync(&ctx->breakpoints);
 
-    breakpoint_t *bp = get_bp_at_address(ctx, possible_bp_loc);
-    if (bp && bp->enabled) {
-        disable_breakpoint(bp);
+    bp_site_t *site = at_breakpoint(ctx);
+    if (site && site->inserted) {
+        // branches and ADR/ADRP need no step at all, most other
+        // instructions are stepped out of line with the trap left in place
+        if (emulate_insn(ctx, site->addr, site->saved_insn))
+            return;
+        if (displaced_step(ctx, site->addr, site->saved_insn))
+            return;
 
-        if (ptrace(PTRACE_SINGLESTEP, ctx->pid, NULL, NULL) < 0) {
-            perror("Error: ");
-            exit(EXIT_FAILURE);
+        remove_bp_site(ctx->pid, site);
+        step_thread(ctx);
+        if (!ctx->exited)
+            insert_bp_site(ctx->pid, site);
+    }
+}
+
+void list_threads(dbg_ctx *ctx) {
+    printf("  Id   LWP      Frame\n");
+    for (size_t i = 0; i < ctx->threads.num_threads; ++i) {
+        thread_t *thread = ctx->threads.threads[i];
+        printf("%c %-4d %-8d ", thread == ctx->thread ? '*' : ' ', thread->num, thread->tid);
+
+        if (thread->state == THREAD_RUNNING) {
+            printf("(running)\n");
+            continue;
         }
 
-        wait_for_signal(ctx);
-        enable_breakpoint(bp);
+        uint64_t pc = get_register_value(&thread->regs, AARCH64_PC_REGNUM);
+        const char *func = symbol_at(ctx, pc);
+        printf(BLU "0x%016lx" RESET " in " YEL "%s ()" RESET "\n", pc, func ? func : "??");
+    }
+}
+
+void select_thread(dbg_ctx *ctx, const char *num) {
+    if (num == NULL) {
+        printf("[Current thread is %d (LWP %d)]\n", ctx->thread->num, ctx->thread->tid);
+        return;
+    }
+
+    thread_t *thread = thread_find_num(&ctx->threads, strtol(num, NULL, 10));
+    if (thread == NULL) {
+        printf("Invalid thread ID: %s\n", num);
+        return;
+    }
+    if (thread->state == THREAD_RUNNING) {
+        printf("Thread %d is running.\n", thread->num);
+        return;
+    }
+
+    ctx->thread = thread;
+    printf("[Switching to thread %d (LWP %d)]\n", thread->num, thread->tid);
+
+    struct src_info src_info = get_src_info(ctx, sub_load_addr(ctx, get_pc(ctx)));
+    print_source(ctx, &src_info);
+}
+
+// Leaving non-stop mode stops whatever is still running
+void set_non_stop(dbg_ctx *ctx, bool on) {
+    if (ctx->running) {
+        printf("Cannot change this setting while the inferior is running.\n");
+        return;
+    }
+    if (ctx->non_stop && !on) {
+        ctx->non_stop = false;
+        stop_all_threads(ctx);
+    }
+    ctx->non_stop = on;
+    printf("Non-stop mode is %s.\n", on ? "on" : "off");
+}
+
+static unwinder_t *find_unwinder(void *arg, uint64_t pc, uint64_t *load_bias) {
+    dbg_ctx *ctx = arg;
+
+    module_t *mod = solib_find(&ctx->solibs, pc);
+    if (mod) {
+        *load_bias = mod->bias;
+        return module_unwinder(mod);
+    }
+
+    if (!ctx->bin->unwinder.loaded)
+        unwind_load(&ctx->bin->unwinder, ctx->bin->elf);
+    *load_bias = add_load_addr(ctx, 0);
+    return &ctx->bin->unwinder;
+}
+
+// Frames in shared libraries are unwound with the library's own CFI
+size_t unwind_thread(dbg_ctx *ctx, unwind_frame_t *frames, size_t max_frames) {
+    return unwind_stack(&ctx->bin->unwinder, find_unwinder, ctx, ctx->pid, &ctx->thread->regs,
+                        frames, max_frames);
+}
+
+// Outer frames are symbolized at the call instruction, not the return address
+void print_backtrace(dbg_ctx *ctx, size_t limit) {
+    unwind_frame_t frames[UNWIND_MAX_FRAMES];
+
+    if (limit == 0 || limit > UNWIND_MAX_FRAMES)
+        limit = UNWIND_MAX_FRAMES;
+
+    size_t depth = unwind_thread(ctx, frames, limit);
+
+    for (size_t i = 0; i < depth; ++i) {
+        uint64_t pc = sub_load_addr(ctx, i == 0 ? frames[i].pc : frames[i].pc - 4);
+        const char *func = symbol_at(ctx, i == 0 ? frames[i].pc : frames[i].pc - 4);
+        struct src_info src_info = get_src_info(ctx, pc);
+
+        printf("#%-3zu " BLU "0x%016lx" RESET " in " YEL "%s ()" RESET, i, frames[i].pc, func ? func : "??");
+        if (src_info.src_file_name)
+            printf(" at " GRN "%s" RESET ":%llu", loc_last_dir(src_info.src_file_name), src_info.line_no);
+        printf("\n");
     }
 }
 
 void single_step(dbg_ctx *ctx) {
-    breakpoint_t *bp = at_breakpoint(ctx);
-    if (bp && bp->enabled) {
+    bp_table_sync(&ctx->breakpoints);
+
+    bp_site_t *site = at_breakpoint(ctx);
+    if (site && site->inserted) {
         step_over_breakpoint(ctx);
     }
+    else {
+        if (resume_inferior(ctx, PTRACE_SINGLESTEP) < 0) {
+            drop_vanished_thread(ctx);
+            return;
+        }
+        if (!wait_for_signal(ctx))
+            return;
+    }
 
-    uint64_t pc = sub_load_addr(ctx, get_pc(ctx->pid));
+    uint64_t pc = sub_load_addr(ctx, get_pc(ctx));
 
     struct src_info src_info = get_src_info(ctx, pc);
-    print_source(&src_info);
+    print_source(ctx, &src_info);
+}
 
-    if (ptrace(PTRACE_SINGLESTEP, ctx->pid, NULL, NULL) < 0) {
-        perror("Error: ");
-        exit(EXIT_FAILURE);
+// Every thread that last stopped for the user at a breakpoint is moved
+// past it while the others are still held
+static void step_threads_over_breakpoints(dbg_ctx *ctx) {
+    thread_t *selected = ctx->thread;
+
+    for (size_t i = 0; i < ctx->threads.num_threads; ++i) {
+        thread_t *thread = ctx->threads.threads[i];
+        if (thread == selected || thread->state != THREAD_STOPPED || !thread->reported)
+            continue;
+
+        ctx->thread = thread;
+        step_over_breakpoint(ctx);
+        thread->reported = false;
     }
+    if (thread_find(&ctx->threads, selected->tid) == selected)
+        ctx->thread = selected;
 }
 
-bool continue_execution(dbg_ctx *ctx) {
+// All-stop: the threads other than the selected one run as well, moved
+// past the breakpoints they were reported at
+void resume_other_threads(dbg_ctx *ctx) {
+    if (ctx->non_stop || ctx->resumed_all)
+        return;
+    step_threads_over_breakpoints(ctx);
+    resume_all_threads(ctx);
+}
+
+// Let the inferior go: every thread in all-stop mode, the selected one in
+// non-stop mode. The stop is collected by poll_inferior.
+bool resume_execution(dbg_ctx *ctx) {
+    if (!ctx->non_stop)
+        step_threads_over_breakpoints(ctx);
+
     step_over_breakpoint(ctx);
-    if (ptrace(PTRACE_CONT, ctx->pid, NULL, NULL) < 0)
-    {
+    if (resume_inferior(ctx, PTRACE_CONT) < 0 && errno != ESRCH)
         return false;
+    if (!ctx->non_stop && !ctx->resumed_all)
+        resume_all_threads(ctx);
+
+    ctx->running = true;
+    return true;
+}
+
+// Collect every stop that has happened, without blocking. Hits whose
+// condition fails or that are being ignored go straight back to the
+// inferior. collected is set if anything was. Returns false once the
+// process has exited.
+bool poll_inferior(dbg_ctx *ctx, bool *collected) {
+    while (1) {
+        wait_result_t res = wait_event(ctx, -1, false);
+        if (res == WAIT_NONE)
+            return true;
+        *collected = true;
+        if (res == WAIT_EXITED)
+            return false;
+
+        if (ctx->auto_resume) {
+            step_over_breakpoint(ctx);
+            resolve_indexed_breakpoints(ctx);
+            if (resume_inferior(ctx, PTRACE_CONT) < 0 && errno != ESRCH)
+                return false;
+            // whatever stopped the others meanwhile, they were let go too
+            resume_other_threads(ctx);
+            continue;
+        }
+
+        // traced output comes before the prompt
+        trace_flush();
+        ctx->running = false;
+    }
+}
+
+// Stop the selected thread, or in all-stop mode any running thread; the
+// others follow as for any other stop
+void interrupt_inferior(dbg_ctx *ctx) {
+    thread_t *target = ctx->thread->state == THREAD_RUNNING ? ctx->thread : NULL;
+
+    for (size_t i = 0; target == NULL && !ctx->non_stop && i < ctx->threads.num_threads; ++i) {
+        if (ctx->threads.threads[i]->state == THREAD_RUNNING && !ctx->threads.threads[i]->stop_expected)
+            target = ctx->threads.threads[i];
+    }
+
+    if (target == NULL) {
+        printf("The program is not being run.\n");
+        return;
+    }
+    if (ptrace(PTRACE_INTERRUPT, target->tid, NULL, NULL) < 0)
+        perror("Error: ");
+}
+
+// Leave the process to run on its own, with its text as it was. Every
+// thread has to be stopped to be detached; signals they were stopped
+// with are passed on.
+void detach_inferior(dbg_ctx *ctx) {
+    stop_all_threads(ctx);
+    delete_watchpoints(ctx);
+    ftrace_stop(&ctx->ftrace, &ctx->breakpoints);
+    bp_table_remove_traps(&ctx->breakpoints);
+
+    for (size_t i = 0; i < ctx->threads.num_threads; ++i) {
+        thread_t *thread = ctx->threads.threads[i];
+        flush_registers(&thread->regs);
+        ptrace(PTRACE_DETACH, thread->tid, NULL, (void *)(long)thread->pending_sig);
     }
 
-    return wait_for_signal(ctx);
+    ctx->running = false;
+    ctx->detached = true;
+    printf("[Inferior %d (process %d) detached]\n", ctx->num, ctx->pid);
 }
 
+// Run argv[0] with argv and the debugger's own environment. The child
+// waits on a pipe until it has been seized, so no instruction of the new
+// image runs untraced. It gets a process group of its own, which the
+// session makes the terminal's foreground group while it runs in the
+// foreground.
+pid_t spawn_seized(char *const argv[], long options) {
+    int sync_pipe[2];
+
+    if (pipe(sync_pipe) < 0) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
 
-void init_elf(dbg_ctx *ctx) {
-    if (elf_version(EV_CURRENT) == EV_NONE) {
-        printf("ELF library initialization failed: %s\n", elf_errmsg(elf_errno()));
+    pid_t pid = fork();
+    if (pid == 0) {
+        char c;
+        sigset_t none;
+
+        close(sync_pipe[1]);
+        if (read(sync_pipe[0], &c, 1) != 1)
+            _exit(EXIT_FAILURE);
+
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        setpgid(0, 0);
+        execve(argv[0], argv, environ);
+        _exit(127);
+    }
+
+    close(sync_pipe[0]);
+    if (ptrace(PTRACE_SEIZE, pid, NULL, options) < 0) {
+        perror("Error: ");
         exit(EXIT_FAILURE);
     }
-    if ((ctx->elf = elf_begin(ctx->elf_fd, ELF_C_READ, NULL)) == NULL) {
-        printf(" elf_begin () failed: %s\n", elf_errmsg(elf_errno()));
+    if (write(sync_pipe[1], "x", 1) != 1) {
+        perror("Error: ");
         exit(EXIT_FAILURE);
     }
-    if (elf_kind(ctx->elf) != ELF_K_ELF) {
-        printf("Error: file is not an ELF object\n");
+    close(sync_pipe[1]);
+
+    return pid;
+}
+
+
+static uint64_t read_auxv(pid_t pid, uint64_t type) {
+    char path[64];
+    uint64_t entry[2], val = 0;
+
+    sprintf(path, "/proc/%d/auxv", pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Error opening %s\n", path);
+        perror("Error");
         exit(EXIT_FAILURE);
     }
+
+    while (fread(entry, sizeof(entry), 1, file) == 1 && entry[0] != AT_NULL) {
+        if (entry[0] == type) {
+            val = entry[1];
+            break;
+        }
+    }
+
+    fclose(file);
+    return val;
+}
+
+static const Elf64_Phdr *find_phdr(dbg_ctx *ctx, uint32_t type) {
+    Elf64_Ehdr *ehdr = elf64_getehdr(ctx->bin->elf);
+    Elf64_Phdr *phdrs = elf64_getphdr(ctx->bin->elf);
+
+    for (int i = 0; phdrs && i < ehdr->e_phnum; ++i)
+        if (phdrs[i].p_type == type)
+            return &phdrs[i];
+    return NULL;
 }
 
-void close_elf(dbg_ctx *ctx) {
-    elf_end(ctx->elf);
-    close(ctx->elf_fd);
+// The start of the mapping of the executable's first page, less the
+// address it was linked at. Readable without stopping the process.
+static bool load_addr_from_maps(dbg_ctx *ctx) {
+    const Elf64_Phdr *first_load = find_phdr(ctx, PT_LOAD);
+    char path[32], line[PATH_MAX + 128];
+    bool found = false;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", ctx->pid);
+    FILE *maps = fopen(path, "r");
+    if (maps == NULL || first_load == NULL) {
+        if (maps)
+            fclose(maps);
+        return false;
+    }
+
+    while (!found && fgets(line, sizeof(line), maps)) {
+        unsigned long start, offset, inode;
+        if (sscanf(line, "%lx-%*x %*s %lx %*s %lu", &start, &offset, &inode) != 3)
+            continue;
+        if (inode == ctx->bin->ino && offset == 0) {
+            ctx->load_addr = start - (first_load->p_vaddr & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1));
+            found = true;
+        }
+    }
+
+    fclose(maps);
+    return found;
 }
 
 void init_load_addr(dbg_ctx *ctx) {
-    FILE *file;
-    char *linebuf, *filebuf;
-    size_t buf_size = 100;
- 
-    if (bin_is_pie(ctx->elf)) {
-        filebuf = malloc(buf_size * sizeof(char));
+    if (!ctx->bin->is_pie || load_addr_from_maps(ctx))
+        return;
+
+    // the kernel passes the entry point it jumps to in the auxiliary vector
+    Elf64_Ehdr *ehdr = elf64_getehdr(ctx->bin->elf);
+    ctx->load_addr = read_auxv(ctx->pid, AT_ENTRY) - ehdr->e_entry;
+}
+
+// The dynamic linker stores the address of its r_debug in the
+// executable's DT_DEBUG entry once it has started
+static uint64_t find_r_debug(dbg_ctx *ctx) {
+    const Elf64_Phdr *dynamic = find_phdr(ctx, PT_DYNAMIC);
+    if (dynamic == NULL)
+        return 0;
+
+    uint64_t addr = add_load_addr(ctx, dynamic->p_vaddr);
+    for (size_t i = 0; i < dynamic->p_memsz / sizeof(Elf64_Dyn); ++i) {
+        Elf64_Dyn dyn;
+        if (read_memory_range(ctx->pid, addr + i * sizeof(dyn), &dyn, sizeof(dyn)) != sizeof(dyn) ||
+            dyn.d_tag == DT_NULL)
+            break;
+        if (dyn.d_tag == DT_DEBUG)
+            return dyn.d_un.d_val;
+    }
+    return 0;
+}
+
+static uint64_t find_solib_symbol(dbg_ctx *ctx, const char *name, module_t **found) {
+    for (size_t i = 0; i < ctx->solibs.num_mods; ++i) {
+        uint64_t addr = module_lookup(ctx->solibs.mods[i], name);
+        if (addr) {
+            if (found)
+                *found = ctx->solibs.mods[i];
+            return addr;
+        }
+    }
+    return 0;
+}
+
+static void resolve_pending_breakpoints(dbg_ctx *ctx) {
+    for (breakpoint_t *bp = ctx->breakpoints.head; bp; bp = bp->next) {
+        if (bp->kind != BP_USER || bp->pending == NULL)
+            continue;
+
+        module_t *mod;
+        uint64_t addr = find_solib_symbol(ctx, bp->pending, &mod);
+        if (addr == 0)
+            continue;
+
+        bp_add_location(&ctx->breakpoints, bp, addr);
+        printf("Breakpoint %d at 0x%lx: %s (%s)\n", bp->num, addr, bp->pending, mod->path);
+        free(bp->pending);
+        bp->pending = NULL;
+    }
+}
 
-        sprintf(filebuf, "/proc/%d/maps", ctx->pid);
+// Locations in a dlclosed library go away with it. A user breakpoint set
+// on one of its functions goes back to pending on that function, to be
+// resolved again when a library defining it is loaded.
+static void solib_unloaded(void *arg, module_t *mod) {
+    dbg_ctx *ctx = arg;
 
-        if ((file = fopen(filebuf, "r")) == NULL) {
-            printf("Error opening %s\n", filebuf);
-            perror("Error");
-            exit(EXIT_FAILURE);
+    for (breakpoint_t *bp = ctx->breakpoints.head; bp; bp = bp->next) {
+        bp_location_t *loc = bp->locs;
+        while (loc) {
+            bp_location_t *next = loc->next_in_bp;
+            uint64_t addr = loc->site->addr;
+
+            if (addr >= mod->low && addr < mod->high) {
+                if (bp->kind == BP_USER && bp->pending == NULL) {
+                    const char *name = module_symbol_at(mod, addr);
+                    if (name && module_lookup(mod, name) == addr)
+                        bp->pending = strdup(name);
+                }
+                bp_drop_location(&ctx->breakpoints, loc);
+            }
+            loc = next;
         }
+    }
+}
+
+// Called at the dynamic linker's _dl_debug_state, after every change to
+// the link_map chain
+static void solib_event(dbg_ctx *ctx) {
+    if (ctx->solibs.r_debug == 0)
+        ctx->solibs.r_debug = find_r_debug(ctx);
+
+    if (solib_sync(&ctx->solibs, ctx->pid, solib_unloaded, ctx) > 0)
+        resolve_pending_breakpoints(ctx);
+}
+
+// Read the library list without a breakpoint on the dynamic linker, for
+// a process that has no breakpoints, e.g. one being profiled
+void solib_refresh(dbg_ctx *ctx) {
+    if (ctx->solibs.r_debug == 0)
+        ctx->solibs.r_debug = find_r_debug(ctx);
+
+    solib_sync(&ctx->solibs, ctx->pid, NULL, NULL);
+}
 
-        linebuf = malloc(buf_size * sizeof(char));
-        getline(&linebuf, &buf_size, file);
+// Only the dynamic linker is known at the first stop; the libraries are
+// picked up as it maps them. Statically linked programs have no PT_INTERP.
+void solib_start(dbg_ctx *ctx) {
+    const Elf64_Phdr *interp = find_phdr(ctx, PT_INTERP);
+    if (interp == NULL)
+        return;
 
-        char *addr = strtok(linebuf, "-");
+    char path[SOLIB_PATH_MAX] = {};
+    size_t len = interp->p_filesz < sizeof(path) - 1 ? interp->p_filesz : sizeof(path) - 1;
+    if (pread(ctx->bin->elf_fd, path, len, interp->p_offset) != (ssize_t)len)
+        return;
 
-        ctx->load_addr = strtol(addr, NULL, 16);
+    module_t *ld = solib_add(&ctx->solibs, path, read_auxv(ctx->pid, AT_BASE));
+    if (ld == NULL)
+        return;
 
-        free(linebuf);
-        free(filebuf);
-        fclose(file);
+    uint64_t brk = module_lookup(ld, "_dl_debug_state");
+    if (brk == 0) {
+        printf("Warning: %s has no _dl_debug_state, shared libraries are not tracked\n", path);
+        return;
     }
+    bp_add_location(&ctx->breakpoints, bp_create_internal(&ctx->breakpoints, BP_SOLIB), brk);
+
+    // already running, e.g. attached to
+    solib_event(ctx);
 }
 
+// Function name for a runtime address, in the executable or a shared library
+const char *symbol_at(dbg_ctx *ctx, uint64_t addr) {
+    module_t *mod = solib_find(&ctx->solibs, addr);
+    if (mod)
+        return module_symbol_at(mod, addr);
+    return get_func_symbol_from_pc(ctx, sub_load_addr(ctx, addr));
+}
+
+void list_solibs(dbg_ctx *ctx) {
+    if (ctx->solibs.num_mods == 0) {
+        printf("No shared libraries loaded at this time.\n");
+        return;
+    }
+
+    printf("From                To                  Syms Read   Shared Object Library\n");
+    for (size_t i = 0; i < ctx->solibs.num_mods; ++i) {
+        module_t *mod = ctx->solibs.mods[i];
+        printf("0x%016lx  0x%016lx  %-11s %s\n", mod->low, mod->high,
+               mod->loaded ? (mod->elf ? "Yes" : "Failed") : "No", mod->path);
+    }
+}
@@ -2,49 +2,132 @@
 #define DEBUGGER_H
 
 #include <unistd.h>
+#include <sys/ptrace.h>
 
 #include <libdwarf-0/dwarf.h>
 #include <libdwarf-0/libdwarf.h>
 #include <libelf.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "breakpoint.h"
+#include "func_index.h"
+#include "sym_index.h"
+#include "line_table.h"
+#include "source_cache.h"
+#include "registers.h"
+#include "memory.h"
+#include "ftrace.h"
+#include "unwind.h"
+#include "solib.h"
+#include "index_cache.h"
+#include "binary.h"
+#include "threads.h"
+#include "watchpoint.h"
 
-#define MAX_BREAKPOINTS 32
+// Longest sleep between polls of the threads of an inferior
+#define WAIT_POLL_NS    (10 * 1000 * 1000)
+
+typedef enum {
+    WAIT_NONE,
+    WAIT_STOPPED,
+    WAIT_EXITED,
+} wait_result_t;
+
+typedef enum {
+    THREAD_STEPPED,
+    THREAD_FAULTED,     // the instruction raised a signal, queued for the thread
+    THREAD_GONE,        // the thread or the whole process exited
+} thread_step_t;
+
+struct inferior_table;
 
 typedef struct {
-    const char *program_name;
+    int num;                // inferior number, as listed by "info inferiors"
     pid_t pid;
-    int active_breakpoints;
-    breakpoint_t *breakpoints[MAX_BREAKPOINTS];
-    Dwarf_Debug dwarf;
-    Elf *elf;
-    int elf_fd;
+    binary_t *bin;          // shared with other inferiors of the same file
+    struct inferior_table *inferiors;
+    bool attached;          // was running before the debugger came along
+    bool exited;
+    bool detached;
+    thread_table_t threads;
+    thread_t *thread;       // selected thread, the one commands act on
+    bool non_stop;          // a stop pauses only the thread that stopped
+    bool resumed_all;       // every thread was let go by the last continue
+    bool running;           // resumed, the stop has not been collected yet
+    bool foreground;        // the prompt waits for that stop
+    bp_table_t breakpoints;
+    watch_table_t watch;
+    source_file_t *list_file;
+    size_t list_first;
     intptr_t load_addr;
+    uint64_t scratch_addr;
+    bool scratch_failed;
+    bool scratch_valid;
+    uint32_t scratch_insn;
+    ftrace_t ftrace;
+    solib_t solibs;
+    bool auto_resume;   // last stop was a breakpoint that chose not to stop
     char **args;
 } dbg_ctx;
 
-void init_elf(dbg_ctx *ctx);
-void close_elf(dbg_ctx *ctx);
 void free_debugger(dbg_ctx *ctx);
 void init_load_addr(dbg_ctx *ctx);
+void solib_start(dbg_ctx *ctx);
+void solib_refresh(dbg_ctx *ctx);
+const char *symbol_at(dbg_ctx *ctx, uint64_t addr);
+void list_solibs(dbg_ctx *ctx);
+uint64_t sub_load_addr(dbg_ctx *ctx, uint64_t addr);
+uint64_t add_load_addr(dbg_ctx *ctx, uint64_t addr);
 
-bool continue_execution(dbg_ctx *ctx);
+bool resume_execution(dbg_ctx *ctx);
+bool poll_inferior(dbg_ctx *ctx, bool *collected);
+void interrupt_inferior(dbg_ctx *ctx);
+void stop_all_threads(dbg_ctx *ctx);
+void resume_other_threads(dbg_ctx *ctx);
+void detach_inferior(dbg_ctx *ctx);
+pid_t spawn_seized(char *const argv[], long options);
 
 void list_breakpoints(const dbg_ctx *ctx);
-void set_bp_at_addr(dbg_ctx *ctx, uint64_t addr);
-void set_bp_at_func(dbg_ctx *ctx, const char *symbol);
+breakpoint_t *set_bp_at_addr(dbg_ctx *ctx, uint64_t addr);
+breakpoint_t *set_bp_at_func(dbg_ctx *ctx, const char *symbol);
+void resolve_indexed_breakpoints(dbg_ctx *ctx);
+void delete_breakpoints(dbg_ctx *ctx, const char *num);
+void enable_breakpoints(dbg_ctx *ctx, const char *num);
+void disable_breakpoints(dbg_ctx *ctx, const char *num);
+bool set_bp_condition(breakpoint_t *bp, const char *text);
+void condition_breakpoint(dbg_ctx *ctx, const char *num, const char *text);
+void ignore_breakpoint(dbg_ctx *ctx, const char *num, const char *count);
+void ftrace_functions(dbg_ctx *ctx, const char *pattern);
 
-long read_memory(const pid_t pid, const uint64_t address);
-void write_memory(const pid_t pid, const uint64_t address, const long val);
+void set_watchpoint(dbg_ctx *ctx, const char *loc, const char *len_text);
+void list_watchpoints(const dbg_ctx *ctx);
+bool delete_watchpoint(dbg_ctx *ctx, int num);
+void delete_watchpoints(dbg_ctx *ctx);
+bool is_watch_fault(const dbg_ctx *ctx, const siginfo_t *info);
+bool watch_fault(dbg_ctx *ctx, siginfo_t *info);
+void unwatch_fork(dbg_ctx *ctx, pid_t child);
 
-uint64_t get_pc(const pid_t pid);
-void set_pc(const pid_t pid, const uint64_t val);
+uint64_t get_pc(dbg_ctx *ctx);
+void set_pc(dbg_ctx *ctx, const uint64_t val);
 
+long resume_inferior(dbg_ctx *ctx, enum __ptrace_request request);
 void step_over_breakpoint(dbg_ctx *ctx);
-breakpoint_t *at_breakpoint(dbg_ctx *ctx);
+bp_site_t *at_breakpoint(dbg_ctx *ctx);
 
+bool check_if_exit(dbg_ctx *ctx, int wait_status);
 bool wait_for_signal(dbg_ctx *ctx);
+bool wait_for_selected(dbg_ctx *ctx);
+thread_step_t step_thread(dbg_ctx *ctx);
+bool drop_vanished_thread(dbg_ctx *ctx);
+
+size_t unwind_thread(dbg_ctx *ctx, unwind_frame_t *frames, size_t max_frames);
+void print_backtrace(dbg_ctx *ctx, size_t limit);
+
+void list_threads(dbg_ctx *ctx);
+void select_thread(dbg_ctx *ctx, const char *num);
+void set_non_stop(dbg_ctx *ctx, bool on);
 
 void single_step(dbg_ctx *ctx);
 
@@ -0,0 +1,158 @@
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "displaced.h"
+#include "inject.h"
+#include "registers.h"
+#include "memory.h"
+
+#define XZR_REGNUM  31
+
+
+static int64_t sign_extend(uint64_t val, int bits) {
+    return (int64_t)(val << (64 - bits)) >> (64 - bits);
+}
+
+// Reads of register 31 in these encodings mean xzr, not sp
+static uint64_t get_xreg(dbg_ctx *ctx, int regnum) {
+    if (regnum == XZR_REGNUM)
+        return 0;
+    return get_register_value(&ctx->thread->regs, AARCH64_X0_REGNUM + regnum);
+}
+
+static void set_xreg(dbg_ctx *ctx, int regnum, uint64_t val) {
+    if (regnum != XZR_REGNUM)
+        set_register_value(&ctx->thread->regs, AARCH64_X0_REGNUM + regnum, val);
+}
+
+static bool condition_holds(uint64_t cpsr, uint32_t cond) {
+    bool n = cpsr >> 31 & 1, z = cpsr >> 30 & 1, c = cpsr >> 29 & 1, v = cpsr >> 28 & 1;
+    bool result;
+
+    switch (cond >> 1) {
+        case 0: result = z; break;                  // EQ / NE
+        case 1: result = c; break;                  // CS / CC
+        case 2: result = n; break;                  // MI / PL
+        case 3: result = v; break;                  // VS / VC
+        case 4: result = c && !z; break;            // HI / LS
+        case 5: result = n == v; break;             // GE / LT
+        case 6: result = n == v && !z; break;       // GT / LE
+        default: return true;                       // AL / NV
+    }
+
+    return (cond & 1) ? !result : result;
+}
+
+// Execute PC-relative instructions in the debugger: branches, ADR/ADRP and
+// integer literal loads. Returns false if insn must really be executed.
+bool emulate_insn(dbg_ctx *ctx, uint64_t pc, uint32_t insn) {
+    uint64_t next_pc = pc + 4;
+    int rt = insn & 0x1F;
+
+    if ((insn & 0x7C000000) == 0x14000000) {
+        // B, BL
+        if (insn & 0x80000000)
+            set_xreg(ctx, AARCH64_LR_REGNUM, pc + 4);
+        next_pc = pc + sign_extend(insn & 0x3FFFFFF, 26) * 4;
+    }
+    else if ((insn & 0xFF000010) == 0x54000000) {
+        // B.cond
+        uint64_t cpsr = get_register_value(&ctx->thread->regs, AARCH64_CPSR_REGNUM);
+        if (condition_holds(cpsr, insn & 0xF))
+            next_pc = pc + sign_extend(insn >> 5 & 0x7FFFF, 19) * 4;
+    }
+    else if ((insn & 0x7E000000) == 0x34000000) {
+        // CBZ, CBNZ
+        uint64_t val = get_xreg(ctx, rt);
+        if (!(insn & 0x80000000))
+            val &= 0xFFFFFFFF;
+        if ((val == 0) == !(insn & 0x01000000))
+            next_pc = pc + sign_extend(insn >> 5 & 0x7FFFF, 19) * 4;
+    }
+    else if ((insn & 0x7E000000) == 0x36000000) {
+        // TBZ, TBNZ
+        int bit = (insn >> 31) << 5 | (insn >> 19 & 0x1F);
+        bool set = get_xreg(ctx, rt) >> bit & 1;
+        if (set == !!(insn & 0x01000000))
+            next_pc = pc + sign_extend(insn >> 5 & 0x3FFF, 14) * 4;
+    }
+    else if ((insn & 0x1F000000) == 0x10000000) {
+        // ADR, ADRP
+        int64_t imm = sign_extend((insn >> 5 & 0x7FFFF) << 2 | (insn >> 29 & 0x3), 21);
+        if (insn & 0x80000000)
+            set_xreg(ctx, rt, (pc & ~0xFFFUL) + (imm << 12));
+        else
+            set_xreg(ctx, rt, pc + imm);
+    }
+    else if ((insn & 0x3B000000) == 0x18000000) {
+        // LDR (literal) into a general purpose register, PRFM
+        uint64_t addr = pc + sign_extend(insn >> 5 & 0x7FFFF, 19) * 4;
+        uint32_t opc = insn >> 30;
+
+        if (insn & 0x04000000)
+            return false;
+        if (opc != 3) {
+            uint64_t val = 0;
+            size_t size = opc == 1 ? 8 : 4;
+            if (read_memory_range(ctx->pid, addr, &val, size) != (ssize_t)size)
+                return false;
+            if (opc == 2)
+                val = sign_extend(val, 32);
+            set_xreg(ctx, rt, val);
+        }
+    }
+    else {
+        return false;
+    }
+
+    set_pc(ctx, next_pc);
+    return true;
+}
+
+// Exclusive loads and stores lose their monitor when stepped alone, and
+// FP/SIMD literal loads are PC relative; keep those in place
+static bool can_displace(uint32_t insn) {
+    if ((insn & 0x3F000000) == 0x08000000)
+        return false;
+    if ((insn & 0x3B000000) == 0x18000000)
+        return false;
+    return true;
+}
+
+// Single-step a copy of insn in the scratch page so the trap at pc stays
+// in place. Returns false if the caller must step over it in place.
+bool displaced_step(dbg_ctx *ctx, uint64_t pc, uint32_t insn) {
+    if (!can_displace(insn))
+        return false;
+
+    uint64_t slot = get_scratch_page(ctx);
+    if (slot == 0)
+        return false;
+
+    if (!ctx->scratch_valid || ctx->scratch_insn != insn) {
+        if (write_text_range(ctx->pid, slot, &insn, sizeof(insn)) != sizeof(insn))
+            return false;
+        ctx->scratch_insn = insn;
+        ctx->scratch_valid = true;
+    }
+
+    set_pc(ctx, slot);
+    if (step_thread(ctx) == THREAD_GONE)
+        return true;
+
+    // Fall through and interrupted steps return to the original code,
+    // a BLR must return there too
+    uint64_t new_pc = get_pc(ctx);
+    if (new_pc == slot + 4)
+        set_pc(ctx, pc + 4);
+    else if (new_pc == slot)
+        set_pc(ctx, pc);
+
+    if (get_register_value(&ctx->thread->regs, AARCH64_LR_REGNUM) == slot + 4)
+        set_register_value(&ctx->thread->regs, AARCH64_LR_REGNUM, pc + 4);
+
+    return true;
+}
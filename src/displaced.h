@@ -0,0 +1,12 @@
+#ifndef DISPLACED_H
+#define DISPLACED_H
+
+#include <stdbool.h>
+
+#include "debugger.h"
+
+
+bool emulate_insn(dbg_ctx *ctx, uint64_t pc, uint32_t insn);
+bool displaced_step(dbg_ctx *ctx, uint64_t pc, uint32_t insn);
+
+#endif
@@ -0,0 +1,88 @@
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+
+
+bool event_loop_init(event_loop_t *loop) {
+    loop->sources = NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->epfd >= 0;
+}
+
+void event_loop_free(event_loop_t *loop) {
+    while (loop->sources) {
+        event_source_t *next = loop->sources->next;
+        free(loop->sources);
+        loop->sources = next;
+    }
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    loop->epfd = -1;
+}
+
+event_source_t *event_add(event_loop_t *loop, int fd, uint32_t events, event_fn_t fn, void *arg) {
+    event_source_t *source = malloc(sizeof(event_source_t));
+    source->fd = fd;
+    source->fn = fn;
+    source->arg = arg;
+
+    struct epoll_event ev = { .events = events, .data.ptr = source };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free(source);
+        return NULL;
+    }
+
+    source->next = loop->sources;
+    loop->sources = source;
+    return source;
+}
+
+// With events 0 the source stays registered but is not reported
+void event_modify(event_loop_t *loop, event_source_t *source, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = source };
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, source->fd, &ev);
+}
+
+// Freed by the next poll, a handler may remove a source that is still
+// in the ready list
+void event_remove(event_loop_t *loop, event_source_t *source) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, source->fd, NULL);
+    source->fn = NULL;
+}
+
+static void sweep_sources(event_loop_t *loop) {
+    event_source_t **p = &loop->sources;
+    while (*p) {
+        event_source_t *source = *p;
+        if (source->fn == NULL) {
+            *p = source->next;
+            free(source);
+        }
+        else {
+            p = &source->next;
+        }
+    }
+}
+
+// Wait for at least one source to become ready and run the handlers of
+// all that are. Returns the number handled, -1 on error.
+int event_loop_poll(event_loop_t *loop, int timeout_ms) {
+    struct epoll_event ready[EVENT_MAX_READY];
+
+    sweep_sources(loop);
+    int num = epoll_wait(loop->epfd, ready, EVENT_MAX_READY, timeout_ms);
+    if (num < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < num; ++i) {
+        event_source_t *source = ready[i].data.ptr;
+        if (source->fn)
+            source->fn(source->arg, ready[i].events);
+    }
+    sweep_sources(loop);
+    return num;
+}
@@ -0,0 +1,35 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define EVENT_MAX_READY     64
+
+
+typedef void (*event_fn_t)(void *arg, uint32_t events);
+
+// A file descriptor watched by the loop. The loop never closes it.
+typedef struct event_source {
+    int fd;
+    event_fn_t fn;
+    void *arg;
+    struct event_source *next;
+} event_source_t;
+
+typedef struct {
+    int epfd;
+    event_source_t *sources;
+} event_loop_t;
+
+
+bool event_loop_init(event_loop_t *loop);
+void event_loop_free(event_loop_t *loop);
+
+event_source_t *event_add(event_loop_t *loop, int fd, uint32_t events, event_fn_t fn, void *arg);
+void event_modify(event_loop_t *loop, event_source_t *source, uint32_t events);
+void event_remove(event_loop_t *loop, event_source_t *source);
+
+int event_loop_poll(event_loop_t *loop, int timeout_ms);
+
+#endif
@@ -0,0 +1,343 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "expr.h"
+#include "memory.h"
+
+enum expr_op {
+    OP_END,
+    OP_CONST,       // 8 byte immediate
+    OP_REG,         // 1 byte register number
+    OP_REG32,       // 1 byte register number, low 32 bits
+    OP_DEREF,       // load 8 bytes from the address on top of the stack
+    OP_NEG,
+    OP_NOT,
+    OP_BNOT,
+    OP_BOOL,
+    OP_JZ,          // 2 byte forward offset; jump if top is 0, else pop
+    OP_JNZ,         // 2 byte forward offset; jump with 1 if top is non-zero, else pop
+    OP_MUL, OP_DIV, OP_MOD,
+    OP_ADD, OP_SUB,
+    OP_SHL, OP_SHR,
+    OP_LT, OP_LE, OP_GT, OP_GE,
+    OP_EQ, OP_NE,
+    OP_AND, OP_XOR, OP_OR,
+};
+
+typedef struct {
+    const char *pos;
+    const char *error;
+    expr_t *expr;
+    int depth;
+    int max_depth;
+} parser_t;
+
+
+static void emit(parser_t *p, const void *bytes, size_t len) {
+    expr_t *expr = p->expr;
+
+    if (expr->len + len > expr->cap) {
+        expr->cap = expr->cap ? expr->cap * 2 : 64;
+        while (expr->cap < expr->len + len)
+            expr->cap *= 2;
+        expr->code = realloc(expr->code, expr->cap);
+    }
+
+    memcpy(expr->code + expr->len, bytes, len);
+    expr->len += len;
+}
+
+static void emit_op(parser_t *p, uint8_t op) {
+    emit(p, &op, 1);
+}
+
+static void push(parser_t *p) {
+    if (++p->depth > p->max_depth)
+        p->max_depth = p->depth;
+}
+
+static void skip_space(parser_t *p) {
+    while (isspace(*p->pos))
+        p->pos++;
+}
+
+// Consume tok if it comes next, but not when it is the start of a longer
+// operator (so "<" does not match "<<")
+static bool accept(parser_t *p, const char *tok) {
+    size_t len = strlen(tok);
+
+    skip_space(p);
+    if (strncmp(p->pos, tok, len) != 0)
+        return false;
+    if (len == 1 && strchr("<>&|=", tok[0]) && p->pos[1] == tok[0])
+        return false;
+    if (len == 1 && strchr("<>!", tok[0]) && p->pos[1] == '=')
+        return false;
+
+    p->pos += len;
+    return true;
+}
+
+static void parse_expr(parser_t *p);
+
+static int parse_register(const char *name, bool *is_32bit) {
+    *is_32bit = false;
+
+    if (strcmp(name, "fp") == 0)
+        return AARCH64_FP_REGNUM;
+    if (strcmp(name, "lr") == 0)
+        return AARCH64_LR_REGNUM;
+
+    if (name[0] == 'w' && isdigit(name[1])) {
+        char *end;
+        long num = strtol(name + 1, &end, 10);
+        if (*end == '\0' && num >= 0 && num <= 30) {
+            *is_32bit = true;
+            return num;
+        }
+        return -1;
+    }
+
+    return get_register_from_name(name);
+}
+
+static void parse_primary(parser_t *p) {
+    skip_space(p);
+
+    if (accept(p, "(")) {
+        parse_expr(p);
+        if (!p->error && !accept(p, ")"))
+            p->error = "expected ')'";
+        return;
+    }
+
+    if (isdigit(*p->pos)) {
+        char *end;
+        uint64_t val = strtoull(p->pos, &end, 0);
+        p->pos = end;
+        emit_op(p, OP_CONST);
+        emit(p, &val, sizeof(val));
+        push(p);
+        return;
+    }
+
+    if (*p->pos == '$')
+        p->pos++;
+
+    if (isalpha(*p->pos)) {
+        char name[16];
+        size_t len = 0;
+        bool is_32bit;
+
+        while (isalnum(*p->pos) && len < sizeof(name) - 1)
+            name[len++] = *p->pos++;
+        name[len] = '\0';
+
+        int regnum = parse_register(name, &is_32bit);
+        if (regnum < 0) {
+            p->error = "unknown register";
+            return;
+        }
+
+        uint8_t reg = regnum;
+        emit_op(p, is_32bit ? OP_REG32 : OP_REG);
+        emit(p, &reg, 1);
+        push(p);
+        return;
+    }
+
+    p->error = "expected a number, register or '('";
+}
+
+static void parse_unary(parser_t *p) {
+    uint8_t op;
+
+    if (accept(p, "-"))
+        op = OP_NEG;
+    else if (accept(p, "!"))
+        op = OP_NOT;
+    else if (accept(p, "~"))
+        op = OP_BNOT;
+    else if (accept(p, "*"))
+        op = OP_DEREF;
+    else {
+        parse_primary(p);
+        return;
+    }
+
+    parse_unary(p);
+    if (!p->error)
+        emit_op(p, op);
+}
+
+// Binary operators from tightest to loosest binding
+static const struct {
+    const char *tok;
+    uint8_t op;
+    int level;
+} binary_ops[] = {
+    { "*", OP_MUL, 0 }, { "/", OP_DIV, 0 }, { "%", OP_MOD, 0 },
+    { "+", OP_ADD, 1 }, { "-", OP_SUB, 1 },
+    { "<<", OP_SHL, 2 }, { ">>", OP_SHR, 2 },
+    { "<=", OP_LE, 3 }, { ">=", OP_GE, 3 }, { "<", OP_LT, 3 }, { ">", OP_GT, 3 },
+    { "==", OP_EQ, 4 }, { "!=", OP_NE, 4 },
+    { "&", OP_AND, 5 },
+    { "^", OP_XOR, 6 },
+    { "|", OP_OR, 7 },
+};
+
+#define LEVEL_LAND  8
+#define LEVEL_LOR   9
+
+static void parse_level(parser_t *p, int level) {
+    if (level < 0) {
+        parse_unary(p);
+        return;
+    }
+
+    parse_level(p, level - 1);
+
+    while (!p->error) {
+        if (level == LEVEL_LAND || level == LEVEL_LOR) {
+            if (!accept(p, level == LEVEL_LAND ? "&&" : "||"))
+                return;
+
+            // short circuit, so the right hand side may dereference
+            // memory that is only valid when the left hand side holds
+            uint8_t jump[3] = { level == LEVEL_LAND ? OP_JZ : OP_JNZ, 0, 0 };
+            size_t patch = p->expr->len + 1;
+            emit(p, jump, sizeof(jump));
+            p->depth--;
+
+            parse_level(p, level - 1);
+            if (p->error)
+                return;
+            emit_op(p, OP_BOOL);
+
+            uint16_t offset = p->expr->len - (patch + 2);
+            memcpy(p->expr->code + patch, &offset, sizeof(offset));
+            continue;
+        }
+
+        size_t i;
+        for (i = 0; i < sizeof(binary_ops) / sizeof(binary_ops[0]); ++i) {
+            if (binary_ops[i].level == level && accept(p, binary_ops[i].tok))
+                break;
+        }
+        if (i == sizeof(binary_ops) / sizeof(binary_ops[0]))
+            return;
+
+        parse_level(p, level - 1);
+        if (p->error)
+            return;
+        emit_op(p, binary_ops[i].op);
+        p->depth--;
+    }
+}
+
+static void parse_expr(parser_t *p) {
+    parse_level(p, LEVEL_LOR);
+}
+
+// Returns NULL and sets error on a syntax error
+expr_t *expr_compile(const char *text, const char **error) {
+    parser_t p = { .pos = text };
+
+    p.expr = calloc(1, sizeof(expr_t));
+    parse_expr(&p);
+
+    skip_space(&p);
+    if (!p.error && *p.pos != '\0')
+        p.error = "unexpected characters at end of expression";
+    if (!p.error && p.max_depth > EXPR_MAX_DEPTH)
+        p.error = "expression too complex";
+
+    if (p.error) {
+        *error = p.error;
+        expr_free(p.expr);
+        return NULL;
+    }
+
+    emit_op(&p, OP_END);
+    return p.expr;
+}
+
+void expr_free(expr_t *expr) {
+    if (expr == NULL)
+        return;
+    free(expr->code);
+    free(expr);
+}
+
+// Returns false if memory cannot be read or on division by zero
+bool expr_eval(const expr_t *expr, reg_cache_t *regs, pid_t pid, uint64_t *result) {
+    uint64_t stack[EXPR_MAX_DEPTH];
+    int sp = -1;
+    const uint8_t *pc = expr->code;
+
+    while (1) {
+        uint8_t op = *pc++;
+        uint64_t a, b;
+        uint16_t offset;
+
+        switch (op) {
+            case OP_END:
+                *result = stack[sp];
+                return true;
+            case OP_CONST:
+                memcpy(&stack[++sp], pc, sizeof(uint64_t));
+                pc += sizeof(uint64_t);
+                continue;
+            case OP_REG:
+                stack[++sp] = get_register_value(regs, *pc++);
+                continue;
+            case OP_REG32:
+                stack[++sp] = get_register_value(regs, *pc++) & 0xFFFFFFFF;
+                continue;
+            case OP_DEREF:
+                if (read_memory_range(pid, stack[sp], &stack[sp], sizeof(uint64_t)) != sizeof(uint64_t))
+                    return false;
+                continue;
+            case OP_NEG:  stack[sp] = -stack[sp]; continue;
+            case OP_NOT:  stack[sp] = !stack[sp]; continue;
+            case OP_BNOT: stack[sp] = ~stack[sp]; continue;
+            case OP_BOOL: stack[sp] = stack[sp] != 0; continue;
+            case OP_JZ:
+            case OP_JNZ:
+                memcpy(&offset, pc, sizeof(offset));
+                pc += sizeof(offset);
+                if ((stack[sp] != 0) == (op == OP_JNZ)) {
+                    stack[sp] = stack[sp] != 0;
+                    pc += offset;
+                }
+                else {
+                    sp--;
+                }
+                continue;
+        }
+
+        b = stack[sp--];
+        a = stack[sp];
+        switch (op) {
+            case OP_MUL: a *= b; break;
+            case OP_DIV: if (b == 0) return false; a /= b; break;
+            case OP_MOD: if (b == 0) return false; a %= b; break;
+            case OP_ADD: a += b; break;
+            case OP_SUB: a -= b; break;
+            // shifting by the width or more is undefined in C
+            case OP_SHL: a = b < 64 ? a << b : 0; break;
+            case OP_SHR: a = b < 64 ? a >> b : 0; break;
+            case OP_LT:  a = (int64_t)a < (int64_t)b; break;
+            case OP_LE:  a = (int64_t)a <= (int64_t)b; break;
+            case OP_GT:  a = (int64_t)a > (int64_t)b; break;
+            case OP_GE:  a = (int64_t)a >= (int64_t)b; break;
+            case OP_EQ:  a = a == b; break;
+            case OP_NE:  a = a != b; break;
+            case OP_AND: a &= b; break;
+            case OP_XOR: a ^= b; break;
+            case OP_OR:  a |= b; break;
+        }
+        stack[sp] = a;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "registers.h"
+
+#define EXPR_MAX_DEPTH 32
+
+
+// Expression over registers, memory and constants, compiled to a
+// stack bytecode once and evaluated on every breakpoint hit, e.g.
+//   x3 == 0x10 && *(x0+8) > 5
+typedef struct {
+    uint8_t *code;
+    size_t len;
+    size_t cap;
+} expr_t;
+
+
+expr_t *expr_compile(const char *text, const char **error);
+void expr_free(expr_t *expr);
+bool expr_eval(const expr_t *expr, reg_cache_t *regs, pid_t pid, uint64_t *result);
+
+#endif
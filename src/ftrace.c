@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ftrace.h"
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t hist_bucket(uint64_t ns) {
+    if (ns < FTRACE_SUB_BUCKETS)
+        return ns;
+
+    int shift = 63 - __builtin_clzll(ns) - FTRACE_SUB_BITS;
+    return (shift + 1) * FTRACE_SUB_BUCKETS + ((ns >> shift) & (FTRACE_SUB_BUCKETS - 1));
+}
+
+// Highest value that falls into the bucket
+static uint64_t hist_bucket_value(size_t bucket) {
+    if (bucket < FTRACE_SUB_BUCKETS)
+        return bucket;
+
+    int shift = bucket / FTRACE_SUB_BUCKETS - 1;
+    uint64_t sub = bucket % FTRACE_SUB_BUCKETS;
+    return ((FTRACE_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void ftrace_init(ftrace_t *ft, pid_t pid) {
+    memset(ft, 0, sizeof(*ft));
+    ft->pid = pid;
+}
+
+// One entry breakpoint per matching function, at its first instruction
+// where LR and SP still hold the caller's values
+size_t ftrace_arm(ftrace_t *ft, bp_table_t *table, const func_index_t *idx, const regex_t *re, uint64_t load_bias) {
+    size_t armed = 0;
+
+    if (ft->num_funcs == 0)
+        ft->start_ns = now_ns();
+
+    for (size_t i = 0; i < idx->num_funcs; ++i) {
+        const func_entry_t *entry = &idx->funcs[i];
+        const char *name = func_entry_name(idx, entry);
+
+        if (regexec(re, name, 0, NULL, 0) != 0)
+            continue;
+
+        // skip functions that are already traced
+        uint64_t addr = entry->low_pc + load_bias;
+        bp_site_t *site = bp_site_lookup(table, addr);
+        bool traced = false;
+        for (bp_location_t *loc = site ? site->locs : NULL; loc; loc = loc->next_in_site)
+            traced |= loc->owner->kind == BP_FTRACE_ENTRY;
+        if (traced)
+            continue;
+
+        ftrace_func_t *func = calloc(1, sizeof(ftrace_func_t));
+        func->name = name;
+        func->addr = addr;
+        func->min_ns = UINT64_MAX;
+
+        ft->funcs = realloc(ft->funcs, (ft->num_funcs + 1) * sizeof(ftrace_func_t *));
+        ft->funcs[ft->num_funcs++] = func;
+
+        breakpoint_t *bp = bp_create_internal(table, BP_FTRACE_ENTRY);
+        bp->data = func;
+        bp_add_location(table, bp, addr);
+        armed++;
+    }
+
+    return armed;
+}
+
+static ftrace_stack_t *get_stack(ftrace_t *ft, pid_t tid) {
+    for (size_t i = 0; i < ft->num_stacks; ++i) {
+        if (ft->stacks[i].tid == tid)
+            return &ft->stacks[i];
+    }
+
+    ft->stacks = realloc(ft->stacks, (ft->num_stacks + 1) * sizeof(ftrace_stack_t));
+    ftrace_stack_t *stack = &ft->stacks[ft->num_stacks++];
+    memset(stack, 0, sizeof(*stack));
+    stack->tid = tid;
+
+    return stack;
+}
+
+// Push a shadow frame and make sure the return address has an exit
+// breakpoint. Exit breakpoints stay until tracing stops, return sites
+// are reused by every later call from the same place.
+void ftrace_entry(ftrace_t *ft, bp_table_t *table, breakpoint_t *bp, pid_t tid, uint64_t lr, uint64_t sp) {
+    ftrace_stack_t *stack = get_stack(ft, tid);
+
+    if (stack->depth == stack->cap) {
+        stack->cap = stack->cap ? stack->cap * 2 : 64;
+        stack->frames = realloc(stack->frames, stack->cap * sizeof(ftrace_frame_t));
+    }
+
+    ftrace_frame_t *frame = &stack->frames[stack->depth++];
+    frame->func = bp->data;
+    frame->ret_addr = lr;
+    frame->sp = sp;
+
+    bp_site_t *site = bp_site_lookup(table, lr);
+    bool has_exit = false;
+    for (bp_location_t *loc = site ? site->locs : NULL; loc; loc = loc->next_in_site)
+        has_exit |= loc->owner->kind == BP_FTRACE_EXIT;
+
+    if (!has_exit) {
+        breakpoint_t *exit_bp = bp_create_internal(table, BP_FTRACE_EXIT);
+        bp_add_location(table, exit_bp, lr);
+    }
+
+    // taken last so the bookkeeping above is not part of the call
+    frame->start_ns = now_ns();
+}
+
+static void write_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', out);
+        fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+static void record_call(ftrace_t *ft, pid_t tid, const ftrace_frame_t *frame, uint64_t end_ns) {
+    ftrace_func_t *func = frame->func;
+    uint64_t ns = end_ns - frame->start_ns;
+
+    if (func->hist == NULL)
+        func->hist = calloc(FTRACE_NUM_BUCKETS, sizeof(uint32_t));
+
+    func->calls++;
+    func->total_ns += ns;
+    func->hist[hist_bucket(ns)]++;
+    if (ns < func->min_ns)
+        func->min_ns = ns;
+    if (ns > func->max_ns)
+        func->max_ns = ns;
+
+    if (ft->json) {
+        fputs(ft->json_first ? "\n" : ",\n", ft->json);
+        ft->json_first = false;
+        fputs("{\"name\":", ft->json);
+        write_json_string(ft->json, func->name);
+        fprintf(ft->json, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                (frame->start_ns - ft->start_ns) / 1000.0, ns / 1000.0, ft->pid, tid);
+    }
+}
+
+// A return reaches the caller with the SP it had at the call. The
+// topmost matching frame returns; frames above it never will (longjmp,
+// exceptions). Frames below with the same return address and SP were
+// tail calls and return at the same time.
+void ftrace_exit(ftrace_t *ft, pid_t tid, uint64_t pc, uint64_t sp) {
+    uint64_t end_ns = now_ns();
+    ftrace_stack_t *stack = get_stack(ft, tid);
+    size_t i = stack->depth;
+
+    while (i > 0 && (stack->frames[i - 1].ret_addr != pc || stack->frames[i - 1].sp != sp))
+        i--;
+    if (i == 0)
+        return;
+
+    ft->abandoned += stack->depth - i;
+    stack->depth = i;
+
+    while (stack->depth > 0 &&
+           stack->frames[stack->depth - 1].ret_addr == pc &&
+           stack->frames[stack->depth - 1].sp == sp) {
+        record_call(ft, tid, &stack->frames[stack->depth - 1], end_ns);
+        stack->depth--;
+    }
+}
+
+static void close_json(ftrace_t *ft) {
+    if (ft->json == NULL)
+        return;
+
+    fputs("\n]\n", ft->json);
+    fclose(ft->json);
+    ft->json = NULL;
+}
+
+// Chrome trace event format, viewable in chrome://tracing or Perfetto
+bool ftrace_set_json(ftrace_t *ft, const char *path) {
+    FILE *json = fopen(path, "w");
+    if (json == NULL) {
+        printf("Error opening %s\n", path);
+        return false;
+    }
+
+    close_json(ft);
+    ft->json = json;
+    ft->json_first = true;
+    fputc('[', json);
+
+    return true;
+}
+
+// Make the calls recorded so far visible to a viewer of the file
+void ftrace_flush(ftrace_t *ft) {
+    if (ft->json)
+        fflush(ft->json);
+}
+
+static uint64_t hist_percentile(const ftrace_func_t *func, double pct) {
+    unsigned long rank = func->calls * pct / 100.0;
+    unsigned long seen = 0;
+
+    for (size_t i = 0; i < FTRACE_NUM_BUCKETS; ++i) {
+        seen += func->hist[i];
+        if (seen > rank) {
+            uint64_t val = hist_bucket_value(i);
+            return val < func->max_ns ? val : func->max_ns;
+        }
+    }
+
+    return func->max_ns;
+}
+
+static int cmp_total_desc(const void *a, const void *b) {
+    const ftrace_func_t *fa = *(ftrace_func_t * const *)a, *fb = *(ftrace_func_t * const *)b;
+    if (fa->total_ns > fb->total_ns) return -1;
+    if (fa->total_ns < fb->total_ns) return 1;
+    return 0;
+}
+
+static void print_ns(uint64_t ns) {
+    if (ns < 10000)
+        printf(" %8luns", ns);
+    else if (ns < 10000000)
+        printf(" %8.1fus", ns / 1000.0);
+    else
+        printf(" %8.1fms", ns / 1000000.0);
+}
+
+// Times are wall clock between the entry and exit traps, so they include
+// the cost of stopping at any traced calls made in between
+void ftrace_report(const ftrace_t *ft) {
+    ftrace_func_t **funcs = malloc(ft->num_funcs * sizeof(ftrace_func_t *));
+    size_t num_called = 0;
+
+    for (size_t i = 0; i < ft->num_funcs; ++i) {
+        if (ft->funcs[i]->calls)
+            funcs[num_called++] = ft->funcs[i];
+    }
+
+    if (num_called == 0) {
+        printf("No traced calls have returned.\n");
+        free(funcs);
+        return;
+    }
+
+    qsort(funcs, num_called, sizeof(ftrace_func_t *), cmp_total_desc);
+
+    printf("%-32s %10s %10s %10s %10s %10s %10s %10s\n", "Function", "Calls", "Total", "Min", "p50", "p90", "p99", "Max");
+    for (size_t i = 0; i < num_called; ++i) {
+        const ftrace_func_t *func = funcs[i];
+        printf("%-32s %10lu", func->name, func->calls);
+        print_ns(func->total_ns);
+        print_ns(func->min_ns);
+        print_ns(hist_percentile(func, 50));
+        print_ns(hist_percentile(func, 90));
+        print_ns(hist_percentile(func, 99));
+        print_ns(func->max_ns);
+        printf("\n");
+    }
+
+    if (ft->abandoned)
+        printf("%lu calls never returned\n", ft->abandoned);
+
+    free(funcs);
+}
+
+void ftrace_stop(ftrace_t *ft, bp_table_t *table) {
+    breakpoint_t *bp = table->head;
+    while (bp) {
+        breakpoint_t *next = bp->next;
+        if (bp->kind == BP_FTRACE_ENTRY || bp->kind == BP_FTRACE_EXIT)
+            bp_delete(table, bp);
+        bp = next;
+    }
+
+    close_json(ft);
+
+    for (size_t i = 0; i < ft->num_funcs; ++i) {
+        free(ft->funcs[i]->hist);
+        free(ft->funcs[i]);
+    }
+    for (size_t i = 0; i < ft->num_stacks; ++i)
+        free(ft->stacks[i].frames);
+    free(ft->funcs);
+    free(ft->stacks);
+
+    ftrace_init(ft, ft->pid);
+}
@@ -0,0 +1,70 @@
+#ifndef FTRACE_H
+#define FTRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <regex.h>
+
+#include "breakpoint.h"
+#include "func_index.h"
+
+// Log-linear latency buckets: exact below 16ns, then 16 buckets per
+// power of two (about 6% precision) up to 2^64ns
+#define FTRACE_SUB_BITS     4
+#define FTRACE_SUB_BUCKETS  (1 << FTRACE_SUB_BITS)
+#define FTRACE_NUM_BUCKETS  ((64 - FTRACE_SUB_BITS + 1) * FTRACE_SUB_BUCKETS)
+
+
+typedef struct {
+    const char *name;
+    uint64_t addr;
+    unsigned long calls;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint32_t *hist;     // allocated on the first completed call
+} ftrace_func_t;
+
+// A call that has been entered but not yet returned
+typedef struct {
+    ftrace_func_t *func;
+    uint64_t ret_addr;
+    uint64_t sp;
+    uint64_t start_ns;
+} ftrace_frame_t;
+
+// Shadow stack of one thread
+typedef struct {
+    pid_t tid;
+    ftrace_frame_t *frames;
+    size_t depth;
+    size_t cap;
+} ftrace_stack_t;
+
+typedef struct {
+    pid_t pid;
+    ftrace_func_t **funcs;
+    size_t num_funcs;
+
+    ftrace_stack_t *stacks;
+    size_t num_stacks;
+
+    FILE *json;
+    bool json_first;
+    uint64_t start_ns;
+    unsigned long abandoned;    // frames that never returned, e.g. longjmp
+} ftrace_t;
+
+
+void ftrace_init(ftrace_t *ft, pid_t pid);
+size_t ftrace_arm(ftrace_t *ft, bp_table_t *table, const func_index_t *idx, const regex_t *re, uint64_t load_bias);
+void ftrace_entry(ftrace_t *ft, bp_table_t *table, breakpoint_t *bp, pid_t tid, uint64_t lr, uint64_t sp);
+void ftrace_exit(ftrace_t *ft, pid_t tid, uint64_t pc, uint64_t sp);
+bool ftrace_set_json(ftrace_t *ft, const char *path);
+void ftrace_flush(ftrace_t *ft);
+void ftrace_report(const ftrace_t *ft);
+void ftrace_stop(ftrace_t *ft, bp_table_t *table);
+
+#endif
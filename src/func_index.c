@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "func_index.h"
+
+
+void func_index_init(func_index_t *idx) {
+    memset(idx, 0, sizeof(*idx));
+}
+
+void func_index_free(func_index_t *idx) {
+    if (!idx->mapped) {
+        free(idx->funcs);
+        free(idx->buckets);
+        free(idx->strtab);
+    }
+    func_index_init(idx);
+}
+
+// FNV-1a
+uint32_t hash_string(const char *str) {
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t func_index_add_string(func_index_t *idx, const char *str) {
+    size_t len = strlen(str) + 1;
+
+    if (idx->strtab_size + len > idx->strtab_cap) {
+        size_t new_cap = idx->strtab_cap ? idx->strtab_cap * 2 : 4096;
+        while (new_cap < idx->strtab_size + len)
+            new_cap *= 2;
+        idx->strtab = realloc(idx->strtab, new_cap);
+        idx->strtab_cap = new_cap;
+    }
+
+    uint32_t off = idx->strtab_size;
+    memcpy(idx->strtab + off, str, len);
+    idx->strtab_size += len;
+
+    return off;
+}
+
+void func_index_add(func_index_t *idx, const char *name, uint32_t cu, uint64_t low_pc, uint64_t high_pc) {
+    if (idx->num_funcs == idx->funcs_cap) {
+        idx->funcs_cap = idx->funcs_cap ? idx->funcs_cap * 2 : 256;
+        idx->funcs = realloc(idx->funcs, idx->funcs_cap * sizeof(func_entry_t));
+    }
+
+    func_entry_t *func = &idx->funcs[idx->num_funcs++];
+    func->low_pc = low_pc;
+    func->high_pc = high_pc;
+    func->name = func_index_add_string(idx, name);
+    func->cu = cu;
+}
+
+static int cmp_func_low_pc(const void *a, const void *b) {
+    const func_entry_t *fa = a, *fb = b;
+    if (fa->low_pc < fb->low_pc) return -1;
+    if (fa->low_pc > fb->low_pc) return 1;
+    return 0;
+}
+
+void func_index_finalize(func_index_t *idx) {
+    qsort(idx->funcs, idx->num_funcs, sizeof(func_entry_t), cmp_func_low_pc);
+
+    // keep the load factor at or below 1/2
+    size_t num_buckets = 16;
+    while (num_buckets < idx->num_funcs * 2)
+        num_buckets *= 2;
+
+    free(idx->buckets);
+    idx->buckets = calloc(num_buckets, sizeof(uint32_t));
+    idx->num_buckets = num_buckets;
+
+    for (size_t i = 0; i < idx->num_funcs; ++i) {
+        const char *name = idx->strtab + idx->funcs[i].name;
+        size_t slot = hash_string(name) & (num_buckets - 1);
+
+        // every definition is kept, static functions can share a name
+        while (idx->buckets[slot] != 0)
+            slot = (slot + 1) & (num_buckets - 1);
+        idx->buckets[slot] = i + 1;
+    }
+}
+
+const func_entry_t *func_index_lookup_name(const func_index_t *idx, const char *name) {
+    if (idx->num_buckets == 0)
+        return NULL;
+
+    size_t slot = hash_string(name) & (idx->num_buckets - 1);
+    while (idx->buckets[slot] != 0) {
+        const func_entry_t *func = &idx->funcs[idx->buckets[slot] - 1];
+        if (strcmp(idx->strtab + func->name, name) == 0)
+            return func;
+        slot = (slot + 1) & (idx->num_buckets - 1);
+    }
+
+    return NULL;
+}
+
+// Collect up to max definitions of name, returns the total number found
+size_t func_index_find_all(const func_index_t *idx, const char *name, const func_entry_t **out, size_t max) {
+    size_t found = 0;
+
+    if (idx->num_buckets == 0)
+        return 0;
+
+    size_t slot = hash_string(name) & (idx->num_buckets - 1);
+    while (idx->buckets[slot] != 0) {
+        const func_entry_t *func = &idx->funcs[idx->buckets[slot] - 1];
+        if (strcmp(idx->strtab + func->name, name) == 0) {
+            if (found < max)
+                out[found] = func;
+            found++;
+        }
+        slot = (slot + 1) & (idx->num_buckets - 1);
+    }
+
+    return found;
+}
+
+const func_entry_t *func_index_lookup_pc(const func_index_t *idx, uint64_t pc) {
+    size_t lo = 0, hi = idx->num_funcs;
+
+    // find the last function starting at or below pc
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->funcs[mid].low_pc <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    const func_entry_t *func = &idx->funcs[lo - 1];
+    if (pc >= func->low_pc && pc < func->high_pc)
+        return func;
+
+    return NULL;
+}
+
+const char *func_entry_name(const func_index_t *idx, const func_entry_t *func) {
+    return idx->strtab + func->name;
+}
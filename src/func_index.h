@@ -0,0 +1,49 @@
+#ifndef FUNC_INDEX_H
+#define FUNC_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+typedef struct {
+    uint64_t low_pc;
+    uint64_t high_pc;
+    uint32_t name;      // offset into the index string table
+    uint32_t cu;        // index of the owning compilation unit
+} func_entry_t;
+
+// Subprogram index built once after dwarf_init.
+// funcs is sorted by low_pc for PC lookups, buckets is an open addressing
+// hash table (func index + 1, 0 = empty) for name lookups.
+typedef struct {
+    func_entry_t *funcs;
+    size_t num_funcs;
+    size_t funcs_cap;
+
+    uint32_t *buckets;
+    size_t num_buckets;
+
+    char *strtab;
+    size_t strtab_size;
+    size_t strtab_cap;
+
+    bool mapped;        // arrays point into the index cache and are not freed
+} func_index_t;
+
+
+void func_index_init(func_index_t *idx);
+void func_index_free(func_index_t *idx);
+
+uint32_t func_index_add_string(func_index_t *idx, const char *str);
+void func_index_add(func_index_t *idx, const char *name, uint32_t cu, uint64_t low_pc, uint64_t high_pc);
+void func_index_finalize(func_index_t *idx);
+
+const func_entry_t *func_index_lookup_name(const func_index_t *idx, const char *name);
+size_t func_index_find_all(const func_index_t *idx, const char *name, const func_entry_t **out, size_t max);
+const func_entry_t *func_index_lookup_pc(const func_index_t *idx, uint64_t pc);
+const char *func_entry_name(const func_index_t *idx, const func_entry_t *func);
+
+uint32_t hash_string(const char *str);
+
+#endif
@@ -0,0 +1,338 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <elf.h>
+
+#include "index_cache.h"
+
+
+typedef struct {
+    uint8_t bytes[INDEX_CACHE_KEY_MAX];
+    uint32_t len;
+    char name[2 * INDEX_CACHE_KEY_MAX + 16];   // file name in the cache directory
+} cache_key_t;
+
+
+static uint64_t fnv1a_64(const char *str) {
+    uint64_t hash = 14695981039346656037ull;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool find_build_id(Elf *elf, cache_key_t *key) {
+    for (Elf_Scn *scn = elf_nextscn(elf, NULL); scn; scn = elf_nextscn(elf, scn)) {
+        Elf64_Shdr *shdr = elf64_getshdr(scn);
+        if (shdr == NULL || shdr->sh_type != SHT_NOTE)
+            continue;
+
+        Elf_Data *data = elf_getdata(scn, NULL);
+        if (data == NULL)
+            continue;
+
+        const unsigned char *p = data->d_buf, *end = p + data->d_size;
+        while (p + sizeof(Elf64_Nhdr) <= end) {
+            const Elf64_Nhdr *nhdr = (const Elf64_Nhdr *)p;
+            const unsigned char *name = p + sizeof(Elf64_Nhdr);
+            const unsigned char *desc = name + ((nhdr->n_namesz + 3) & ~3u);
+            p = desc + ((nhdr->n_descsz + 3) & ~3u);
+            if (p > end)
+                break;
+
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && memcmp(name, "GNU", 4) == 0 &&
+                nhdr->n_descsz > 0 && nhdr->n_descsz <= INDEX_CACHE_KEY_MAX) {
+                memcpy(key->bytes, desc, nhdr->n_descsz);
+                key->len = nhdr->n_descsz;
+                for (uint32_t i = 0; i < key->len; ++i)
+                    sprintf(key->name + 2 * i, "%02x", key->bytes[i]);
+                strcat(key->name, ".idx");
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Without a build-id the binary is identified by its path, size and mtime
+static bool make_key(Elf *elf, const char *path, cache_key_t *key) {
+    memset(key, 0, sizeof(*key));
+    if (find_build_id(elf, key))
+        return true;
+
+    char real[PATH_MAX];
+    struct stat st;
+    if (realpath(path, real) == NULL || stat(real, &st) < 0)
+        return false;
+
+    uint64_t fields[3] = { fnv1a_64(real), st.st_size, st.st_mtime };
+    memcpy(key->bytes, fields, sizeof(fields));
+    key->len = sizeof(fields);
+    sprintf(key->name, "path-%016lx.idx", fields[0]);
+    return true;
+}
+
+// $XDG_CACHE_HOME/sonicdbg or ~/.cache/sonicdbg, created if missing
+static bool cache_dir(char *dir, size_t size) {
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+    if (xdg && *xdg)
+        snprintf(dir, size, "%s/sonicdbg", xdg);
+    else if (home && *home)
+        snprintf(dir, size, "%s/.cache/sonicdbg", home);
+    else
+        return false;
+
+    for (char *p = dir + 1; *p; ++p) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+    return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
+
+static bool cache_path(Elf *elf, const char *path, cache_key_t *key, char *file, size_t size) {
+    char dir[PATH_MAX - 128];
+    if (!make_key(elf, path, key) || !cache_dir(dir, sizeof(dir)))
+        return false;
+    snprintf(file, size, "%s/%s", dir, key->name);
+    return true;
+}
+
+static const void *array_at(const index_cache_t *cache, const cache_array_t *array, size_t elem_size) {
+    if (array->offset % 8 || array->offset > cache->len ||
+        array->count > (cache->len - array->offset) / elem_size)
+        return NULL;
+    return (const char *)cache->map + array->offset;
+}
+
+// Offsets and indexes inside the arrays are checked too, a damaged file
+// must not send a lookup outside the mapping
+static bool map_func_index(const index_cache_t *cache, func_index_t *idx, size_t num_cus, const cache_array_t *funcs,
+                           const cache_array_t *buckets, const cache_array_t *strtab) {
+    func_index_init(idx);
+    idx->funcs = (func_entry_t *)array_at(cache, funcs, sizeof(func_entry_t));
+    idx->buckets = (uint32_t *)array_at(cache, buckets, sizeof(uint32_t));
+    idx->strtab = (char *)array_at(cache, strtab, 1);
+    idx->num_funcs = funcs->count;
+    idx->num_buckets = buckets->count;
+    idx->strtab_size = strtab->count;
+    idx->mapped = true;
+
+    if (idx->funcs == NULL || idx->buckets == NULL || idx->strtab == NULL ||
+        (idx->num_buckets & (idx->num_buckets - 1)) != 0 || idx->num_buckets <= idx->num_funcs ||
+        (idx->strtab_size && idx->strtab[idx->strtab_size - 1] != '\0'))
+        return false;
+
+    for (size_t i = 0; i < idx->num_funcs; ++i)
+        if (idx->funcs[i].name >= idx->strtab_size || idx->funcs[i].cu >= num_cus)
+            return false;
+    for (size_t i = 0; i < idx->num_buckets; ++i)
+        if (idx->buckets[i] > idx->num_funcs)
+            return false;
+    return true;
+}
+
+static bool span_ok(uint64_t first, uint64_t count, uint64_t total) {
+    return count <= total && first <= total - count;
+}
+
+static bool check_cu_lines(const index_cache_t *cache, const index_cache_header_t *header, const cache_cu_t *cus) {
+    const line_entry_t *lines = array_at(cache, &header->lines, sizeof(line_entry_t));
+    const uint32_t *files = array_at(cache, &header->line_files, sizeof(uint32_t));
+    const char *strtab = array_at(cache, &header->line_strtab, 1);
+
+    if (lines == NULL || files == NULL || strtab == NULL ||
+        (header->line_strtab.count && strtab[header->line_strtab.count - 1] != '\0'))
+        return false;
+
+    for (size_t i = 0; i < header->cus.count; ++i)
+        if (!span_ok(cus[i].first_line, cus[i].num_lines, header->lines.count) ||
+            !span_ok(cus[i].first_file, cus[i].num_files, header->line_files.count))
+            return false;
+    for (size_t i = 0; i < header->line_files.count; ++i)
+        if (files[i] >= header->line_strtab.count)
+            return false;
+    return true;
+}
+
+// A cache written for another build of the binary, or by another version
+// of the debugger, is ignored and later overwritten
+bool index_cache_load(index_cache_t *cache, Elf *elf, const char *path,
+                      func_index_t *funcs, func_index_t *inlines, line_table_t *lines) {
+    cache_key_t key;
+    char file[PATH_MAX];
+    struct stat st;
+
+    memset(cache, 0, sizeof(*cache));
+    if (!cache_path(elf, path, &key, file, sizeof(file)))
+        return false;
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(index_cache_header_t)) {
+        close(fd);
+        return false;
+    }
+
+    cache->len = st.st_size;
+    cache->map = mmap(NULL, cache->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache->map == MAP_FAILED) {
+        memset(cache, 0, sizeof(*cache));
+        return false;
+    }
+
+    const index_cache_header_t *header = cache->map;
+    const cache_cu_t *cus = array_at(cache, &header->cus, sizeof(cache_cu_t));
+    const cu_range_t *ranges = array_at(cache, &header->ranges, sizeof(cu_range_t));
+
+    bool ok = memcmp(header->magic, INDEX_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == INDEX_CACHE_VERSION &&
+              header->key_len == key.len && memcmp(header->key, key.bytes, key.len) == 0 &&
+              cus && ranges && check_cu_lines(cache, header, cus) &&
+              map_func_index(cache, funcs, header->cus.count, &header->funcs, &header->func_buckets, &header->func_strtab) &&
+              map_func_index(cache, inlines, header->cus.count, &header->inlines, &header->inline_buckets, &header->inline_strtab);
+
+    for (size_t i = 0; ok && i < header->ranges.count; ++i)
+        ok = ranges[i].cu < header->cus.count;
+
+    if (!ok) {
+        func_index_init(funcs);
+        func_index_init(inlines);
+        index_cache_free(cache);
+        return false;
+    }
+
+    // the CUs themselves are copied, their line rows and files are used
+    // in place
+    const line_entry_t *line_rows = (const line_entry_t *)((const char *)cache->map + header->lines.offset);
+    const uint32_t *line_files = (const uint32_t *)((const char *)cache->map + header->line_files.offset);
+    const char *line_strtab = (const char *)cache->map + header->line_strtab.offset;
+
+    line_table_init(lines);
+    lines->cus = calloc(header->cus.count ? header->cus.count : 1, sizeof(cu_lines_t));
+    lines->num_cus = lines->cus_cap = header->cus.count;
+    for (size_t i = 0; i < header->cus.count; ++i) {
+        cu_lines_t *cu = &lines->cus[i];
+        cu->low_pc = cus[i].low_pc;
+        cu->high_pc = cus[i].high_pc;
+        cu->die_offset = cus[i].die_offset;
+        cu->decoded = cu->mapped = true;
+        cu->lines = (line_entry_t *)(line_rows + cus[i].first_line);
+        cu->num_lines = cus[i].num_lines;
+        cu->files = (uint32_t *)(line_files + cus[i].first_file);
+        cu->num_files = cus[i].num_files;
+        cu->strtab = (char *)line_strtab;
+    }
+    lines->ranges = (cu_range_t *)ranges;
+    lines->num_ranges = header->ranges.count;
+    lines->mapped = true;
+
+    return true;
+}
+
+static void put_array(FILE *file, cache_array_t *array, const void *data, size_t count, size_t elem_size) {
+    static const char zeros[8];
+    long offset = ftell(file);
+
+    fwrite(zeros, 1, (8 - offset % 8) % 8, file);
+    array->offset = ftell(file);
+    array->count = count;
+    fwrite(data, elem_size, count, file);
+}
+
+// Written to a temporary file and renamed, so a reader never maps a
+// partial cache. Every CU's line program must have been decoded.
+void index_cache_save(Elf *elf, const char *path,
+                      const func_index_t *funcs, const func_index_t *inlines, const line_table_t *lines) {
+    cache_key_t key;
+    char file[PATH_MAX], tmp[PATH_MAX + 32];
+
+    if (!cache_path(elf, path, &key, file, sizeof(file)))
+        return;
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, getpid());
+
+    FILE *out = fopen(tmp, "wb");
+    if (out == NULL)
+        return;
+
+    index_cache_header_t header = {
+        .version = INDEX_CACHE_VERSION,
+        .key_len = key.len,
+    };
+    memcpy(header.magic, INDEX_CACHE_MAGIC, sizeof(header.magic));
+    memcpy(header.key, key.bytes, key.len);
+    fwrite(&header, sizeof(header), 1, out);
+
+    // the CUs' line rows, file offsets and strings are gathered into one
+    // array each, file offsets moved by where each CU's strings land
+    size_t total_lines = 0, total_files = 0, strtab_size = 0;
+    for (size_t i = 0; i < lines->num_cus; ++i) {
+        const cu_lines_t *cu = &lines->cus[i];
+        total_lines += cu->num_lines;
+        total_files += cu->num_files;
+        for (size_t f = 0; f < cu->num_files; ++f)
+            strtab_size += strlen(cu->strtab + cu->files[f]) + 1;
+    }
+
+    cache_cu_t *cus = malloc((lines->num_cus ? lines->num_cus : 1) * sizeof(cache_cu_t));
+    line_entry_t *line_rows = malloc((total_lines ? total_lines : 1) * sizeof(line_entry_t));
+    uint32_t *line_files = malloc((total_files ? total_files : 1) * sizeof(uint32_t));
+    char *line_strtab = malloc(strtab_size ? strtab_size : 1);
+    size_t num_lines = 0, num_files = 0, strtab_len = 0;
+
+    for (size_t i = 0; i < lines->num_cus; ++i) {
+        const cu_lines_t *cu = &lines->cus[i];
+        cus[i] = (cache_cu_t) { cu->low_pc, cu->high_pc, cu->die_offset,
+                                num_lines, cu->num_lines, num_files, cu->num_files };
+
+        memcpy(line_rows + num_lines, cu->lines, cu->num_lines * sizeof(line_entry_t));
+        num_lines += cu->num_lines;
+        for (size_t f = 0; f < cu->num_files; ++f) {
+            size_t len = strlen(cu->strtab + cu->files[f]) + 1;
+            memcpy(line_strtab + strtab_len, cu->strtab + cu->files[f], len);
+            line_files[num_files++] = strtab_len;
+            strtab_len += len;
+        }
+    }
+
+    put_array(out, &header.funcs, funcs->funcs, funcs->num_funcs, sizeof(func_entry_t));
+    put_array(out, &header.func_buckets, funcs->buckets, funcs->num_buckets, sizeof(uint32_t));
+    put_array(out, &header.func_strtab, funcs->strtab, funcs->strtab_size, 1);
+    put_array(out, &header.inlines, inlines->funcs, inlines->num_funcs, sizeof(func_entry_t));
+    put_array(out, &header.inline_buckets, inlines->buckets, inlines->num_buckets, sizeof(uint32_t));
+    put_array(out, &header.inline_strtab, inlines->strtab, inlines->strtab_size, 1);
+    put_array(out, &header.cus, cus, lines->num_cus, sizeof(cache_cu_t));
+    put_array(out, &header.ranges, lines->ranges, lines->num_ranges, sizeof(cu_range_t));
+    put_array(out, &header.lines, line_rows, num_lines, sizeof(line_entry_t));
+    put_array(out, &header.line_files, line_files, num_files, sizeof(uint32_t));
+    put_array(out, &header.line_strtab, line_strtab, strtab_len, 1);
+    free(cus);
+    free(line_rows);
+    free(line_files);
+    free(line_strtab);
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+
+    if (fclose(out) != 0 || rename(tmp, file) != 0)
+        unlink(tmp);
+}
+
+void index_cache_free(index_cache_t *cache) {
+    if (cache->map)
+        munmap(cache->map, cache->len);
+    memset(cache, 0, sizeof(*cache));
+}
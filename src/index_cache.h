@@ -0,0 +1,67 @@
+#ifndef INDEX_CACHE_H
+#define INDEX_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <libelf.h>
+
+#include "func_index.h"
+#include "line_table.h"
+
+#define INDEX_CACHE_MAGIC   "SDBGIDX1"
+#define INDEX_CACHE_VERSION 3
+#define INDEX_CACHE_KEY_MAX 40      // a build-id, or path hash, size and mtime
+
+
+// Everything in the file is addressed by its offset from the start, so
+// the arrays are used in place wherever the file is mapped
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+} cache_array_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_len;
+    uint8_t key[INDEX_CACHE_KEY_MAX];
+    cache_array_t funcs;
+    cache_array_t func_buckets;
+    cache_array_t func_strtab;
+    cache_array_t inlines;
+    cache_array_t inline_buckets;
+    cache_array_t inline_strtab;
+    cache_array_t cus;
+    cache_array_t ranges;
+    cache_array_t lines;
+    cache_array_t line_files;
+    cache_array_t line_strtab;
+} index_cache_header_t;
+
+// The line rows and file names of all CUs are stored back to back, file
+// names in one string table
+typedef struct {
+    uint64_t low_pc;
+    uint64_t high_pc;
+    uint64_t die_offset;
+    uint64_t first_line;
+    uint64_t num_lines;
+    uint64_t first_file;
+    uint64_t num_files;
+} cache_cu_t;
+
+// Mapping backing the indexes loaded from the cache, if any
+typedef struct {
+    void *map;
+    size_t len;
+} index_cache_t;
+
+
+bool index_cache_load(index_cache_t *cache, Elf *elf, const char *path,
+                      func_index_t *funcs, func_index_t *inlines, line_table_t *lines);
+void index_cache_save(Elf *elf, const char *path,
+                      const func_index_t *funcs, const func_index_t *inlines, const line_table_t *lines);
+void index_cache_free(index_cache_t *cache);
+
+#endif
@@ -0,0 +1,218 @@
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+
+#include "inferior.h"
+#include "dbg_dwarf.h"
+
+
+void inferior_table_init(inferior_table_t *table) {
+    memset(table, 0, sizeof(*table));
+    table->next_num = 1;
+}
+
+// Processes that were attached to keep running, those the debugger
+// started are killed with it
+void inferior_table_free(inferior_table_t *table) {
+    while (table->num_inferiors) {
+        dbg_ctx *ctx = table->inferiors[table->num_inferiors - 1];
+        if (ctx->attached && !ctx->exited)
+            detach_inferior(ctx);
+        inferior_remove(table, ctx);
+    }
+    free(table->inferiors);
+    inferior_table_init(table);
+}
+
+// Only what belongs to the process; the binary is shared
+static dbg_ctx *new_inferior(inferior_table_t *table, binary_t *bin, pid_t pid) {
+    dbg_ctx *ctx = calloc(1, sizeof(dbg_ctx));
+    ctx->num = table->next_num++;
+    ctx->pid = pid;
+    ctx->bin = bin;
+    ctx->inferiors = table;
+    thread_table_init(&ctx->threads);
+    bp_table_init(&ctx->breakpoints, pid);
+    watch_table_init(&ctx->watch);
+    ftrace_init(&ctx->ftrace, pid);
+    solib_init(&ctx->solibs);
+
+    if (table->num_inferiors == table->inferiors_cap) {
+        table->inferiors_cap = table->inferiors_cap ? table->inferiors_cap * 2 : 8;
+        table->inferiors = realloc(table->inferiors, table->inferiors_cap * sizeof(dbg_ctx *));
+    }
+    table->inferiors[table->num_inferiors++] = ctx;
+    if (table->current == NULL)
+        table->current = ctx;
+
+    return ctx;
+}
+
+// Run argv[0] with argv; the new process is stopped at its first
+// instruction
+dbg_ctx *inferior_launch(inferior_table_t *table, char *const argv[]) {
+    binary_t *bin = binary_get(&table->binaries, argv[0]);
+    if (bin == NULL)
+        return NULL;
+
+    // threads the inferior creates are traced as well
+    pid_t pid = spawn_seized(argv, PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_EXITKILL);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status) ||
+        status >> 8 != (SIGTRAP | (PTRACE_EVENT_EXEC << 8))) {
+        printf("Failed to execute %s\n", argv[0]);
+        binary_put(&table->binaries, bin);
+        return NULL;
+    }
+
+    dbg_ctx *ctx = new_inferior(table, bin, pid);
+    ctx->thread = thread_add(&ctx->threads, pid);
+
+    init_load_addr(ctx);
+    solib_start(ctx);
+    return ctx;
+}
+
+// Seize the threads listed in /proc/pid/task until a pass finds no new
+// one. A thread created meanwhile either shows up in the next pass or is
+// reported through the clone event of its seized parent.
+static void seize_threads(dbg_ctx *ctx) {
+    char path[PATH_MAX];
+    bool found = true;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", ctx->pid);
+    while (found) {
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+            return;
+
+        found = false;
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            pid_t tid = strtol(ent->d_name, NULL, 10);
+            if (tid <= 0 || tid == ctx->pid || thread_find(&ctx->threads, tid))
+                continue;
+            if (ptrace(PTRACE_SEIZE, tid, NULL, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK) < 0)
+                continue;
+            thread_add(&ctx->threads, tid)->state = THREAD_RUNNING;
+            found = true;
+        }
+        closedir(dir);
+    }
+}
+
+// The process is only stopped at the very end. The debug info is indexed
+// while it runs untraced, since a clone event would hold the thread that
+// raised it, and it is seized, mapped and its libraries read while it
+// runs traced. What is left for the stop is patching in breakpoints.
+dbg_ctx *inferior_attach(inferior_table_t *table, pid_t pid) {
+    char link[32], path[PATH_MAX];
+
+    snprintf(link, sizeof(link), "/proc/%d/exe", pid);
+    ssize_t len = readlink(link, path, sizeof(path) - 1);
+    if (len < 0) {
+        printf("Cannot find the executable of process %d\n", pid);
+        return NULL;
+    }
+    path[len] = '\0';
+
+    binary_t *bin = binary_get(&table->binaries, path);
+    if (bin == NULL)
+        return NULL;
+    wait_dwarf_index(bin);
+
+    // the main thread first, so that it stays first in the thread table
+    if (ptrace(PTRACE_SEIZE, pid, NULL, PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK) < 0) {
+        printf("Cannot attach to process %d: %s\n", pid, strerror(errno));
+        binary_put(&table->binaries, bin);
+        return NULL;
+    }
+
+    dbg_ctx *ctx = new_inferior(table, bin, pid);
+    ctx->attached = true;
+    ctx->thread = thread_add(&ctx->threads, pid);
+    ctx->thread->state = THREAD_RUNNING;
+    seize_threads(ctx);
+
+    init_load_addr(ctx);
+    solib_start(ctx);
+    stop_all_threads(ctx);
+    return ctx;
+}
+
+void inferior_remove(inferior_table_t *table, dbg_ctx *ctx) {
+    for (size_t i = 0; i < table->num_inferiors; ++i) {
+        if (table->inferiors[i] != ctx)
+            continue;
+        memmove(&table->inferiors[i], &table->inferiors[i + 1], (table->num_inferiors - i - 1) * sizeof(dbg_ctx *));
+        table->num_inferiors--;
+        break;
+    }
+    if (table->current == ctx)
+        table->current = table->num_inferiors ? table->inferiors[0] : NULL;
+
+    free_debugger(ctx);
+    binary_put(&table->binaries, ctx->bin);
+    free(ctx);
+}
+
+static void print_inferior(const dbg_ctx *ctx) {
+    printf("[Inferior %d (process %d) %s]\n", ctx->num, ctx->pid, ctx->bin->path);
+}
+
+// A pid attaches to a running process, anything else is a program to
+// run with the arguments that follow it
+void add_inferior(inferior_table_t *table, char *const argv[]) {
+    if (argv[0] == NULL) {
+        printf("Usage: inferior add <pid|program> [args...]\n");
+        return;
+    }
+
+    bool is_pid = true;
+    for (const char *p = argv[0]; *p; ++p)
+        is_pid &= isdigit(*p) != 0;
+
+    dbg_ctx *ctx = is_pid ? inferior_attach(table, strtol(argv[0], NULL, 10)) : inferior_launch(table, argv);
+    if (ctx == NULL)
+        return;
+
+    printf("Added ");
+    print_inferior(ctx);
+}
+
+void list_inferiors(const inferior_table_t *table) {
+    printf("  Num  PID      Threads  State    Executable\n");
+    for (size_t i = 0; i < table->num_inferiors; ++i) {
+        dbg_ctx *ctx = table->inferiors[i];
+        printf("%c %-4d %-8d %-8zu %-8s %s\n", ctx == table->current ? '*' : ' ', ctx->num, ctx->pid,
+               ctx->threads.num_threads, ctx->running ? "running" : "stopped", ctx->bin->path);
+    }
+}
+
+void select_inferior(inferior_table_t *table, const char *num) {
+    if (num == NULL) {
+        printf("Current is ");
+        print_inferior(table->current);
+        return;
+    }
+
+    int n = strtol(num, NULL, 10);
+    for (size_t i = 0; i < table->num_inferiors; ++i) {
+        if (table->inferiors[i]->num != n)
+            continue;
+        table->current = table->inferiors[i];
+        printf("Switching to ");
+        print_inferior(table->current);
+        return;
+    }
+    printf("Invalid inferior ID: %s\n", num);
+}
@@ -0,0 +1,33 @@
+#ifndef INFERIOR_H
+#define INFERIOR_H
+
+#include <unistd.h>
+#include <stdbool.h>
+
+#include "debugger.h"
+
+
+// Every process of the session. Inferiors are numbered from 1 in the
+// order they are added; the number of an inferior never changes.
+typedef struct inferior_table {
+    dbg_ctx **inferiors;
+    size_t num_inferiors;
+    size_t inferiors_cap;
+    int next_num;
+    dbg_ctx *current;       // the inferior commands act on
+    binary_t *binaries;     // loaded executables, shared between inferiors
+} inferior_table_t;
+
+
+void inferior_table_init(inferior_table_t *table);
+void inferior_table_free(inferior_table_t *table);
+
+dbg_ctx *inferior_launch(inferior_table_t *table, char *const argv[]);
+dbg_ctx *inferior_attach(inferior_table_t *table, pid_t pid);
+void inferior_remove(inferior_table_t *table, dbg_ctx *ctx);
+
+void add_inferior(inferior_table_t *table, char *const argv[]);
+void list_inferiors(const inferior_table_t *table);
+void select_inferior(inferior_table_t *table, const char *num);
+
+#endif
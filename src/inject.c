@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "inject.h"
+#include "registers.h"
+#include "memory.h"
+
+
+// Run one system call in the stopped inferior: "svc #0; brk #0" is
+// executed with the syscall number in x8 and arguments in x0-x5, then the
+// registers are restored. Once there is a scratch page the stub there is
+// used; until then it is patched in at the current pc, where another
+// running thread could come across it. Returns x0, i.e. -errno on failure.
+// Only the trap of the stub's brk ends the syscall; signals arriving
+// meanwhile are queued for the thread, event stops are resumed.
+long inject_syscall(dbg_ctx *ctx, long nr, const long *args, int nargs) {
+    const uint32_t code[2] = { SVC_INSN, BP_TRAP_INSN };
+    uint32_t orig_code[2];
+    elf_gregset_t saved_regs;
+    int wait_status;
+    long ret;
+
+    uint64_t pc = get_pc(ctx);
+    memcpy(saved_regs, ctx->thread->regs.regs, sizeof(saved_regs));
+
+    bool in_place = ctx->scratch_addr == 0;
+    uint64_t stub = in_place ? pc : ctx->scratch_addr + SCRATCH_STUB_OFFSET;
+    if (in_place) {
+        if (read_memory_range(ctx->pid, pc, orig_code, sizeof(orig_code)) != sizeof(orig_code) ||
+            write_text_range(ctx->pid, pc, code, sizeof(code)) != sizeof(code))
+            return -EFAULT;
+    }
+    else {
+        set_pc(ctx, stub);
+    }
+
+    set_register_value(&ctx->thread->regs, AARCH64_X0_REGNUM + 8, nr);
+    for (int i = 0; i < MAX_SYSCALL_ARGS; ++i)
+        set_register_value(&ctx->thread->regs, AARCH64_X0_REGNUM + i, i < nargs ? args[i] : 0);
+
+    flush_registers(&ctx->thread->regs);
+
+    while (1) {
+        invalidate_registers(&ctx->thread->regs);
+        if (ptrace(PTRACE_CONT, ctx->thread->tid, NULL, NULL) < 0)
+            return -errno;
+        if (waitpid(ctx->thread->tid, &wait_status, __WALL) < 0)
+            return -errno;
+        if (!WIFSTOPPED(wait_status)) {
+            printf("Process %d exited during injected syscall\n", ctx->pid);
+            return -ESRCH;
+        }
+
+        // PTRACE_EVENT_STOP of group stops and interrupts comes with
+        // SIGTRAP or the stopping signal, neither to be delivered
+        int sig = WSTOPSIG(wait_status);
+        if (wait_status >> 16 != 0)
+            continue;
+        if (sig != SIGTRAP) {
+            ctx->thread->pending_sig = sig;
+            continue;
+        }
+
+        siginfo_t info;
+        ptrace(PTRACE_GETSIGINFO, ctx->thread->tid, NULL, &info);
+        if (info.si_code == TRAP_BRKPT && get_pc(ctx) == stub + 4)
+            break;
+    }
+
+    ret = get_register_value(&ctx->thread->regs, AARCH64_X0_REGNUM);
+
+    if (in_place)
+        write_text_range(ctx->pid, pc, orig_code, sizeof(orig_code));
+    memcpy(ctx->thread->regs.regs, saved_regs, sizeof(saved_regs));
+    ctx->thread->regs.valid = true;
+    ctx->thread->regs.dirty = true;
+
+    return ret;
+}
+
+// Returns 0 on failure
+uint64_t inject_mmap(dbg_ctx *ctx, size_t len, int prot) {
+    const long args[] = { 0, len, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 };
+
+    long addr = inject_syscall(ctx, __NR_mmap, args, 6);
+    if (addr < 0 && addr > -4096) {
+        printf("Error: mmap in inferior failed: %s\n", strerror(-addr));
+        return 0;
+    }
+
+    return addr;
+}
+
+// Returns 0 or -errno
+long inject_mprotect(dbg_ctx *ctx, uint64_t addr, size_t len, int prot) {
+    const long args[] = { addr, len, prot };
+
+    return inject_syscall(ctx, __NR_mprotect, args, 3);
+}
+
+// A page of code for the debugger in the inferior, mapped on first use.
+// Returns 0 if it cannot be had.
+uint64_t get_scratch_page(dbg_ctx *ctx) {
+    const uint32_t stub[2] = { SVC_INSN, BP_TRAP_INSN };
+
+    if (ctx->scratch_addr == 0 && !ctx->scratch_failed) {
+        uint64_t page = inject_mmap(ctx, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC);
+        if (page && write_text_range(ctx->pid, page + SCRATCH_STUB_OFFSET, stub, sizeof(stub)) == sizeof(stub))
+            ctx->scratch_addr = page;
+        ctx->scratch_failed = ctx->scratch_addr == 0;
+        ctx->scratch_valid = false;
+    }
+
+    return ctx->scratch_addr;
+}
@@ -0,0 +1,19 @@
+#ifndef INJECT_H
+#define INJECT_H
+
+#include "debugger.h"
+
+#define SVC_INSN    0xD4000001
+#define MAX_SYSCALL_ARGS 6
+
+// Layout of the scratch page: a slot for displaced steps, then the
+// "svc #0; brk #0" stub injected syscalls run from
+#define SCRATCH_STUB_OFFSET 16
+
+
+long inject_syscall(dbg_ctx *ctx, long nr, const long *args, int nargs);
+uint64_t inject_mmap(dbg_ctx *ctx, size_t len, int prot);
+long inject_mprotect(dbg_ctx *ctx, uint64_t addr, size_t len, int prot);
+uint64_t get_scratch_page(dbg_ctx *ctx);
+
+#endif
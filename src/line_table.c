@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "line_table.h"
+
+
+void line_table_init(line_table_t *table) {
+    memset(table, 0, sizeof(*table));
+}
+
+void cu_lines_free(cu_lines_t *cu) {
+    if (cu->mapped)
+        return;
+    free(cu->lines);
+    free(cu->files);
+    free(cu->strtab);
+}
+
+void line_table_free(line_table_t *table) {
+    for (size_t i = 0; i < table->num_cus; ++i)
+        cu_lines_free(&table->cus[i]);
+    free(table->cus);
+    if (!table->mapped)
+        free(table->ranges);
+    line_table_init(table);
+}
+
+uint32_t line_table_add_cu(line_table_t *table, uint64_t die_offset) {
+    if (table->num_cus == table->cus_cap) {
+        table->cus_cap = table->cus_cap ? table->cus_cap * 2 : 64;
+        table->cus = realloc(table->cus, table->cus_cap * sizeof(cu_lines_t));
+    }
+
+    cu_lines_t *cu = &table->cus[table->num_cus];
+    memset(cu, 0, sizeof(*cu));
+    cu->die_offset = die_offset;
+
+    return table->num_cus++;
+}
+
+void line_table_add_range(line_table_t *table, uint32_t cu, uint64_t low_pc, uint64_t high_pc) {
+    if (table->num_ranges == table->ranges_cap) {
+        table->ranges_cap = table->ranges_cap ? table->ranges_cap * 2 : 64;
+        table->ranges = realloc(table->ranges, table->ranges_cap * sizeof(cu_range_t));
+    }
+
+    cu_range_t *range = &table->ranges[table->num_ranges++];
+    range->low_pc = low_pc;
+    range->high_pc = high_pc;
+    range->cu = cu;
+
+    table->cus[cu].low_pc = low_pc;
+    table->cus[cu].high_pc = high_pc;
+}
+
+static int cmp_range_low_pc(const void *a, const void *b) {
+    const cu_range_t *ra = a, *rb = b;
+    if (ra->low_pc < rb->low_pc) return -1;
+    if (ra->low_pc > rb->low_pc) return 1;
+    return 0;
+}
+
+void line_table_finalize(line_table_t *table) {
+    qsort(table->ranges, table->num_ranges, sizeof(cu_range_t), cmp_range_low_pc);
+}
+
+cu_lines_t *line_table_find_cu(line_table_t *table, uint64_t pc) {
+    size_t lo = 0, hi = table->num_ranges;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (table->ranges[mid].low_pc <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    const cu_range_t *range = &table->ranges[lo - 1];
+    if (pc >= range->low_pc && pc < range->high_pc)
+        return &table->cus[range->cu];
+
+    return NULL;
+}
+
+static int cmp_line_addr(const void *a, const void *b) {
+    const line_entry_t *la = a, *lb = b;
+    if (la->addr < lb->addr) return -1;
+    if (la->addr > lb->addr) return 1;
+    // an end_sequence row sorts before a sequence starting at the same address
+    return (int)(lb->flags & LINE_END_SEQUENCE) - (int)(la->flags & LINE_END_SEQUENCE);
+}
+
+void cu_lines_sort(cu_lines_t *cu) {
+    // sequences can be emitted in any order; rows within one are already sorted
+    for (size_t i = 1; i < cu->num_lines; ++i) {
+        if (cmp_line_addr(&cu->lines[i - 1], &cu->lines[i]) > 0) {
+            qsort(cu->lines, cu->num_lines, sizeof(line_entry_t), cmp_line_addr);
+            return;
+        }
+    }
+}
+
+const line_entry_t *cu_lines_lookup(const cu_lines_t *cu, uint64_t pc) {
+    size_t lo = 0, hi = cu->num_lines;
+
+    // find the last row at or below pc
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cu->lines[mid].addr <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    const line_entry_t *line = &cu->lines[lo - 1];
+    if (line->flags & LINE_END_SEQUENCE)
+        return NULL;
+
+    // several rows can share an address, report the first of them
+    while (line > cu->lines && line[-1].addr == line->addr && !(line[-1].flags & LINE_END_SEQUENCE))
+        line--;
+
+    return line;
+}
+
+const char *cu_lines_file_name(const cu_lines_t *cu, uint16_t file) {
+    if (file >= cu->num_files)
+        return NULL;
+    return cu->strtab + cu->files[file];
+}
@@ -0,0 +1,68 @@
+#ifndef LINE_TABLE_H
+#define LINE_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LINE_IS_STMT        0x1
+#define LINE_PROLOGUE_END   0x2
+#define LINE_END_SEQUENCE   0x4
+
+
+typedef struct {
+    uint64_t addr;
+    uint32_t line;
+    uint16_t file;      // index into the owning CU's file list
+    uint16_t flags;
+} line_entry_t;
+
+// Line program of one compilation unit, decoded lazily on first use
+typedef struct {
+    uint64_t low_pc;
+    uint64_t high_pc;
+    uint64_t die_offset;
+
+    bool decoded;
+    bool mapped;            // lines, files and strtab point into the index cache
+    line_entry_t *lines;    // sorted by addr
+    size_t num_lines;
+
+    uint32_t *files;        // offsets into strtab
+    size_t num_files;
+    char *strtab;
+} cu_lines_t;
+
+typedef struct {
+    uint64_t low_pc;
+    uint64_t high_pc;
+    uint32_t cu;
+} cu_range_t;
+
+typedef struct {
+    cu_lines_t *cus;
+    size_t num_cus;
+    size_t cus_cap;
+
+    cu_range_t *ranges;     // sorted by low_pc
+    size_t num_ranges;
+    size_t ranges_cap;
+
+    bool mapped;            // ranges point into the index cache
+} line_table_t;
+
+
+void line_table_init(line_table_t *table);
+void line_table_free(line_table_t *table);
+
+uint32_t line_table_add_cu(line_table_t *table, uint64_t die_offset);
+void line_table_add_range(line_table_t *table, uint32_t cu, uint64_t low_pc, uint64_t high_pc);
+void line_table_finalize(line_table_t *table);
+
+cu_lines_t *line_table_find_cu(line_table_t *table, uint64_t pc);
+void cu_lines_free(cu_lines_t *cu);
+void cu_lines_sort(cu_lines_t *cu);
+const line_entry_t *cu_lines_lookup(const cu_lines_t *cu, uint64_t pc);
+const char *cu_lines_file_name(const cu_lines_t *cu, uint16_t file);
+
+#endif
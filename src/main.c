@@ -1,65 +1,300 @@
 #include <sys/wait.h>
 #include <sys/ptrace.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
 
 #include "debugger.h"
 #include "commands.h"
 #include "dbg_dwarf.h"
+#include "profile.h"
+#include "event_loop.h"
+#include "inferior.h"
+#include "trace.h"
 
+// How often output is flushed while the inferior runs
+#define FLUSH_INTERVAL_MS   100
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("Please specify an executable file as input\n");
-        exit(EXIT_FAILURE);
+
+typedef struct {
+    inferior_table_t inferiors;
+    event_loop_t loop;
+    event_source_t *input;      // NULL if stdin cannot be polled, e.g. a file
+    int signal_fd;
+    pid_t tty_pgrp;             // the debugger's process group, -1 without a terminal
+    char *line;                 // input not yet run, may hold several lines
+    size_t line_len;
+    size_t line_cap;
+    bool prompt_shown;
+    bool quit;
+} session_t;
+
+static bool waiting_for_stop(const session_t *s) {
+    dbg_ctx *ctx = s->inferiors.current;
+    return ctx->running && ctx->foreground;
+}
+
+static bool any_running(const session_t *s) {
+    for (size_t i = 0; i < s->inferiors.num_inferiors; ++i)
+        if (s->inferiors.inferiors[i]->running)
+            return true;
+    return false;
+}
+
+static void prompt(session_t *s) {
+    if (s->prompt_shown || s->quit)
+        return;
+    printf("sonicdbg> ");
+    fflush(stdout);
+    s->prompt_shown = true;
+}
+
+// Drop the inferiors whose process has gone or was detached. The session
+// ends with the last one.
+static bool reap_inferiors(session_t *s) {
+    bool reaped = false;
+
+    for (size_t i = s->inferiors.num_inferiors; i-- > 0;) {
+        dbg_ctx *ctx = s->inferiors.inferiors[i];
+        if (!ctx->exited && !ctx->detached)
+            continue;
+        if (ctx->exited && s->inferiors.num_inferiors > 1)
+            printf("[Inferior %d (process %d) exited]\n", ctx->num, ctx->pid);
+        inferior_remove(&s->inferiors, ctx);
+        reaped = true;
     }
-    
-    const char *path = argv[1];
-    char *newargv[] = { NULL };
-    char *newenviron[] = { NULL };
-    
-    pid_t child_pid = fork();
-    
-    if (child_pid == 0) {
-        ptrace(PTRACE_TRACEME);
-        printf("Executing tracee program...\n");
-        execve(path, newargv, newenviron);
+
+    if (s->inferiors.num_inferiors == 0)
+        s->quit = true;
+    return reaped;
+}
+
+static void poll_inferiors(session_t *s);
+
+// Run the complete lines read so far, up to a foreground continue. The
+// lines after it wait until the inferior has stopped.
+static void run_lines(session_t *s) {
+    size_t start = 0;
+
+    for (size_t i = 0; i < s->line_len && !s->quit && !waiting_for_stop(s); ++i) {
+        if (s->line[i] != '\n')
+            continue;
+        s->line[i] = '\0';
+        s->prompt_shown = false;
+
+        // a command that ends because its process exited only ends that inferior
+        bool ok = handle_command(s->inferiors.current, s->line + start);
+        if (!reap_inferiors(s) && !ok)
+            s->quit = true;
+        start = i + 1;
+
+        // the SIGCHLD of other inferiors may have been taken by a blocking wait
+        if (!s->quit)
+            poll_inferiors(s);
     }
-    else {
-        dbg_ctx ctx = {};
-        ctx.program_name = path;
-        ctx.pid = child_pid;
 
-        wait_for_signal(&ctx);
+    memmove(s->line, s->line + start, s->line_len - start);
+    s->line_len -= start;
+}
 
-        dwarf_init(&ctx.dwarf, ctx.program_name);
+// An inferior the debugger started gets the terminal while it runs in
+// the foreground, so that it can read it without SIGTTIN; Ctrl-C then
+// stops it with SIGINT. The debugger takes the terminal back with the
+// prompt.
+static void update_terminal(session_t *s) {
+    dbg_ctx *ctx = s->inferiors.current;
+    pid_t pgrp = s->tty_pgrp;
 
-        if ((ctx.elf_fd = open(ctx.program_name, O_RDONLY, 0)) < 0) {
-            printf(" opening \"%s\" failed\n", argv[1]);
-            exit(EXIT_FAILURE);
+    if (pgrp < 0)
+        return;
+    if (waiting_for_stop(s) && !ctx->attached)
+        pgrp = getpgid(ctx->pid);
+    if (pgrp > 0 && tcgetpgrp(STDIN_FILENO) != pgrp)
+        tcsetpgrp(STDIN_FILENO, pgrp);
+}
+
+// Input is only read while the prompt is up
+static void update_input(session_t *s) {
+    update_terminal(s);
+    if (s->input)
+        event_modify(&s->loop, s->input, waiting_for_stop(s) ? 0 : EPOLLIN);
+    if (!waiting_for_stop(s))
+        prompt(s);
+}
+
+static void on_input(void *arg, uint32_t events) {
+    session_t *s = arg;
+    char buf[512];
+    (void)events;
+
+    ssize_t len = read(STDIN_FILENO, buf, sizeof(buf));
+    if (len <= 0) {
+        s->quit = true;
+        return;
+    }
+
+    if (s->line_len + len > s->line_cap) {
+        s->line_cap = (s->line_len + len) * 2;
+        s->line = realloc(s->line, s->line_cap);
+    }
+    memcpy(s->line + s->line_len, buf, len);
+    s->line_len += len;
+
+    run_lines(s);
+}
+
+// Collect the stops of every inferior; a stop in the background is
+// printed over the prompt. Stopping the threads of one inferior waits for
+// SIGCHLD and may take that of another one polled before it, so passes
+// are repeated until one collects nothing.
+static void poll_inferiors(session_t *s) {
+    bool stopped = false, collected = true;
+
+    while (collected) {
+        collected = false;
+        for (size_t i = 0; i < s->inferiors.num_inferiors; ++i) {
+            dbg_ctx *ctx = s->inferiors.inferiors[i];
+            bool was_running = ctx->running;
+
+            if (ctx->exited || ctx->detached)
+                continue;
+            if (!poll_inferior(ctx, &collected) || !was_running || ctx->running)
+                continue;
+
+            stopped = true;
+            if (ctx != s->inferiors.current)
+                printf("[Inferior %d (process %d) stopped]\n", ctx->num, ctx->pid);
         }
+    }
 
-        init_elf(&ctx);
+    if (reap_inferiors(s) || stopped)
+        s->prompt_shown = false;
+}
 
-        init_load_addr(&ctx);
+static void on_signal(void *arg, uint32_t events) {
+    session_t *s = arg;
+    struct signalfd_siginfo info;
+    bool child = false;
+    (void)events;
 
-        size_t buf_size = 512;
-        char *buf = malloc(buf_size * sizeof(char));
+    while (read(s->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD) {
+            child = true;
+        }
+        else if (s->inferiors.current->running) {
+            interrupt_inferior(s->inferiors.current);
+        }
+        else {
+            // Ctrl-C at the prompt drops the line being typed
+            printf("\nQuit\n");
+            s->prompt_shown = false;
+        }
+    }
 
-        while (1) {
-            printf("sonicdbg> ");
-            getline(&buf, &buf_size, stdin);
-            if (!handle_command(&ctx, buf)) {
-                free_debugger(&ctx);
-                free(buf);
-                break;
-            }
+    if (child) {
+        poll_inferiors(s);
+        if (!s->quit)
+            run_lines(s);
+    }
+}
+
+static void session_run(session_t *s) {
+    sigset_t mask;
+
+    if (!event_loop_init(&s->loop)) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    if ((s->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+        event_add(&s->loop, s->signal_fd, EPOLLIN, on_signal, s) == NULL) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
+
+    s->tty_pgrp = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp() ? getpgrp() : -1;
+
+    // regular files cannot be polled, they are always readable
+    s->input = event_add(&s->loop, STDIN_FILENO, EPOLLIN, on_input, s);
+
+    while (!s->quit) {
+        update_input(s);
+
+        if (s->input == NULL && !waiting_for_stop(s)) {
+            on_input(s, EPOLLIN);
+            continue;
+        }
+
+        bool running = any_running(s);
+        if (event_loop_poll(&s->loop, running ? FLUSH_INTERVAL_MS : -1) < 0) {
+            perror("Error: ");
+            break;
+        }
+
+        // the inferiors' and the tracers' output shows up while they run
+        if (running) {
+            fflush(stdout);
+            for (size_t i = 0; i < s->inferiors.num_inferiors; ++i)
+                ftrace_flush(&s->inferiors.inferiors[i]->ftrace);
         }
-        
-        
     }
-}
\ No newline at end of file
+
+    if (s->tty_pgrp > 0)
+        tcsetpgrp(STDIN_FILENO, s->tty_pgrp);
+    inferior_table_free(&s->inferiors);
+    trace_stop();
+    event_loop_free(&s->loop);
+    close(s->signal_fd);
+    free(s->line);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || (strcmp(argv[1], "-p") == 0 && argc < 3)) {
+        printf("Usage: sonicdbg <prog> [args...]\n"
+               "       sonicdbg -p <pid>\n"
+               "       sonicdbg profile [--hz N] [-o file] <prog> [args...]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(argv[1], "profile") == 0)
+        return profile_main(argc - 2, argv + 2);
+
+    // SIGCHLD and SIGINT are read from the event loop. Blocked before any
+    // thread is created, so that no thread takes them instead. SIGTTOU is
+    // blocked so the debugger can write to and take back the terminal it
+    // handed to an inferior.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    session_t s = {};
+    inferior_table_init(&s.inferiors);
+
+    // indexing continues in the background while the prompt is up
+    if (strcmp(argv[1], "-p") == 0) {
+        printf("Attaching to process %s...\n", argv[2]);
+        if (inferior_attach(&s.inferiors, strtol(argv[2], NULL, 10)) == NULL)
+            exit(EXIT_FAILURE);
+    }
+    else {
+        printf("Executing tracee program...\n");
+        if (inferior_launch(&s.inferiors, argv + 1) == NULL)
+            exit(EXIT_FAILURE);
+    }
+
+    session_run(&s);
+    return 0;
+}
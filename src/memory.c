@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+
+#include "memory.h"
+
+// /proc/pid/mem descriptors, direct mapped by pid
+static struct {
+    pid_t pid;
+    int fd;
+} mem_fds[MEM_FD_CACHE_SIZE];
+
+static bool have_process_vm = true;
+
+
+static int get_mem_fd(const pid_t pid) {
+    size_t slot = pid % MEM_FD_CACHE_SIZE;
+    char path[32];
+
+    if (mem_fds[slot].pid == pid && mem_fds[slot].fd > 0)
+        return mem_fds[slot].fd;
+
+    if (mem_fds[slot].fd > 0)
+        close(mem_fds[slot].fd);
+
+    snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+    mem_fds[slot].pid = pid;
+    mem_fds[slot].fd = open(path, O_RDWR | O_CLOEXEC);
+
+    return mem_fds[slot].fd;
+}
+
+void close_memory(const pid_t pid) {
+    size_t slot = pid % MEM_FD_CACHE_SIZE;
+
+    if (mem_fds[slot].pid == pid && mem_fds[slot].fd > 0) {
+        close(mem_fds[slot].fd);
+        mem_fds[slot].fd = 0;
+    }
+}
+
+static size_t process_vm_transfer(const pid_t pid, const uint64_t address, void *buf, const size_t len, bool write) {
+    struct iovec local = { buf, len };
+    struct iovec remote = { (void *)address, len };
+    ssize_t ret;
+
+    if (!have_process_vm)
+        return 0;
+
+    if (write)
+        ret = process_vm_writev(pid, &local, 1, &remote, 1, 0);
+    else
+        ret = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+
+    if (ret < 0) {
+        if (errno == ENOSYS || errno == EPERM)
+            have_process_vm = false;
+        return 0;
+    }
+
+    return ret;
+}
+
+// /proc/pid/mem also reaches pages the inferior itself cannot read or write
+static size_t proc_mem_transfer(const pid_t pid, const uint64_t address, void *buf, const size_t len, bool write) {
+    int fd = get_mem_fd(pid);
+    size_t done = 0;
+
+    if (fd < 0)
+        return 0;
+
+    while (done < len) {
+        ssize_t ret;
+        if (write)
+            ret = pwrite(fd, (char *)buf + done, len - done, address + done);
+        else
+            ret = pread(fd, (char *)buf + done, len - done, address + done);
+
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    return done;
+}
+
+static size_t ptrace_transfer(const pid_t pid, const uint64_t address, void *buf, const size_t len, bool write) {
+    size_t done = 0;
+
+    while (done < len) {
+        uint64_t word_addr = (address + done) & ~7UL;
+        size_t off = (address + done) - word_addr;
+        size_t n = 8 - off < len - done ? 8 - off : len - done;
+        long word;
+
+        errno = 0;
+        word = ptrace(PTRACE_PEEKDATA, pid, word_addr, NULL);
+        if (errno != 0)
+            break;
+
+        if (write) {
+            memcpy((char *)&word + off, (char *)buf + done, n);
+            if (ptrace(PTRACE_POKEDATA, pid, word_addr, word) < 0)
+                break;
+        }
+        else {
+            memcpy((char *)buf + done, (char *)&word + off, n);
+        }
+
+        done += n;
+    }
+
+    return done;
+}
+
+static ssize_t transfer_memory(const pid_t pid, const uint64_t address, void *buf, const size_t len, bool write) {
+    size_t done = 0;
+
+    if (len == 0)
+        return 0;
+
+    done += process_vm_transfer(pid, address, buf, len, write);
+    if (done < len)
+        done += proc_mem_transfer(pid, address + done, (char *)buf + done, len - done, write);
+    if (done < len)
+        done += ptrace_transfer(pid, address + done, (char *)buf + done, len - done, write);
+
+    return done ? (ssize_t)done : -1;
+}
+
+// Returns the number of bytes transferred, which is short if the range
+// runs into unmapped memory, or -1 if nothing could be transferred
+ssize_t read_memory_range(const pid_t pid, const uint64_t address, void *buf, const size_t len) {
+    return transfer_memory(pid, address, buf, len, false);
+}
+
+ssize_t write_memory_range(const pid_t pid, const uint64_t address, const void *buf, const size_t len) {
+    return transfer_memory(pid, address, (void *)buf, len, true);
+}
+
+// Code patches skip process_vm_writev: only the /proc/pid/mem and ptrace
+// paths go through the kernel's ptrace access, which keeps the inferior's
+// instruction cache coherent
+ssize_t write_text_range(const pid_t pid, const uint64_t address, const void *buf, const size_t len) {
+    size_t done = 0;
+
+    if (len == 0)
+        return 0;
+
+    done += proc_mem_transfer(pid, address, (void *)buf, len, true);
+    if (done < len)
+        done += ptrace_transfer(pid, address + done, (char *)buf + done, len - done, true);
+
+    return done ? (ssize_t)done : -1;
+}
+
+long read_memory(const pid_t pid, const uint64_t address) {
+    long val;
+    if (read_memory_range(pid, address, &val, sizeof(val)) != sizeof(val)) {
+        printf("Error: cannot read memory at 0x%lx\n", address);
+        exit(EXIT_FAILURE);
+    }
+
+    return val;
+}
+
+void write_memory(const pid_t pid, const uint64_t address, const long val) {
+    if (write_memory_range(pid, address, &val, sizeof(val)) != sizeof(val)) {
+        printf("Error: cannot write memory at 0x%lx\n", address);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void hexdump_memory(const pid_t pid, const uint64_t address, const size_t len) {
+    unsigned char *buf = malloc(MEM_CHUNK_SIZE);
+    size_t done = 0;
+
+    while (done < len) {
+        size_t want = len - done < MEM_CHUNK_SIZE ? len - done : MEM_CHUNK_SIZE;
+        ssize_t got = read_memory_range(pid, address + done, buf, want);
+        if (got <= 0) {
+            printf("Error: cannot access memory at 0x%lx\n", address + done);
+            break;
+        }
+
+        for (ssize_t i = 0; i < got; i += 16) {
+            ssize_t n = got - i < 16 ? got - i : 16;
+
+            printf("0x%016lx: ", address + done + i);
+            for (ssize_t j = 0; j < 16; ++j) {
+                if (j < n)
+                    printf("%02x ", buf[i + j]);
+                else
+                    printf("   ");
+            }
+            printf(" |");
+            for (ssize_t j = 0; j < n; ++j)
+                putchar(isprint(buf[i + j]) ? buf[i + j] : '.');
+            printf("|\n");
+        }
+
+        done += got;
+        if ((size_t)got < want) {
+            printf("Error: cannot access memory at 0x%lx\n", address + done);
+            break;
+        }
+    }
+
+    free(buf);
+}
+
+void dump_memory_to_file(const pid_t pid, const char *path, const uint64_t start, const uint64_t end) {
+    char *buf;
+    int fd;
+    uint64_t addr = start;
+
+    if (end <= start) {
+        printf("Error: invalid memory range\n");
+        return;
+    }
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        printf("Error opening %s\n", path);
+        perror("Error");
+        return;
+    }
+
+    buf = malloc(MEM_CHUNK_SIZE);
+    while (addr < end) {
+        size_t want = end - addr < MEM_CHUNK_SIZE ? end - addr : MEM_CHUNK_SIZE;
+        ssize_t got = read_memory_range(pid, addr, buf, want);
+        if (got <= 0)
+            break;
+        if (write(fd, buf, got) != got) {
+            perror("Error");
+            break;
+        }
+
+        addr += got;
+        if ((size_t)got < want)
+            break;
+    }
+
+    if (addr < end)
+        printf("Error: cannot access memory at 0x%lx\n", addr);
+    printf("Wrote %lu bytes to %s\n", addr - start, path);
+
+    free(buf);
+    close(fd);
+}
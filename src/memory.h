@@ -0,0 +1,23 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#define MEM_FD_CACHE_SIZE   64
+#define MEM_CHUNK_SIZE      (1 << 20)
+
+
+ssize_t read_memory_range(const pid_t pid, const uint64_t address, void *buf, const size_t len);
+ssize_t write_memory_range(const pid_t pid, const uint64_t address, const void *buf, const size_t len);
+ssize_t write_text_range(const pid_t pid, const uint64_t address, const void *buf, const size_t len);
+void close_memory(const pid_t pid);
+
+long read_memory(const pid_t pid, const uint64_t address);
+void write_memory(const pid_t pid, const uint64_t address, const long val);
+
+void hexdump_memory(const pid_t pid, const uint64_t address, const size_t len);
+void dump_memory_to_file(const pid_t pid, const char *path, const uint64_t start, const uint64_t end);
+
+#endif
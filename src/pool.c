@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define POOL_ALIGN 16
+#define POOL_ROUND(n) (((n) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+
+void pool_init(pool_t *pool, size_t obj_size) {
+    pool->obj_size = POOL_ROUND(obj_size);
+    pool->free_list = NULL;
+    pool->chunks = NULL;
+    pool->chunk_objs = POOL_FIRST_OBJS;
+}
+
+void pool_destroy(pool_t *pool) {
+    pool_chunk_t *chunk = pool->chunks;
+    while (chunk) {
+        pool_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    pool->free_list = NULL;
+    pool->chunks = NULL;
+    pool->chunk_objs = POOL_FIRST_OBJS;
+}
+
+// Small tables, such as those of the many inferiors of one session, stay
+// small; busy ones soon allocate POOL_CHUNK_OBJS at a time
+static void pool_grow(pool_t *pool) {
+    size_t header = POOL_ROUND(sizeof(pool_chunk_t));
+    size_t num_objs = pool->chunk_objs;
+    pool_chunk_t *chunk = malloc(header + num_objs * pool->obj_size);
+
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    if (pool->chunk_objs < POOL_CHUNK_OBJS)
+        pool->chunk_objs *= 2;
+
+    char *objs = (char *)chunk + header;
+    for (size_t i = 0; i < num_objs; ++i)
+        pool_free(pool, objs + i * pool->obj_size);
+}
+
+// Returned objects are zeroed
+void *pool_alloc(pool_t *pool) {
+    if (pool->free_list == NULL)
+        pool_grow(pool);
+
+    void *obj = pool->free_list;
+    pool->free_list = *(void **)obj;
+    memset(obj, 0, pool->obj_size);
+
+    return obj;
+}
+
+void pool_free(pool_t *pool, void *obj) {
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+}
@@ -0,0 +1,28 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+#define POOL_CHUNK_OBJS     64
+#define POOL_FIRST_OBJS     4       // chunks double up to POOL_CHUNK_OBJS
+
+
+typedef struct pool_chunk {
+    struct pool_chunk *next;
+} pool_chunk_t;
+
+// Fixed size object allocator; freed objects are recycled through a free list
+typedef struct {
+    size_t obj_size;
+    void *free_list;
+    pool_chunk_t *chunks;
+    size_t chunk_objs;      // objects in the next chunk
+} pool_t;
+
+
+void pool_init(pool_t *pool, size_t obj_size);
+void pool_destroy(pool_t *pool);
+void *pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *obj);
+
+#endif
@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "profile.h"
+#include "debugger.h"
+#include "dbg_dwarf.h"
+
+
+// Unique stacks, hashed by their thread and frames. The frames of all
+// stacks are stored back to back in one array.
+typedef struct {
+    uint64_t hash;
+    pid_t tid;
+    uint32_t offset;
+    uint32_t depth;
+    unsigned long count;
+} stack_entry_t;
+
+typedef struct {
+    stack_entry_t *entries;
+    size_t num_entries;
+    size_t cap;
+
+    uint64_t *frames;
+    size_t num_frames;
+    size_t frames_cap;
+
+    unsigned long samples;
+} stack_table_t;
+
+typedef struct {
+    const sym_index_t *syms;
+    const func_index_t *idx;
+    uint64_t load_bias;
+    const uint64_t *addrs;
+    const char **names;
+    size_t first;
+    size_t last;
+} symbolize_job_t;
+
+typedef struct {
+    char *line;
+    unsigned long count;
+} folded_t;
+
+
+static uint64_t hash_frames(pid_t tid, const uint64_t *frames, size_t depth) {
+    uint64_t hash = (14695981039346656037ULL ^ tid) * 1099511628211ULL;
+    for (size_t i = 0; i < depth; ++i) {
+        hash ^= frames[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void stack_table_put(stack_entry_t *entries, size_t cap, const stack_entry_t *entry) {
+    size_t slot = entry->hash & (cap - 1);
+    while (entries[slot].count != 0)
+        slot = (slot + 1) & (cap - 1);
+    entries[slot] = *entry;
+}
+
+static void stack_table_grow(stack_table_t *table) {
+    size_t new_cap = table->cap ? table->cap * 2 : 1024;
+    stack_entry_t *new_entries = calloc(new_cap, sizeof(stack_entry_t));
+
+    for (size_t i = 0; i < table->cap; ++i) {
+        if (table->entries[i].count)
+            stack_table_put(new_entries, new_cap, &table->entries[i]);
+    }
+
+    free(table->entries);
+    table->entries = new_entries;
+    table->cap = new_cap;
+}
+
+static void add_stack(stack_table_t *table, pid_t tid, const uint64_t *frames, size_t depth) {
+    uint64_t hash = hash_frames(tid, frames, depth);
+
+    table->samples++;
+
+    if (table->cap) {
+        size_t slot = hash & (table->cap - 1);
+        while (table->entries[slot].count != 0) {
+            stack_entry_t *entry = &table->entries[slot];
+            if (entry->hash == hash && entry->tid == tid && entry->depth == depth &&
+                memcmp(table->frames + entry->offset, frames, depth * sizeof(uint64_t)) == 0) {
+                entry->count++;
+                return;
+            }
+            slot = (slot + 1) & (table->cap - 1);
+        }
+    }
+
+    // keep the load factor at or below 1/2
+    if ((table->num_entries + 1) * 2 > table->cap)
+        stack_table_grow(table);
+
+    if (table->num_frames + depth > table->frames_cap) {
+        table->frames_cap = table->frames_cap ? table->frames_cap * 2 : 4096;
+        while (table->frames_cap < table->num_frames + depth)
+            table->frames_cap *= 2;
+        table->frames = realloc(table->frames, table->frames_cap * sizeof(uint64_t));
+    }
+
+    stack_entry_t entry = { hash, tid, table->num_frames, depth, 1 };
+    memcpy(table->frames + table->num_frames, frames, depth * sizeof(uint64_t));
+    table->num_frames += depth;
+    stack_table_put(table->entries, table->cap, &entry);
+    table->num_entries++;
+}
+
+// Frame 0 is the pc, return addresses are stored minus one instruction
+// so they symbolize to the call site
+static size_t walk_stack(dbg_ctx *ctx, uint64_t *frames) {
+    unwind_frame_t unwound[PROFILE_MAX_DEPTH];
+    size_t depth = unwind_thread(ctx, unwound, PROFILE_MAX_DEPTH);
+
+    for (size_t i = 0; i < depth; ++i)
+        frames[i] = i == 0 ? unwound[i].pc : unwound[i].pc - 4;
+
+    return depth;
+}
+
+// Interrupt every thread and wait until each has stopped, passing on
+// any signal stops on the way. Returns false once the inferior is gone.
+// Threads cloned meanwhile are added stopped, their first stop is an
+// event stop as well; threads that exit are dropped.
+// A group-stop (SIGSTOP, Ctrl-Z) is reported as an event stop too, with
+// the stop signal rather than SIGTRAP, and takes the interrupt's place.
+// The thread is left stopped with PTRACE_LISTEN, unsampled, and the
+// SIGTRAP event stop that follows its SIGCONT stands for the interrupt.
+static bool interrupt_threads(dbg_ctx *ctx) {
+    size_t waiting = 0;
+    int status;
+
+    for (size_t i = 0; i < ctx->threads.num_threads; ++i) {
+        thread_t *thread = ctx->threads.threads[i];
+        thread->stop_expected = ptrace(PTRACE_INTERRUPT, thread->tid, NULL, NULL) == 0;
+        waiting += thread->stop_expected;
+    }
+    if (waiting == 0)
+        return false;
+
+    while (waiting) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0)
+            return false;
+
+        thread_t *thread = thread_find(&ctx->threads, tid);
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            // the main thread is reaped last, with the process
+            if (tid == ctx->pid)
+                return false;
+            if (thread) {
+                waiting -= thread->stop_expected;
+                thread_remove(&ctx->threads, thread);
+            }
+            continue;
+        }
+
+        // a new thread can stop before its parent reports the clone
+        if (thread == NULL) {
+            thread = thread_add(&ctx->threads, tid);
+            thread->stop_expected = true;
+            waiting++;
+        }
+
+        if (status >> 16 == PTRACE_EVENT_STOP) {
+            if (WSTOPSIG(status) == SIGTRAP) {
+                waiting -= thread->stop_expected;
+                thread->stop_expected = false;
+                thread->state = THREAD_STOPPED;
+            }
+            else {
+                ptrace(PTRACE_LISTEN, tid, NULL, NULL);
+            }
+            continue;
+        }
+
+        if (status >> 16 == PTRACE_EVENT_CLONE) {
+            unsigned long new_tid;
+            if (ptrace(PTRACE_GETEVENTMSG, tid, NULL, &new_tid) == 0 &&
+                thread_find(&ctx->threads, new_tid) == NULL) {
+                thread_add(&ctx->threads, new_tid)->stop_expected = true;
+                waiting++;
+            }
+        }
+
+        // the interrupt stays pending past other stops; event stops come
+        // with SIGTRAP, which is not to be delivered
+        ptrace(PTRACE_CONT, tid, NULL, status >> 16 ? 0 : WSTOPSIG(status));
+    }
+
+    return true;
+}
+
+static void resume_threads(dbg_ctx *ctx) {
+    for (size_t i = 0; i < ctx->threads.num_threads; ++i) {
+        thread_t *thread = ctx->threads.threads[i];
+        if (thread->state != THREAD_STOPPED)
+            continue;
+        invalidate_registers(&thread->regs);
+        thread->state = THREAD_RUNNING;
+        ptrace(PTRACE_CONT, thread->tid, NULL, NULL);
+    }
+}
+
+static void sample_loop(dbg_ctx *ctx, stack_table_t *stacks, long hz) {
+    uint64_t frames[PROFILE_MAX_DEPTH];
+    long period_ns = 1000000000L / hz;
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (unsigned long tick = 0; ; ++tick) {
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        if (!interrupt_threads(ctx))
+            break;
+
+        // libraries are unwound with their own CFI; the list is read again
+        // every second to catch the ones loaded since
+        if (tick % hz == 0)
+            solib_refresh(ctx);
+
+        for (size_t i = 0; i < ctx->threads.num_threads; ++i) {
+            ctx->thread = ctx->threads.threads[i];
+            if (ctx->thread->state != THREAD_STOPPED)
+                continue;
+            size_t depth = walk_stack(ctx, frames);
+            add_stack(stacks, ctx->thread->tid, frames, depth);
+        }
+        ctx->thread = ctx->threads.threads[0];
+
+        resume_threads(ctx);
+
+        // fell behind, e.g. a slow sample: skip the missed ticks
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec + 1)
+            next = now;
+    }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void *symbolize_range(void *arg) {
+    symbolize_job_t *job = arg;
+
+    for (size_t i = job->first; i < job->last; ++i) {
+        const sym_entry_t *sym = sym_index_lookup_pc(job->syms, job->addrs[i] - job->load_bias);
+        const func_entry_t *func = sym ? NULL : func_index_lookup_pc(job->idx, job->addrs[i] - job->load_bias);
+
+        if (sym)
+            job->names[i] = sym_entry_name(job->syms, sym);
+        else
+            job->names[i] = func ? func_entry_name(job->idx, func) : "[unknown]";
+    }
+
+    return NULL;
+}
+
+// Each distinct address is looked up once, the lookups are split
+// between worker threads
+static size_t symbolize_addrs(dbg_ctx *ctx, const stack_table_t *stacks, uint64_t **addrs_out, const char ***names_out) {
+    uint64_t *addrs = malloc((stacks->num_frames + 1) * sizeof(uint64_t));
+    size_t num_addrs = 0;
+
+    memcpy(addrs, stacks->frames, stacks->num_frames * sizeof(uint64_t));
+    qsort(addrs, stacks->num_frames, sizeof(uint64_t), cmp_u64);
+    for (size_t i = 0; i < stacks->num_frames; ++i) {
+        if (num_addrs == 0 || addrs[num_addrs - 1] != addrs[i])
+            addrs[num_addrs++] = addrs[i];
+    }
+
+    const char **names = malloc((num_addrs + 1) * sizeof(char *));
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > PROFILE_MAX_THREADS)
+        num_threads = PROFILE_MAX_THREADS;
+    if (num_threads > (long)(num_addrs / 1024) + 1)
+        num_threads = num_addrs / 1024 + 1;
+
+    pthread_t threads[PROFILE_MAX_THREADS];
+    symbolize_job_t jobs[PROFILE_MAX_THREADS];
+    size_t per_thread = (num_addrs + num_threads - 1) / num_threads;
+
+    for (long t = 0; t < num_threads; ++t) {
+        jobs[t] = (symbolize_job_t){ &ctx->bin->sym_index, &ctx->bin->func_index, add_load_addr(ctx, 0), addrs, names, t * per_thread, (t + 1) * per_thread };
+        if (jobs[t].first > num_addrs)
+            jobs[t].first = num_addrs;
+        if (jobs[t].last > num_addrs)
+            jobs[t].last = num_addrs;
+        if (t > 0 && pthread_create(&threads[t], NULL, symbolize_range, &jobs[t]) != 0)
+            symbolize_range(&jobs[t]);
+    }
+    symbolize_range(&jobs[0]);
+    for (long t = 1; t < num_threads; ++t)
+        pthread_join(threads[t], NULL);
+
+    *addrs_out = addrs;
+    *names_out = names;
+    return num_addrs;
+}
+
+static const char *addr_name(const uint64_t *addrs, const char **names, size_t num_addrs, uint64_t addr) {
+    const uint64_t *found = bsearch(&addr, addrs, num_addrs, sizeof(uint64_t), cmp_u64);
+    return names[found - addrs];
+}
+
+static int cmp_folded(const void *a, const void *b) {
+    return strcmp(((const folded_t *)a)->line, ((const folded_t *)b)->line);
+}
+
+// One "thread;root;...;leaf count" line per distinct symbolized stack,
+// the thread being the root frame, so every thread gets a tower of its own
+static void write_folded(FILE *out, dbg_ctx *ctx, const stack_table_t *stacks) {
+    uint64_t *addrs;
+    const char **names;
+    size_t num_addrs = symbolize_addrs(ctx, stacks, &addrs, &names);
+    folded_t *folded = malloc((stacks->num_entries + 1) * sizeof(folded_t));
+    size_t num_folded = 0;
+
+    for (size_t i = 0; i < stacks->cap; ++i) {
+        const stack_entry_t *entry = &stacks->entries[i];
+        if (entry->count == 0)
+            continue;
+
+        const uint64_t *frames = stacks->frames + entry->offset;
+        size_t cap = 256;
+        char *line = malloc(cap);
+        size_t len = snprintf(line, cap, "[tid %d]", entry->tid);
+
+        for (size_t j = entry->depth; j-- > 0;) {
+            const char *name = addr_name(addrs, names, num_addrs, frames[j]);
+            size_t name_len = strlen(name);
+            while (len + name_len + 2 > cap) {
+                cap *= 2;
+                line = realloc(line, cap);
+            }
+            line[len++] = ';';
+            memcpy(line + len, name, name_len);
+            len += name_len;
+        }
+        line[len] = '\0';
+
+        folded[num_folded++] = (folded_t){ line, entry->count };
+    }
+
+    // different addresses in the same functions fold to the same line
+    qsort(folded, num_folded, sizeof(folded_t), cmp_folded);
+    for (size_t i = 0; i < num_folded; ++i) {
+        unsigned long count = folded[i].count;
+        while (i + 1 < num_folded && strcmp(folded[i].line, folded[i + 1].line) == 0) {
+            free(folded[i].line);
+            count += folded[++i].count;
+        }
+        fprintf(out, "%s %lu\n", folded[i].line, count);
+        free(folded[i].line);
+    }
+
+    free(folded);
+    free(names);
+    free(addrs);
+}
+
+int profile_main(int argc, char **argv) {
+    long hz = PROFILE_DEFAULT_HZ;
+    const char *output = NULL;
+    char **prog_argv = NULL;
+    const char *path = NULL;
+
+    // everything from the program on is its command line
+    for (int i = 0; i < argc && path == NULL; ++i) {
+        if (strcmp(argv[i], "--hz") == 0 && i + 1 < argc)
+            hz = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else
+            path = *(prog_argv = argv + i);
+    }
+
+    if (path == NULL || hz <= 0 || hz > 100000) {
+        printf("Usage: sonicdbg profile [--hz N] [-o file] <prog> [args...]\n");
+        return EXIT_FAILURE;
+    }
+
+    dbg_ctx ctx = {};
+    if ((ctx.bin = binary_open(path)) == NULL)
+        return EXIT_FAILURE;
+
+    ctx.pid = spawn_seized(prog_argv, PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    thread_table_init(&ctx.threads);
+    ctx.thread = thread_add(&ctx.threads, ctx.pid);
+    bp_table_init(&ctx.breakpoints, ctx.pid);
+    ftrace_init(&ctx.ftrace, ctx.pid);
+
+    // the load address is only known once the new image is mapped
+    int status;
+    if (waitpid(ctx.pid, &status, 0) < 0 || !WIFSTOPPED(status) ||
+        status >> 8 != (SIGTRAP | (PTRACE_EVENT_EXEC << 8))) {
+        printf("Failed to execute %s\n", path);
+        return EXIT_FAILURE;
+    }
+    init_load_addr(&ctx);
+    ctx.thread->state = THREAD_RUNNING;
+    ptrace(PTRACE_CONT, ctx.pid, NULL, NULL);
+
+    stack_table_t stacks = {};
+    sample_loop(&ctx, &stacks, hz);
+
+    dwarf_init(&ctx.bin->dwarf, ctx.bin->path);
+    build_dwarf_index(ctx.bin);
+
+    FILE *out = stdout;
+    if (output && (out = fopen(output, "w")) == NULL) {
+        printf("Error opening %s\n", output);
+        out = stdout;
+    }
+    write_folded(out, &ctx, &stacks);
+    if (out != stdout)
+        fclose(out);
+
+    fprintf(stderr, "%lu samples, %zu distinct stacks\n", stacks.samples, stacks.num_entries);
+
+    free(stacks.entries);
+    free(stacks.frames);
+    free_debugger(&ctx);
+    binary_free(ctx.bin);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,12 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#define PROFILE_DEFAULT_HZ      99
+#define PROFILE_MAX_DEPTH       128
+#define PROFILE_MAX_THREADS     8
+
+
+// sonicdbg profile [--hz N] [-o file] <prog>
+int profile_main(int argc, char **argv);
+
+#endif
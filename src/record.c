@@ -0,0 +1,408 @@
+#define _XOPEN_SOURCE 700
+
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "record.h"
+#include "dbg_dwarf.h"
+#include "utils.h"
+
+// largest encoding of one record: pc delta, register mask and 32 deltas
+#define RECORD_MAX_LEN  (10 + 5 + RECORD_NUM_REGS * 10)
+
+
+typedef struct {
+    FILE *file;
+    unsigned char *buf;
+    size_t len;
+    uint64_t bytes;
+} record_writer_t;
+
+typedef struct {
+    uint64_t pc;
+    uint64_t count;
+    const char *func;
+    const char *file;
+    uint64_t line;
+} pc_count_t;
+
+// pc -> instruction count, open addressing with a zero pc as the empty slot
+typedef struct {
+    pc_count_t *slots;
+    size_t cap;
+    size_t len;
+} pc_table_t;
+
+typedef struct {
+    const char *name;
+    uint64_t line;
+    uint64_t count;
+} stat_group_t;
+
+
+static char *record_path;
+
+void record_set_path(const char *path) {
+    free(record_path);
+    record_path = strdup(path);
+}
+
+static const char *get_record_path(void) {
+    return record_path ? record_path : RECORD_DEFAULT_PATH;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned char *put_uleb(unsigned char *p, uint64_t val) {
+    do {
+        unsigned char byte = val & 0x7f;
+        val >>= 7;
+        *p++ = byte | (val ? 0x80 : 0);
+    } while (val);
+    return p;
+}
+
+static unsigned char *put_sleb(unsigned char *p, int64_t val) {
+    return put_uleb(p, ((uint64_t)val << 1) ^ (uint64_t)(val >> 63));
+}
+
+static const unsigned char *get_uleb(const unsigned char *p, const unsigned char *end, uint64_t *val) {
+    uint64_t result = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char byte = *p++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *val = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const unsigned char *get_sleb(const unsigned char *p, const unsigned char *end, int64_t *val) {
+    uint64_t zz;
+    if ((p = get_uleb(p, end, &zz)) == NULL)
+        return NULL;
+    *val = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+    return p;
+}
+
+static void writer_flush(record_writer_t *w) {
+    if (w->len && fwrite(w->buf, 1, w->len, w->file) != w->len)
+        perror("Error writing trace");
+    w->bytes += w->len;
+    w->len = 0;
+}
+
+// The inferior is stepped with step_thread, never reported: nothing is
+// symbolized or printed until recording ends, and each step costs a
+// SINGLESTEP, a waitpid and the GETREGSET that reads the new pc
+bool record_execution(dbg_ctx *ctx, uint64_t max_steps, uint64_t until_addr, bool with_regs) {
+    record_writer_t w = {};
+    uint64_t prev_regs[RECORD_NUM_REGS] = {};
+    uint64_t prev_pc = 0, steps = 0;
+    bool running = true;
+
+    if ((w.file = fopen(get_record_path(), "wb")) == NULL) {
+        printf("Error opening %s\n", get_record_path());
+        perror("Error");
+        return true;
+    }
+
+    record_header_t header = {
+        .load_bias = add_load_addr(ctx, 0),
+        .flags = with_regs ? RECORD_FLAG_REGS : 0,
+    };
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, w.file);
+    w.bytes = sizeof(header);
+    w.buf = malloc(RECORD_BUF_SIZE);
+
+    // the recorded thread may wait on the others, which run meanwhile
+    // (all-stop) and stop again once recording ends
+    resume_other_threads(ctx);
+    double start = now_sec();
+
+    while (max_steps == 0 || steps < max_steps) {
+        uint64_t pc = get_pc(ctx);
+        if (pc == until_addr)
+            break;
+
+        if (w.len > RECORD_BUF_SIZE - RECORD_MAX_LEN)
+            writer_flush(&w);
+
+        unsigned char *p = put_sleb(w.buf + w.len, (int64_t)(pc - prev_pc) >> 2);
+        prev_pc = pc;
+
+        if (with_regs) {
+            uint32_t mask = 0;
+            for (int i = 0; i < RECORD_NUM_REGS; ++i)
+                if (ctx->thread->regs.regs[i] != prev_regs[i])
+                    mask |= 1u << i;
+
+            p = put_uleb(p, mask);
+            for (int i = 0; i < RECORD_NUM_REGS; ++i) {
+                if (mask & (1u << i)) {
+                    p = put_sleb(p, (int64_t)(ctx->thread->regs.regs[i] - prev_regs[i]));
+                    prev_regs[i] = ctx->thread->regs.regs[i];
+                }
+            }
+        }
+        w.len = p - w.buf;
+        steps++;
+
+        // breakpoints are stepped over, not reported
+        bp_site_t *site = at_breakpoint(ctx);
+        if (site && site->inserted) {
+            step_over_breakpoint(ctx);
+            continue;
+        }
+
+        // only the exit of the whole process ends the session; the
+        // recorded thread exiting alone just ends the recording
+        thread_step_t step = step_thread(ctx);
+        if (step == THREAD_GONE) {
+            running = !ctx->exited;
+            break;
+        }
+        if (step == THREAD_FAULTED) {
+            printf("Got signal: %s\n", strsignal(ctx->thread->pending_sig));
+            break;
+        }
+    }
+
+    double elapsed = now_sec() - start;
+    if (!ctx->exited && !ctx->non_stop)
+        stop_all_threads(ctx);
+    writer_flush(&w);
+    fclose(w.file);
+    free(w.buf);
+
+    printf("Recorded %lu instructions to %s (%lu bytes", steps, get_record_path(), w.bytes);
+    if (elapsed > 0)
+        printf(", %.0f steps/s", steps / elapsed);
+    printf(")\n");
+
+    if (running) {
+        struct src_info src_info = get_src_info(ctx, sub_load_addr(ctx, get_pc(ctx)));
+        print_source(ctx, &src_info);
+    }
+    return running;
+}
+
+static unsigned char *read_trace(size_t *len, record_header_t *header) {
+    FILE *file = fopen(get_record_path(), "rb");
+    if (file == NULL) {
+        printf("Error opening %s\n", get_record_path());
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    if (size < (long)sizeof(*header) || fread(header, sizeof(*header), 1, file) != 1 ||
+        memcmp(header->magic, RECORD_MAGIC, sizeof(header->magic)) != 0) {
+        printf("%s is not a trace file\n", get_record_path());
+        fclose(file);
+        return NULL;
+    }
+
+    *len = size - sizeof(*header);
+    unsigned char *data = malloc(*len ? *len : 1);
+    if (fread(data, 1, *len, file) != *len) {
+        printf("Error reading %s\n", get_record_path());
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+// Decode the record at p, returning the position of the next one or NULL
+// at the end of the data
+static const unsigned char *next_record(const unsigned char *p, const unsigned char *end,
+                                        uint32_t flags, uint64_t *pc) {
+    int64_t delta;
+
+    if (p >= end || (p = get_sleb(p, end, &delta)) == NULL)
+        return NULL;
+    *pc += (uint64_t)delta << 2;
+
+    if (flags & RECORD_FLAG_REGS) {
+        uint64_t mask;
+        if ((p = get_uleb(p, end, &mask)) == NULL)
+            return NULL;
+        for (int i = 0; i < RECORD_NUM_REGS && p; ++i)
+            if (mask & (1u << i))
+                p = get_sleb(p, end, &delta);
+    }
+    return p;
+}
+
+static void symbolize(dbg_ctx *ctx, pc_count_t *entry, uint64_t load_bias) {
+    uint64_t pc = entry->pc - load_bias;
+    struct src_info src_info = get_src_info(ctx, pc);
+
+    entry->func = symbol_at(ctx, add_load_addr(ctx, pc));
+    entry->file = src_info.src_file_name;
+    entry->line = src_info.line_no;
+}
+
+void record_dump(dbg_ctx *ctx, uint64_t limit) {
+    record_header_t header;
+    size_t len;
+    unsigned char *data = read_trace(&len, &header);
+    if (data == NULL)
+        return;
+
+    const unsigned char *p = data, *end = data + len;
+    uint64_t pc = 0;
+
+    for (uint64_t i = 0; (limit == 0 || i < limit) && (p = next_record(p, end, header.flags, &pc)); ++i) {
+        pc_count_t entry = { .pc = pc };
+        symbolize(ctx, &entry, header.load_bias);
+
+        printf("%8lu " BLU "0x%016lx" RESET " in " YEL "%s ()" RESET, i, pc, entry.func ? entry.func : "??");
+        if (entry.file)
+            printf(" at " GRN "%s" RESET ":%lu", loc_last_dir(entry.file), entry.line);
+        printf("\n");
+    }
+    free(data);
+}
+
+static pc_count_t *pc_table_slot(pc_table_t *table, uint64_t pc) {
+    size_t i = (pc >> 2) * 0x9E3779B97F4A7C15ull >> 20;
+    for (;; ++i) {
+        pc_count_t *slot = &table->slots[i & (table->cap - 1)];
+        if (slot->pc == pc || slot->pc == 0)
+            return slot;
+    }
+}
+
+static void pc_table_add(pc_table_t *table, uint64_t pc) {
+    if (table->len * 2 >= table->cap) {
+        pc_table_t grown = { .cap = table->cap ? table->cap * 2 : 4096 };
+        grown.slots = calloc(grown.cap, sizeof(pc_count_t));
+        for (size_t i = 0; i < table->cap; ++i)
+            if (table->slots[i].pc)
+                *pc_table_slot(&grown, table->slots[i].pc) = table->slots[i];
+        grown.len = table->len;
+        free(table->slots);
+        *table = grown;
+    }
+
+    pc_count_t *slot = pc_table_slot(table, pc);
+    if (slot->pc == 0) {
+        slot->pc = pc;
+        table->len++;
+    }
+    slot->count++;
+}
+
+static int cmp_name(const char *a, const char *b) {
+    if (a == NULL || b == NULL)
+        return (a == NULL) - (b == NULL);
+    return strcmp(a, b);
+}
+
+static int cmp_by_func(const void *a, const void *b) {
+    return cmp_name(((const pc_count_t *)a)->func, ((const pc_count_t *)b)->func);
+}
+
+static int cmp_by_line(const void *a, const void *b) {
+    const pc_count_t *x = a, *y = b;
+    int ret = cmp_name(x->file, y->file);
+    if (ret)
+        return ret;
+    return (x->line > y->line) - (x->line < y->line);
+}
+
+static int cmp_group_count(const void *a, const void *b) {
+    const stat_group_t *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+// Sum the counts of adjacent entries the comparison considers equal and
+// print the largest groups
+static void print_groups(pc_count_t *entries, size_t num, uint64_t total, bool by_line) {
+    stat_group_t *groups = malloc(num * sizeof(stat_group_t));
+    size_t num_groups = 0;
+
+    qsort(entries, num, sizeof(pc_count_t), by_line ? cmp_by_line : cmp_by_func);
+
+    for (size_t i = 0; i < num; ++i) {
+        if (i == 0 || (by_line ? cmp_by_line : cmp_by_func)(&entries[i - 1], &entries[i]) != 0) {
+            groups[num_groups++] = (stat_group_t) {
+                .name = by_line ? entries[i].file : entries[i].func,
+                .line = entries[i].line,
+            };
+        }
+        groups[num_groups - 1].count += entries[i].count;
+    }
+
+    qsort(groups, num_groups, sizeof(stat_group_t), cmp_group_count);
+
+    printf("\n%-40s %14s %7s\n", by_line ? "Line" : "Function", "Instructions", "%");
+    for (size_t i = 0; i < num_groups && i < RECORD_TOP; ++i) {
+        char name[256];
+        if (groups[i].name == NULL)
+            snprintf(name, sizeof(name), "??");
+        else if (by_line)
+            snprintf(name, sizeof(name), "%s:%lu", loc_last_dir(groups[i].name), groups[i].line);
+        else
+            snprintf(name, sizeof(name), "%s", groups[i].name);
+
+        printf("%-40s %14lu %6.2f%%\n", name, groups[i].count, 100.0 * groups[i].count / total);
+    }
+    free(groups);
+}
+
+// Each distinct pc is symbolized once, however many times it ran
+void record_stats(dbg_ctx *ctx) {
+    record_header_t header;
+    size_t len;
+    unsigned char *data = read_trace(&len, &header);
+    if (data == NULL)
+        return;
+
+    pc_table_t table = {};
+    const unsigned char *p = data, *end = data + len;
+    uint64_t pc = 0, total = 0;
+
+    while ((p = next_record(p, end, header.flags, &pc)) != NULL) {
+        pc_table_add(&table, pc);
+        total++;
+    }
+    free(data);
+
+    if (total == 0) {
+        printf("Trace is empty\n");
+        return;
+    }
+
+    pc_count_t *entries = malloc(table.len * sizeof(pc_count_t));
+    size_t num = 0;
+    for (size_t i = 0; i < table.cap; ++i)
+        if (table.slots[i].pc)
+            entries[num++] = table.slots[i];
+    free(table.slots);
+
+    for (size_t i = 0; i < num; ++i)
+        symbolize(ctx, &entries[i], header.load_bias);
+
+    printf("%lu instructions, %zu distinct pcs\n", total, num);
+    print_groups(entries, num, total, false);
+    print_groups(entries, num, total, true);
+    free(entries);
+}
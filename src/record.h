@@ -0,0 +1,38 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "debugger.h"
+
+#define RECORD_MAGIC        "SDBGTRC1"
+#define RECORD_DEFAULT_PATH "sonicdbg.trace"
+#define RECORD_BUF_SIZE     (1 << 20)
+#define RECORD_FLAG_REGS    1
+#define RECORD_NUM_REGS     32      // x0-x30 and sp
+#define RECORD_TOP          20
+
+
+// Trace file: a header, then one record per executed instruction.
+// The first pc delta is from zero.
+// A record is the pc delta from the previous record in instructions,
+// zigzag LEB128 encoded. With RECORD_FLAG_REGS it is followed by a
+// LEB128 mask of the registers that changed since the last record and,
+// for each, the zigzag LEB128 delta of its value.
+typedef struct {
+    char magic[8];
+    uint64_t load_bias;
+    uint32_t flags;
+    uint32_t unused;
+} record_header_t;
+
+
+// record [N|until <loc>] [regs]: single step until N instructions ran,
+// the until address is reached or the inferior stops for another reason
+void record_set_path(const char *path);
+bool record_execution(dbg_ctx *ctx, uint64_t max_steps, uint64_t until_addr, bool with_regs);
+void record_dump(dbg_ctx *ctx, uint64_t limit);
+void record_stats(dbg_ctx *ctx);
+
+#endif
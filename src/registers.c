@@ -5,6 +5,7 @@
 #include <linux/elf.h>
 
 #include <stddef.h>
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,47 +29,68 @@ static const char *const aarch64_r_register_names[] =
 };
 
 
-uint64_t get_register_value(const pid_t pid, const enum aarch64_regnum regnum)
-{
+void reg_cache_init(reg_cache_t *cache, const pid_t pid) {
+    cache->pid = pid;
+    cache->valid = false;
+    cache->dirty = false;
+}
+
+static void fetch_registers(reg_cache_t *cache) {
     struct iovec iovec;
-    elf_gregset_t regs;
 
-    iovec.iov_base = &regs;
-    iovec.iov_len = sizeof(regs);
+    iovec.iov_base = &cache->regs;
+    iovec.iov_len = sizeof(cache->regs);
 
-    if (ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iovec) < 0) {
-        perror("Error: ");
-        exit(EXIT_FAILURE);
+    // a thread that vanished reads as zeros until its exit is collected
+    if (ptrace(PTRACE_GETREGSET, cache->pid, NT_PRSTATUS, &iovec) < 0) {
+        printf("Cannot read the registers of LWP %d: %s\n", cache->pid, strerror(errno));
+        memset(cache->regs, 0, sizeof(cache->regs));
     }
 
-    return ((uint64_t *)iovec.iov_base)[regnum];
+    cache->valid = true;
 }
 
-void dump_registers(const pid_t pid) {
-    for (int i = AARCH64_X0_REGNUM; i < AARCH64_V0_REGNUM; ++i) {
-        uint64_t val = get_register_value(pid, i);
-        printf("%s = %lu\n", get_register_name(i), val);
-    }
+// Write back modified registers, must be called before the thread
+// resumes. Fails with errno set, ESRCH if the thread has vanished.
+bool flush_registers(reg_cache_t *cache) {
+    struct iovec iovec;
+
+    if (!cache->dirty)
+        return true;
+
+    iovec.iov_base = &cache->regs;
+    iovec.iov_len = sizeof(cache->regs);
+    cache->dirty = false;
+
+    return ptrace(PTRACE_SETREGSET, cache->pid, NT_PRSTATUS, &iovec) == 0;
 }
 
-void set_register_value(const pid_t pid, const enum aarch64_regnum regnum, const uint64_t val) {
-    struct iovec iovec;
-    elf_gregset_t regs;
+void invalidate_registers(reg_cache_t *cache) {
+    cache->valid = false;
+    cache->dirty = false;
+}
 
-    iovec.iov_base = &regs;
-    iovec.iov_len = sizeof(regs);
+uint64_t get_register_value(reg_cache_t *cache, const enum aarch64_regnum regnum)
+{
+    if (!cache->valid)
+        fetch_registers(cache);
+
+    return cache->regs[regnum];
+}
 
-    if (ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iovec) < 0) {
-        perror("Error: ");
-        exit(EXIT_FAILURE);
+void dump_registers(reg_cache_t *cache) {
+    for (int i = AARCH64_X0_REGNUM; i < AARCH64_V0_REGNUM; ++i) {
+        uint64_t val = get_register_value(cache, i);
+        printf("%s = %lu\n", get_register_name(i), val);
     }
+}
 
-    ((uint64_t *)iovec.iov_base)[regnum] = val;
+void set_register_value(reg_cache_t *cache, const enum aarch64_regnum regnum, const uint64_t val) {
+    if (!cache->valid)
+        fetch_registers(cache);
 
-    if (ptrace(PTRACE_SETREGSET, pid, NT_PRSTATUS, &iovec)) {
-        perror("Error: ");
-        exit(EXIT_FAILURE);
-    }
+    cache->regs[regnum] = val;
+    cache->dirty = true;
 }
 
 const char *get_register_name(const enum aarch64_regnum regnum)
@@ -3,6 +3,7 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #if defined(__aarch64__) || defined(__arm__)
 #include <asm/ptrace.h>
@@ -39,10 +40,23 @@ enum aarch64_regnum
 };
 
 
+// General purpose registers of a stopped thread, fetched with one
+// GETREGSET on first use and written back with one SETREGSET on resume
+typedef struct {
+    pid_t pid;
+    bool valid;
+    bool dirty;
+    elf_gregset_t regs;
+} reg_cache_t;
 
-uint64_t get_register_value(const pid_t pid, const enum aarch64_regnum regnum);
-void set_register_value(const pid_t pid, const enum aarch64_regnum regnum, const uint64_t val);
-void dump_registers(const pid_t pid);
+
+void reg_cache_init(reg_cache_t *cache, const pid_t pid);
+bool flush_registers(reg_cache_t *cache);
+void invalidate_registers(reg_cache_t *cache);
+
+uint64_t get_register_value(reg_cache_t *cache, const enum aarch64_regnum regnum);
+void set_register_value(reg_cache_t *cache, const enum aarch64_regnum regnum, const uint64_t val);
+void dump_registers(reg_cache_t *cache);
 
 const char *get_register_name(const enum aarch64_regnum regnum);
 enum aarch64_regnum get_register_from_name(const char *name);
@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <elf.h>
+
+#include "solib.h"
+#include "memory.h"
+
+#define RT_CONSISTENT   0
+
+
+// glibc's struct r_debug and the start of struct link_map
+typedef struct {
+    int32_t r_version;
+    uint64_t r_map;
+    uint64_t r_brk;
+    int32_t r_state;
+    uint64_t r_ldbase;
+} r_debug_t;
+
+typedef struct {
+    uint64_t l_addr;
+    uint64_t l_name;
+    uint64_t l_ld;
+    uint64_t l_next;
+    uint64_t l_prev;
+} link_map_t;
+
+
+void solib_init(solib_t *so) {
+    memset(so, 0, sizeof(*so));
+}
+
+static void module_free(module_t *mod) {
+    if (mod->elf)
+        elf_end(mod->elf);
+    if (mod->fd >= 0)
+        close(mod->fd);
+    sym_index_free(&mod->syms);
+    unwind_free(&mod->unwinder);
+    free(mod->path);
+    free(mod);
+}
+
+void solib_free(solib_t *so) {
+    for (size_t i = 0; i < so->num_mods; ++i)
+        module_free(so->mods[i]);
+    free(so->mods);
+    solib_init(so);
+}
+
+// The extent of the PT_LOAD segments, from the headers alone
+static bool read_load_range(const char *path, uint64_t *low, uint64_t *high) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    Elf64_Ehdr ehdr;
+    bool ok = pread(fd, &ehdr, sizeof(ehdr), 0) == sizeof(ehdr) &&
+              memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0 &&
+              ehdr.e_ident[EI_CLASS] == ELFCLASS64 &&
+              ehdr.e_phentsize == sizeof(Elf64_Phdr);
+
+    *low = UINT64_MAX;
+    *high = 0;
+    for (int i = 0; ok && i < ehdr.e_phnum; ++i) {
+        Elf64_Phdr phdr;
+        if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) != sizeof(phdr)) {
+            ok = false;
+            break;
+        }
+        if (phdr.p_type != PT_LOAD)
+            continue;
+        if (phdr.p_vaddr < *low)
+            *low = phdr.p_vaddr;
+        if (phdr.p_vaddr + phdr.p_memsz > *high)
+            *high = phdr.p_vaddr + phdr.p_memsz;
+    }
+
+    close(fd);
+    return ok && *low < *high;
+}
+
+// Files that cannot be read (e.g. the vdso) are not tracked
+module_t *solib_add(solib_t *so, const char *path, uint64_t bias) {
+    uint64_t low, high;
+    if (!read_load_range(path, &low, &high))
+        return NULL;
+
+    module_t *mod = calloc(1, sizeof(module_t));
+    mod->path = strdup(path);
+    mod->bias = bias;
+    mod->low = bias + low;
+    mod->high = bias + high;
+    mod->fd = -1;
+    mod->seen = true;
+
+    if (so->num_mods == so->mods_cap) {
+        so->mods_cap = so->mods_cap ? so->mods_cap * 2 : 16;
+        so->mods = realloc(so->mods, so->mods_cap * sizeof(module_t *));
+    }
+
+    size_t pos = so->num_mods;
+    while (pos > 0 && so->mods[pos - 1]->low > mod->low) {
+        so->mods[pos] = so->mods[pos - 1];
+        pos--;
+    }
+    so->mods[pos] = mod;
+    so->num_mods++;
+
+    return mod;
+}
+
+module_t *solib_find(const solib_t *so, uint64_t addr) {
+    size_t lo = 0, hi = so->num_mods;
+
+    // find the last module starting at or below addr
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (so->mods[mid]->low <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0 || addr >= so->mods[lo - 1]->high)
+        return NULL;
+    return so->mods[lo - 1];
+}
+
+static bool read_string(pid_t pid, uint64_t addr, char *buf, size_t size) {
+    for (size_t off = 0; off < size; off += 256) {
+        size_t len = size - off < 256 ? size - off : 256;
+        ssize_t got = read_memory_range(pid, addr + off, buf + off, len);
+        if (got <= 0)
+            return false;
+        if (memchr(buf + off, '\0', got))
+            return true;
+    }
+    buf[size - 1] = '\0';
+    return true;
+}
+
+static module_t *find_loaded(const solib_t *so, const char *path, uint64_t bias) {
+    for (size_t i = 0; i < so->num_mods; ++i)
+        if (so->mods[i]->bias == bias && strcmp(so->mods[i]->path, path) == 0)
+            return so->mods[i];
+    return NULL;
+}
+
+// Bring the module list in line with the dynamic linker's link_map chain.
+// Nothing changes while the linker is in the middle of an update. Returns
+// the number of modules added.
+size_t solib_sync(solib_t *so, pid_t pid, solib_unload_fn_t unloaded, void *arg) {
+    r_debug_t r_debug;
+    size_t added = 0;
+
+    if (so->r_debug == 0 ||
+        read_memory_range(pid, so->r_debug, &r_debug, sizeof(r_debug)) != sizeof(r_debug) ||
+        r_debug.r_state != RT_CONSISTENT)
+        return 0;
+
+    for (size_t i = 0; i < so->num_mods; ++i)
+        so->mods[i]->seen = false;
+
+    char *path = malloc(SOLIB_PATH_MAX);
+    uint64_t addr = r_debug.r_map;
+    for (int n = 0; addr && n < SOLIB_MAX_MODULES; ++n) {
+        link_map_t map;
+        if (read_memory_range(pid, addr, &map, sizeof(map)) != sizeof(map))
+            break;
+        addr = map.l_next;
+
+        // the executable itself has no name
+        if (map.l_name == 0 || !read_string(pid, map.l_name, path, SOLIB_PATH_MAX) || path[0] == '\0')
+            continue;
+
+        module_t *mod = find_loaded(so, path, map.l_addr);
+        if (mod)
+            mod->seen = true;
+        else if (solib_add(so, path, map.l_addr))
+            added++;
+    }
+    free(path);
+
+    // dlclosed
+    size_t kept = 0;
+    for (size_t i = 0; i < so->num_mods; ++i) {
+        if (so->mods[i]->seen) {
+            so->mods[kept++] = so->mods[i];
+            continue;
+        }
+        if (unloaded)
+            unloaded(arg, so->mods[i]);
+        module_free(so->mods[i]);
+    }
+    so->num_mods = kept;
+
+    return added;
+}
+
+bool module_load(module_t *mod) {
+    if (mod->loaded)
+        return mod->elf != NULL;
+    mod->loaded = true;
+
+    if ((mod->fd = open(mod->path, O_RDONLY)) < 0)
+        return false;
+    if ((mod->elf = elf_begin(mod->fd, ELF_C_READ, NULL)) == NULL || elf_kind(mod->elf) != ELF_K_ELF) {
+        if (mod->elf)
+            elf_end(mod->elf);
+        mod->elf = NULL;
+        return false;
+    }
+
+    sym_index_load(&mod->syms, mod->elf);
+    return true;
+}
+
+const char *module_symbol_at(module_t *mod, uint64_t addr) {
+    if (!module_load(mod))
+        return NULL;
+
+    const sym_entry_t *sym = sym_index_lookup_pc(&mod->syms, addr - mod->bias);
+    return sym ? sym_entry_name(&mod->syms, sym) : NULL;
+}
+
+// Runtime address of a function defined in the module, 0 if there is none
+uint64_t module_lookup(module_t *mod, const char *name) {
+    if (!module_load(mod))
+        return 0;
+
+    const sym_entry_t *sym = sym_index_lookup_name(&mod->syms, name);
+    return sym ? mod->bias + sym->addr : 0;
+}
+
+// NULL if the module's ELF file cannot be read
+unwinder_t *module_unwinder(module_t *mod) {
+    if (!module_load(mod))
+        return NULL;
+
+    if (!mod->unwinder.loaded)
+        unwind_load(&mod->unwinder, mod->elf);
+    return &mod->unwinder;
+}
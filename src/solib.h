@@ -0,0 +1,58 @@
+#ifndef SOLIB_H
+#define SOLIB_H
+
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <libelf.h>
+
+#include "sym_index.h"
+#include "unwind.h"
+
+#define SOLIB_MAX_MODULES   4096    // guards the link_map walk against a corrupt chain
+#define SOLIB_PATH_MAX      4096
+
+
+// A shared object mapped into the inferior. Only its program headers are
+// read when it appears; the ELF file and its symbols are opened the first
+// time an address or symbol in it is needed.
+typedef struct {
+    char *path;
+    uint64_t bias;      // l_addr: runtime address minus link time address
+    uint64_t low;       // runtime range of its PT_LOAD segments
+    uint64_t high;
+    bool seen;          // still on the link_map chain at the last sync
+    bool loaded;
+    int fd;
+    Elf *elf;
+    sym_index_t syms;
+    unwinder_t unwinder;    // its CFI, loaded on the first unwind through it
+} module_t;
+
+// mods is sorted by low and the ranges never overlap, so a binary search
+// finds the module containing an address
+typedef struct {
+    module_t **mods;
+    size_t num_mods;
+    size_t mods_cap;
+
+    uint64_t r_debug;   // the dynamic linker's struct r_debug, 0 if unknown
+} solib_t;
+
+// Called for each dlclosed module before it is freed
+typedef void (*solib_unload_fn_t)(void *arg, module_t *mod);
+
+
+void solib_init(solib_t *so);
+void solib_free(solib_t *so);
+
+module_t *solib_add(solib_t *so, const char *path, uint64_t bias);
+module_t *solib_find(const solib_t *so, uint64_t addr);
+size_t solib_sync(solib_t *so, pid_t pid, solib_unload_fn_t unloaded, void *arg);
+
+bool module_load(module_t *mod);
+const char *module_symbol_at(module_t *mod, uint64_t addr);
+uint64_t module_lookup(module_t *mod, const char *name);
+unwinder_t *module_unwinder(module_t *mod);
+
+#endif
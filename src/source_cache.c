@@ -0,0 +1,113 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "source_cache.h"
+#include "func_index.h"
+
+
+void source_cache_init(source_cache_t *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+void source_cache_free(source_cache_t *cache) {
+    for (size_t i = 0; i < SOURCE_CACHE_BUCKETS; ++i) {
+        source_file_t *file = cache->buckets[i];
+        while (file) {
+            source_file_t *next = file->next;
+            if (file->data)
+                munmap((void *)file->data, file->size);
+            free(file->line_offsets);
+            free(file->path);
+            free(file);
+            file = next;
+        }
+    }
+    source_cache_init(cache);
+}
+
+static void index_lines(source_file_t *file) {
+    size_t cap = 1024;
+    file->line_offsets = malloc(cap * sizeof(size_t));
+
+    size_t off = 0;
+    while (off < file->size) {
+        if (file->num_lines == cap) {
+            cap *= 2;
+            file->line_offsets = realloc(file->line_offsets, cap * sizeof(size_t));
+        }
+        file->line_offsets[file->num_lines++] = off;
+
+        const char *nl = memchr(file->data + off, '\n', file->size - off);
+        if (nl == NULL)
+            break;
+        off = nl - file->data + 1;
+    }
+}
+
+static void map_source_file(source_file_t *file) {
+    struct stat st;
+    int fd;
+
+    if ((fd = open(file->path, O_RDONLY)) < 0)
+        return;
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            file->data = data;
+            file->size = st.st_size;
+            index_lines(file);
+        }
+    }
+
+    close(fd);
+}
+
+// Files that fail to open are cached too, so they are not retried on every stop
+source_file_t *source_cache_get(source_cache_t *cache, const char *path) {
+    size_t bucket = hash_string(path) % SOURCE_CACHE_BUCKETS;
+
+    for (source_file_t *file = cache->buckets[bucket]; file; file = file->next) {
+        if (strcmp(file->path, path) == 0)
+            return file;
+    }
+
+    source_file_t *file = calloc(1, sizeof(source_file_t));
+    file->path = strdup(path);
+    map_source_file(file);
+
+    file->next = cache->buckets[bucket];
+    cache->buckets[bucket] = file;
+
+    return file;
+}
+
+// Line numbers start at 1; the returned text excludes the newline
+bool source_file_line(const source_file_t *file, size_t line_no, const char **text, size_t *len) {
+    if (line_no == 0 || line_no > file->num_lines)
+        return false;
+
+    size_t start = file->line_offsets[line_no - 1];
+    size_t end = line_no < file->num_lines ? file->line_offsets[line_no] : file->size;
+    if (end > start && file->data[end - 1] == '\n')
+        end--;
+
+    *text = file->data + start;
+    *len = end - start;
+
+    return true;
+}
+
+void print_source_line(const source_file_t *file, size_t line_no) {
+    const char *text;
+    size_t len;
+
+    if (source_file_line(file, line_no, &text, &len))
+        printf("%zu\t%.*s\n", line_no, (int)len, text);
+}
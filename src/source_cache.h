@@ -0,0 +1,32 @@
+#ifndef SOURCE_CACHE_H
+#define SOURCE_CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SOURCE_CACHE_BUCKETS 128
+
+
+// A source file mapped once, with the offset of every line start
+typedef struct source_file {
+    char *path;
+    const char *data;
+    size_t size;
+    size_t *line_offsets;
+    size_t num_lines;
+    struct source_file *next;
+} source_file_t;
+
+typedef struct {
+    source_file_t *buckets[SOURCE_CACHE_BUCKETS];
+} source_cache_t;
+
+
+void source_cache_init(source_cache_t *cache);
+void source_cache_free(source_cache_t *cache);
+
+source_file_t *source_cache_get(source_cache_t *cache, const char *path);
+bool source_file_line(const source_file_t *file, size_t line_no, const char **text, size_t *len);
+void print_source_line(const source_file_t *file, size_t line_no);
+
+#endif
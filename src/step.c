@@ -0,0 +1,466 @@
+#define _XOPEN_SOURCE 700
+
+#include <sys/ptrace.h>
+
+#include <ctype.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "step.h"
+#include "dbg_dwarf.h"
+#include "utils.h"
+#include "trace.h"
+
+
+typedef enum {
+    STOP_DONE,      // stopped where the stepping command asked to
+    STOP_REPORTED,  // a breakpoint or signal stopped it and was reported
+    STOP_EXITED,
+} step_stop_t;
+
+typedef enum {
+    INSN_OTHER,
+    INSN_BRANCH,    // direct branch, possibly conditional
+    INSN_CALL,      // BL, BLR
+    INSN_JUMP,      // BR, target unknown until it executes
+    INSN_RET,
+} insn_kind_t;
+
+
+static int64_t sign_extend(uint64_t val, int bits) {
+    return (int64_t)(val << (64 - bits)) >> (64 - bits);
+}
+
+static insn_kind_t classify_insn(uint32_t insn, uint64_t pc, uint64_t *target) {
+    if ((insn & 0x7C000000) == 0x14000000) {
+        // B, BL
+        *target = pc + sign_extend(insn & 0x3FFFFFF, 26) * 4;
+        return (insn & 0x80000000) ? INSN_CALL : INSN_BRANCH;
+    }
+    if ((insn & 0xFF000010) == 0x54000000 || (insn & 0x7E000000) == 0x34000000) {
+        // B.cond, CBZ, CBNZ
+        *target = pc + sign_extend(insn >> 5 & 0x7FFFF, 19) * 4;
+        return INSN_BRANCH;
+    }
+    if ((insn & 0x7E000000) == 0x36000000) {
+        // TBZ, TBNZ
+        *target = pc + sign_extend(insn >> 5 & 0x3FFF, 14) * 4;
+        return INSN_BRANCH;
+    }
+    if ((insn & 0xFE000000) == 0xD6000000) {
+        // branch to register, including the pointer authenticating forms
+        switch (insn >> 21 & 0x7) {
+            case 0: return INSN_JUMP;
+            case 1: return INSN_CALL;
+            case 2: return INSN_RET;
+        }
+    }
+    return INSN_OTHER;
+}
+
+// Code as it is without the debugger's traps
+static size_t read_code(dbg_ctx *ctx, uint64_t addr, uint32_t *insns, size_t num) {
+    ssize_t got = read_memory_range(ctx->pid, addr, insns, num * sizeof(uint32_t));
+    if (got <= 0)
+        return 0;
+
+    num = got / sizeof(uint32_t);
+    for (size_t i = 0; i < num; ++i) {
+        bp_site_t *site = bp_site_lookup(&ctx->breakpoints, addr + i * 4);
+        if (site && site->inserted)
+            insns[i] = site->saved_insn;
+    }
+    return num;
+}
+
+static uint64_t get_sp(dbg_ctx *ctx) {
+    return get_register_value(&ctx->thread->regs, AARCH64_SP_REGNUM);
+}
+
+// The caller's pc and sp; false in the outermost frame
+static bool get_caller(dbg_ctx *ctx, unwind_frame_t *caller) {
+    unwind_frame_t frames[2];
+    if (unwind_thread(ctx, frames, 2) < 2)
+        return false;
+    *caller = frames[1];
+    return true;
+}
+
+// Frames are told apart by their CFA, the caller's sp; deeper frames have lower ones
+static uint64_t frame_cfa(dbg_ctx *ctx) {
+    unwind_frame_t caller;
+    return get_caller(ctx, &caller) ? caller.sp : get_sp(ctx);
+}
+
+static bool line_range_at(dbg_ctx *ctx, uint64_t pc, struct line_range *range) {
+    if (!get_line_range(ctx, sub_load_addr(ctx, pc), range))
+        return false;
+    range->low_pc = add_load_addr(ctx, range->low_pc);
+    range->high_pc = add_load_addr(ctx, range->high_pc);
+    return true;
+}
+
+static void add_step_location(dbg_ctx *ctx, breakpoint_t *bp, uint64_t addr) {
+    for (bp_location_t *loc = bp->locs; loc; loc = loc->next_in_bp)
+        if (loc->site->addr == addr)
+            return;
+    bp_add_location(&ctx->breakpoints, bp, addr);
+}
+
+static bool at_step_bp(dbg_ctx *ctx, breakpoint_t *bp) {
+    bp_site_t *site = at_breakpoint(ctx);
+    if (site == NULL)
+        return false;
+    for (bp_location_t *loc = site->locs; loc; loc = loc->next_in_site)
+        if (loc->owner == bp)
+            return true;
+    return false;
+}
+
+// Hits of the stepping breakpoints come back as auto resumed breakpoint
+// stops, anything that stops at the prompt has been reported already.
+// A single step is done by the debugger alone and only a fault stops it.
+static step_stop_t resume_step(dbg_ctx *ctx, bool single) {
+    bp_table_sync(&ctx->breakpoints);
+
+    bp_site_t *site = at_breakpoint(ctx);
+    if (site && site->inserted) {
+        step_over_breakpoint(ctx);
+        if (single)
+            return STOP_DONE;
+    }
+
+    if (single) {
+        switch (step_thread(ctx)) {
+            case THREAD_STEPPED:
+                return STOP_DONE;
+            case THREAD_FAULTED:
+                printf("Got signal: %s\n", strsignal(ctx->thread->pending_sig));
+                return STOP_REPORTED;
+            default:
+                return ctx->exited ? STOP_EXITED : STOP_REPORTED;
+        }
+    }
+
+    // a call stepped over may wait on another thread, so they all run
+    // (all-stop); a stop another thread reports ends the step
+    thread_t *selected = ctx->thread;
+    resume_other_threads(ctx);
+    if (resume_inferior(ctx, PTRACE_CONT) < 0) {
+        drop_vanished_thread(ctx);
+        return ctx->exited ? STOP_EXITED : STOP_REPORTED;
+    }
+    if (!wait_for_selected(ctx))
+        return STOP_EXITED;
+    if (ctx->thread != selected)
+        return STOP_REPORTED;
+
+    // breakpoint hits that chose not to stop, and stores to watched pages
+    // that changed nothing, were dealt with already
+    if (ctx->auto_resume)
+        return STOP_DONE;
+
+    return STOP_REPORTED;
+}
+
+// Continue until one of addrs is hit with sp at or above min_sp
+static step_stop_t run_to(dbg_ctx *ctx, const uint64_t *addrs, size_t num, uint64_t min_sp) {
+    breakpoint_t *bp = bp_create_internal(&ctx->breakpoints, BP_STEP);
+    for (size_t i = 0; i < num; ++i)
+        add_step_location(ctx, bp, addrs[i]);
+
+    step_stop_t stop;
+    do {
+        stop = resume_step(ctx, false);
+    } while (stop == STOP_DONE && (!at_step_bp(ctx, bp) || get_sp(ctx) < min_sp));
+
+    bp_delete(&ctx->breakpoints, bp);
+    return stop;
+}
+
+static step_stop_t step_out(dbg_ctx *ctx) {
+    unwind_frame_t caller;
+    if (!get_caller(ctx, &caller)) {
+        printf("\"finish\" not meaningful in the outermost frame.\n");
+        return STOP_REPORTED;
+    }
+    return run_to(ctx, &caller.pc, 1, caller.sp);
+}
+
+// Successors of the range from pc on: its end, branch targets outside
+// it, the jumps inside it and the return address. Calls only need a
+// breakpoint when stepping into them.
+static breakpoint_t *plan_range(dbg_ctx *ctx, const struct line_range *range, step_mode_t mode, uint64_t pc) {
+    breakpoint_t *bp = bp_create_internal(&ctx->breakpoints, BP_STEP);
+    size_t num = (range->high_pc - pc) / 4;
+    if (num > STEP_MAX_SCAN)
+        num = STEP_MAX_SCAN;
+
+    uint32_t *insns = malloc(num * sizeof(uint32_t));
+    num = read_code(ctx, pc, insns, num);
+    add_step_location(ctx, bp, pc + num * 4);
+
+    unwind_frame_t caller;
+    bool have_caller = get_caller(ctx, &caller);
+    if (have_caller)
+        add_step_location(ctx, bp, caller.pc);
+
+    for (size_t i = 0; i < num; ++i) {
+        uint64_t addr = pc + i * 4, target;
+
+        switch (classify_insn(insns[i], addr, &target)) {
+            case INSN_BRANCH:
+                if (target < range->low_pc || target >= range->high_pc)
+                    add_step_location(ctx, bp, target);
+                break;
+            case INSN_CALL:
+                if (mode == STEP_INTO && i > 0)
+                    add_step_location(ctx, bp, addr);
+                break;
+            case INSN_JUMP:
+                if (i > 0)
+                    add_step_location(ctx, bp, addr);
+                break;
+            case INSN_RET:
+                if (!have_caller && i > 0)
+                    add_step_location(ctx, bp, addr);
+                break;
+            default:
+                break;
+        }
+    }
+
+    free(insns);
+    return bp;
+}
+
+// Run until pc leaves the range in the stepping frame. Hits in deeper
+// frames (recursion) resume with the same breakpoints; the instructions
+// whose successor is unknown are single stepped. entered is set after
+// stepping into a call.
+static step_stop_t step_range(dbg_ctx *ctx, const struct line_range *range, step_mode_t mode,
+                              uint64_t frame, bool *entered) {
+    for (;;) {
+        uint64_t pc = get_pc(ctx), target;
+        uint32_t insn;
+        if (read_code(ctx, pc, &insn, 1) != 1)
+            return STOP_REPORTED;
+
+        insn_kind_t kind = classify_insn(insn, pc, &target);
+        bool single = kind == INSN_JUMP || kind == INSN_RET || (mode == STEP_INTO && kind == INSN_CALL);
+        step_stop_t stop;
+
+        if (single) {
+            stop = resume_step(ctx, true);
+        }
+        else {
+            breakpoint_t *bp = plan_range(ctx, range, mode, pc);
+            do {
+                stop = resume_step(ctx, false);
+            } while (stop == STOP_DONE && (!at_step_bp(ctx, bp) || frame_cfa(ctx) < frame));
+            bp_delete(&ctx->breakpoints, bp);
+        }
+
+        if (stop != STOP_DONE)
+            return stop;
+        if (single && kind == INSN_CALL) {
+            *entered = true;
+            return STOP_DONE;
+        }
+
+        pc = get_pc(ctx);
+        if (pc < range->low_pc || pc >= range->high_pc || frame_cfa(ctx) != frame)
+            return STOP_DONE;
+    }
+}
+
+// At the first instruction of a function: step stops after its prologue
+// if it has line information, otherwise it runs back out to the caller
+static step_stop_t enter_function(dbg_ctx *ctx, step_mode_t mode, bool *stopped) {
+    uint64_t pc = get_pc(ctx);
+    wait_dwarf_index(ctx->bin);
+    const func_entry_t *func = func_index_lookup_pc(&ctx->bin->func_index, sub_load_addr(ctx, pc));
+    struct line_range range;
+
+    if (mode == STEP_INTO && func && line_range_at(ctx, pc, &range)) {
+        *stopped = true;
+        uint64_t body = add_load_addr(ctx, get_func_prologue_end_addr(ctx, func));
+        if (body == pc)
+            return STOP_DONE;
+        return run_to(ctx, &body, 1, 0);
+    }
+
+    uint64_t lr = get_register_value(&ctx->thread->regs, AARCH64_LR_REGNUM) & UNWIND_ADDR_MASK;
+    return run_to(ctx, &lr, 1, get_sp(ctx));
+}
+
+// The other threads ran along with the step and stop with it (all-stop)
+static void end_step(dbg_ctx *ctx, step_stop_t stop) {
+    if (stop != STOP_EXITED && !ctx->non_stop)
+        stop_all_threads(ctx);
+    trace_flush();
+}
+
+static void print_stop(dbg_ctx *ctx) {
+    struct src_info src_info = get_src_info(ctx, sub_load_addr(ctx, get_pc(ctx)));
+    print_source(ctx, &src_info);
+}
+
+// next, step and until: step line ranges until pc reaches the start of a
+// statement, in the starting frame or an outer one
+bool step_source(dbg_ctx *ctx, step_mode_t mode) {
+    uint64_t frame = frame_cfa(ctx);
+    struct line_range range;
+    step_stop_t stop = STOP_DONE;
+
+    if (!line_range_at(ctx, get_pc(ctx), &range)) {
+        const char *func = symbol_at(ctx, get_pc(ctx));
+        printf("Single stepping until exit from function %s,\nwhich has no line number information.\n", func ? func : "??");
+        stop = step_out(ctx);
+    }
+    else {
+        uint64_t start = range.low_pc;
+
+        for (;;) {
+            bool entered = false, stopped = false;
+            stop = step_range(ctx, &range, mode, frame, &entered);
+            if (stop != STOP_DONE)
+                break;
+
+            uint64_t pc = get_pc(ctx);
+            const sym_entry_t *sym = sym_index_lookup_pc(&ctx->bin->sym_index, sub_load_addr(ctx, pc));
+            wait_dwarf_index(ctx->bin);
+            const func_entry_t *func = func_index_lookup_pc(&ctx->bin->func_index, sub_load_addr(ctx, pc));
+            bool at_entry = sym ? sub_load_addr(ctx, pc) == sym->addr : func && sub_load_addr(ctx, pc) == func->low_pc;
+
+            // called, or reached by a tail call
+            if (entered || at_entry) {
+                stop = enter_function(ctx, mode, &stopped);
+                if (stop != STOP_DONE || stopped)
+                    break;
+                pc = get_pc(ctx);
+            }
+
+            uint64_t cfa = frame_cfa(ctx);
+            if (cfa > frame)
+                frame = cfa;
+
+            if (!line_range_at(ctx, pc, &range)) {
+                stop = step_out(ctx);
+                if (stop != STOP_DONE)
+                    break;
+                if (!line_range_at(ctx, get_pc(ctx), &range))
+                    break;
+                continue;
+            }
+
+            // back in the middle of a line, e.g. in the caller after a return
+            if (!range.at_stmt)
+                continue;
+            if (mode == STEP_UNTIL && cfa == frame && pc < start)
+                continue;
+            break;
+        }
+    }
+
+    end_step(ctx, stop);
+    if (stop == STOP_EXITED)
+        return false;
+    if (stop == STOP_DONE)
+        print_stop(ctx);
+    return true;
+}
+
+bool finish_frame(dbg_ctx *ctx) {
+    uint64_t pc = get_pc(ctx);
+    const char *func = symbol_at(ctx, pc);
+
+    printf("Run till exit from " BLU "0x%016lx" RESET " in " YEL "%s ()" RESET "\n", pc, func ? func : "??");
+
+    step_stop_t stop = step_out(ctx);
+    end_step(ctx, stop);
+    if (stop == STOP_EXITED)
+        return false;
+    if (stop == STOP_DONE) {
+        print_stop(ctx);
+        uint64_t x0 = get_register_value(&ctx->thread->regs, AARCH64_X0_REGNUM);
+        printf("Value returned: x0 = 0x%lx (%ld)\n", x0, (int64_t)x0);
+    }
+    return true;
+}
+
+static size_t resolve_location(dbg_ctx *ctx, const char *loc, uint64_t *addrs, size_t max) {
+    if (*loc == '*') {
+        addrs[0] = convert_val_radix(loc + 1);
+        return 1;
+    }
+
+    if (isdigit((unsigned char)*loc)) {
+        size_t num = get_line_addrs(ctx, sub_load_addr(ctx, get_pc(ctx)), strtoul(loc, NULL, 10), addrs, max);
+        for (size_t i = 0; i < num; ++i)
+            addrs[i] = add_load_addr(ctx, addrs[i]);
+        return num;
+    }
+
+    const func_entry_t *funcs[STEP_MAX_LOCS];
+    wait_dwarf_index(ctx->bin);
+    size_t num = func_index_find_all(&ctx->bin->func_index, loc, funcs, max < STEP_MAX_LOCS ? max : STEP_MAX_LOCS);
+    for (size_t i = 0; i < num; ++i)
+        addrs[i] = add_load_addr(ctx, get_func_prologue_end_addr(ctx, funcs[i]));
+
+    const sym_entry_t *sym = sym_index_lookup_name(&ctx->bin->sym_index, loc);
+    if (num == 0 && sym) {
+        addrs[0] = add_load_addr(ctx, sym->addr);
+        num = 1;
+    }
+    return num;
+}
+
+// until <loc> only stops at loc in the current frame or an outer one,
+// advance <loc> anywhere; both stop when the current frame returns
+bool advance_to(dbg_ctx *ctx, const char *loc, bool same_frame) {
+    uint64_t addrs[STEP_MAX_LOCS + 1];
+    size_t num = resolve_location(ctx, loc, addrs, STEP_MAX_LOCS);
+    if (num == 0) {
+        printf("No location %s\n", loc);
+        return true;
+    }
+
+    uint64_t frame = frame_cfa(ctx);
+    unwind_frame_t caller;
+    bool have_caller = get_caller(ctx, &caller);
+    if (have_caller)
+        addrs[num++] = caller.pc;
+
+    breakpoint_t *bp = bp_create_internal(&ctx->breakpoints, BP_STEP);
+    for (size_t i = 0; i < num; ++i)
+        add_step_location(ctx, bp, addrs[i]);
+
+    step_stop_t stop;
+    for (;;) {
+        stop = resume_step(ctx, false);
+        if (stop != STOP_DONE)
+            break;
+        if (!at_step_bp(ctx, bp))
+            continue;
+
+        uint64_t pc = get_pc(ctx);
+        if (have_caller && pc == caller.pc && get_sp(ctx) >= caller.sp)
+            break;
+        bool at_loc = false;
+        for (size_t i = 0; i < num - have_caller; ++i)
+            at_loc |= addrs[i] == pc;
+        if (at_loc && (!same_frame || frame_cfa(ctx) >= frame))
+            break;
+    }
+    bp_delete(&ctx->breakpoints, bp);
+
+    end_step(ctx, stop);
+    if (stop == STOP_EXITED)
+        return false;
+    if (stop == STOP_DONE)
+        print_stop(ctx);
+    return true;
+}
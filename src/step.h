@@ -0,0 +1,24 @@
+#ifndef STEP_H
+#define STEP_H
+
+#include <stdbool.h>
+
+#include "debugger.h"
+
+#define STEP_MAX_SCAN   4096    // instructions of a line range scanned for branches
+#define STEP_MAX_LOCS   64
+
+
+typedef enum {
+    STEP_OVER,      // next
+    STEP_INTO,      // step
+    STEP_UNTIL,     // until without an argument: next, but not back into a loop
+} step_mode_t;
+
+
+// All return false once the inferior has exited
+bool step_source(dbg_ctx *ctx, step_mode_t mode);
+bool finish_frame(dbg_ctx *ctx);
+bool advance_to(dbg_ctx *ctx, const char *loc, bool same_frame);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+
+#include "sym_index.h"
+#include "func_index.h"
+
+
+typedef struct {
+    uint64_t addr;
+    uint64_t size;
+    const char *name;   // in the ELF string table until the index owns a copy
+    uint8_t bind;
+    uint8_t type;
+} raw_sym_t;
+
+
+void sym_index_init(sym_index_t *idx) {
+    memset(idx, 0, sizeof(*idx));
+}
+
+void sym_index_free(sym_index_t *idx) {
+    free(idx->syms);
+    free(idx->buckets);
+    free(idx->strtab);
+    sym_index_init(idx);
+}
+
+static uint32_t add_string(sym_index_t *idx, const char *str) {
+    size_t len = strlen(str) + 1;
+
+    if (idx->strtab_size + len > idx->strtab_cap) {
+        size_t new_cap = idx->strtab_cap ? idx->strtab_cap * 2 : 4096;
+        while (new_cap < idx->strtab_size + len)
+            new_cap *= 2;
+        idx->strtab = realloc(idx->strtab, new_cap);
+        idx->strtab_cap = new_cap;
+    }
+
+    uint32_t off = idx->strtab_size;
+    memcpy(idx->strtab + off, str, len);
+    idx->strtab_size += len;
+
+    return off;
+}
+
+static int bind_rank(uint8_t bind) {
+    switch (bind) {
+        case STB_GLOBAL: return 0;
+        case STB_WEAK: return 1;
+        default: return 2;
+    }
+}
+
+// Aliases are ordered so that printf is reported rather than _IO_printf
+static int cmp_raw_sym(const void *a, const void *b) {
+    const raw_sym_t *sa = a, *sb = b;
+    if (sa->addr != sb->addr)
+        return sa->addr < sb->addr ? -1 : 1;
+    if (bind_rank(sa->bind) != bind_rank(sb->bind))
+        return bind_rank(sa->bind) - bind_rank(sb->bind);
+    size_t ua = strspn(sa->name, "_"), ub = strspn(sb->name, "_");
+    if (ua != ub)
+        return ua < ub ? -1 : 1;
+    return strcmp(sa->name, sb->name);
+}
+
+static size_t collect_syms(Elf *elf, Elf_Scn *scn, Elf64_Shdr *shdr, raw_sym_t **raw, size_t num, size_t *cap) {
+    Elf_Data *data = elf_getdata(scn, NULL);
+    if (data == NULL || shdr->sh_entsize != sizeof(Elf64_Sym))
+        return num;
+
+    const Elf64_Sym *syms = data->d_buf;
+    size_t count = data->d_size / sizeof(Elf64_Sym);
+
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t type = ELF64_ST_TYPE(syms[i].st_info);
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+            syms[i].st_shndx == SHN_UNDEF || syms[i].st_value == 0)
+            continue;
+
+        const char *name = elf_strptr(elf, shdr->sh_link, syms[i].st_name);
+        if (name == NULL || *name == '\0')
+            continue;
+
+        if (num == *cap) {
+            *cap = *cap ? *cap * 2 : 256;
+            *raw = realloc(*raw, *cap * sizeof(raw_sym_t));
+        }
+        (*raw)[num++] = (raw_sym_t) {
+            .addr = syms[i].st_value,
+            .size = syms[i].st_size,
+            .name = name,
+            .bind = ELF64_ST_BIND(syms[i].st_info),
+            .type = type,
+        };
+    }
+    return num;
+}
+
+// .dynsym repeats the exported part of .symtab, the copies are dropped
+void sym_index_load(sym_index_t *idx, Elf *elf) {
+    raw_sym_t *raw = NULL;
+    size_t num = 0, cap = 0;
+
+    for (Elf_Scn *scn = elf_nextscn(elf, NULL); scn; scn = elf_nextscn(elf, scn)) {
+        Elf64_Shdr *shdr = elf64_getshdr(scn);
+        if (shdr && (shdr->sh_type == SHT_SYMTAB || shdr->sh_type == SHT_DYNSYM))
+            num = collect_syms(elf, scn, shdr, &raw, num, &cap);
+    }
+
+    qsort(raw, num, sizeof(raw_sym_t), cmp_raw_sym);
+
+    idx->syms = malloc((num ? num : 1) * sizeof(sym_entry_t));
+    idx->syms_cap = num;
+    for (size_t i = 0; i < num; ++i) {
+        if (i > 0 && raw[i].addr == raw[i - 1].addr && strcmp(raw[i].name, raw[i - 1].name) == 0)
+            continue;
+
+        idx->syms[idx->num_syms++] = (sym_entry_t) {
+            .addr = raw[i].addr,
+            .size = raw[i].size,
+            .name = add_string(idx, raw[i].name),
+            .bind = raw[i].bind,
+            .type = raw[i].type,
+        };
+    }
+    free(raw);
+
+    // keep the load factor at or below 1/2
+    size_t num_buckets = 16;
+    while (num_buckets < idx->num_syms * 2)
+        num_buckets *= 2;
+
+    idx->buckets = calloc(num_buckets, sizeof(uint32_t));
+    idx->num_buckets = num_buckets;
+
+    for (size_t i = 0; i < idx->num_syms; ++i) {
+        size_t slot = hash_string(idx->strtab + idx->syms[i].name) & (num_buckets - 1);
+        while (idx->buckets[slot] != 0)
+            slot = (slot + 1) & (num_buckets - 1);
+        idx->buckets[slot] = i + 1;
+    }
+}
+
+// Global definitions are preferred over weak and local ones of the same name
+const sym_entry_t *sym_index_lookup_name(const sym_index_t *idx, const char *name) {
+    const sym_entry_t *best = NULL;
+
+    if (idx->num_buckets == 0)
+        return NULL;
+
+    size_t slot = hash_string(name) & (idx->num_buckets - 1);
+    while (idx->buckets[slot] != 0) {
+        const sym_entry_t *sym = &idx->syms[idx->buckets[slot] - 1];
+        if (strcmp(idx->strtab + sym->name, name) == 0 &&
+            (best == NULL || bind_rank(sym->bind) < bind_rank(best->bind)))
+            best = sym;
+        slot = (slot + 1) & (idx->num_buckets - 1);
+    }
+
+    return best;
+}
+
+const sym_entry_t *sym_index_lookup_pc(const sym_index_t *idx, uint64_t pc) {
+    size_t lo = 0, hi = idx->num_syms;
+
+    // find the last symbol starting at or below pc
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->syms[mid].addr <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    size_t next = lo;
+    const sym_entry_t *sym = &idx->syms[lo - 1];
+    while (sym > idx->syms && sym[-1].addr == sym->addr)
+        sym--;
+
+    if (sym->size)
+        return pc < sym->addr + sym->size ? sym : NULL;
+    return next < idx->num_syms ? sym : NULL;
+}
+
+const char *sym_entry_name(const sym_index_t *idx, const sym_entry_t *sym) {
+    return idx->strtab + sym->name;
+}
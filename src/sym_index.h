@@ -0,0 +1,43 @@
+#ifndef SYM_INDEX_H
+#define SYM_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libelf.h>
+
+
+typedef struct {
+    uint64_t addr;
+    uint64_t size;      // 0 if unknown, the symbol then runs up to the next one
+    uint32_t name;      // offset into the index string table
+    uint8_t bind;       // STB_*
+    uint8_t type;       // STT_*
+} sym_entry_t;
+
+// Function symbols of .symtab and .dynsym, built once from the ELF file.
+// syms is sorted by address with duplicates removed; of several names for
+// one address the strongest binding comes first. buckets is an open
+// addressing hash table (sym index + 1, 0 = empty) for name lookups.
+typedef struct {
+    sym_entry_t *syms;
+    size_t num_syms;
+    size_t syms_cap;
+
+    uint32_t *buckets;
+    size_t num_buckets;
+
+    char *strtab;
+    size_t strtab_size;
+    size_t strtab_cap;
+} sym_index_t;
+
+
+void sym_index_init(sym_index_t *idx);
+void sym_index_free(sym_index_t *idx);
+void sym_index_load(sym_index_t *idx, Elf *elf);
+
+const sym_entry_t *sym_index_lookup_name(const sym_index_t *idx, const char *name);
+const sym_entry_t *sym_index_lookup_pc(const sym_index_t *idx, uint64_t pc);
+const char *sym_entry_name(const sym_index_t *idx, const sym_entry_t *sym);
+
+#endif
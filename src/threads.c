@@ -0,0 +1,63 @@
+#include <sys/ptrace.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "threads.h"
+
+
+void thread_table_init(thread_table_t *table) {
+    memset(table, 0, sizeof(*table));
+    table->next_num = 1;
+}
+
+void thread_table_free(thread_table_t *table) {
+    for (size_t i = 0; i < table->num_threads; ++i)
+        free(table->threads[i]);
+    free(table->threads);
+    thread_table_init(table);
+}
+
+// New threads start out stopped, as they are when the kernel reports them
+thread_t *thread_add(thread_table_t *table, pid_t tid) {
+    thread_t *thread = calloc(1, sizeof(thread_t));
+    thread->tid = tid;
+    thread->num = table->next_num++;
+    thread->state = THREAD_STOPPED;
+    thread->last_request = PTRACE_CONT;
+    reg_cache_init(&thread->regs, tid);
+
+    if (table->num_threads == table->threads_cap) {
+        table->threads_cap = table->threads_cap ? table->threads_cap * 2 : 16;
+        table->threads = realloc(table->threads, table->threads_cap * sizeof(thread_t *));
+    }
+    table->threads[table->num_threads++] = thread;
+
+    return thread;
+}
+
+thread_t *thread_find(const thread_table_t *table, pid_t tid) {
+    for (size_t i = 0; i < table->num_threads; ++i)
+        if (table->threads[i]->tid == tid)
+            return table->threads[i];
+    return NULL;
+}
+
+thread_t *thread_find_num(const thread_table_t *table, int num) {
+    for (size_t i = 0; i < table->num_threads; ++i)
+        if (table->threads[i]->num == num)
+            return table->threads[i];
+    return NULL;
+}
+
+void thread_remove(thread_table_t *table, thread_t *thread) {
+    for (size_t i = 0; i < table->num_threads; ++i) {
+        if (table->threads[i] != thread)
+            continue;
+        memmove(&table->threads[i], &table->threads[i + 1], (table->num_threads - i - 1) * sizeof(thread_t *));
+        table->num_threads--;
+        free(thread);
+        return;
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "registers.h"
+
+
+typedef enum {
+    THREAD_RUNNING,
+    THREAD_STOPPED,
+} thread_state_t;
+
+// One traced thread of the inferior. Threads are numbered from 1 in the
+// order they appear; the number of a thread never changes.
+typedef struct {
+    pid_t tid;
+    int num;
+    thread_state_t state;
+    reg_cache_t regs;
+    int pending_sig;            // delivered when the thread is next resumed
+    bool stop_expected;         // a stop is due that nobody asked to see
+    bool reported;              // its last stop was shown at the prompt
+    enum __ptrace_request last_request;
+} thread_t;
+
+// Kept in creation order, so the main thread is always first
+typedef struct {
+    thread_t **threads;
+    size_t num_threads;
+    size_t threads_cap;
+    int next_num;
+} thread_table_t;
+
+
+void thread_table_init(thread_table_t *table);
+void thread_table_free(thread_table_t *table);
+
+thread_t *thread_add(thread_table_t *table, pid_t tid);
+thread_t *thread_find(const thread_table_t *table, pid_t tid);
+thread_t *thread_find_num(const thread_table_t *table, int num);
+void thread_remove(thread_table_t *table, thread_t *thread);
+
+#endif
@@ -0,0 +1,529 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "trace.h"
+#include "memory.h"
+
+#define ARG_ERROR   UINT32_MAX
+#define ALIGN8(n)   (((n) + 7) & ~(size_t)7)
+
+
+// Every record is a header followed by one slot per argument. A slot is
+// an 8 byte length (ARG_ERROR if the value could not be read) followed by
+// the data rounded up to 8 bytes. A record with bp_num 0 pads to the end
+// of the ring.
+typedef struct {
+    uint32_t size;
+    int32_t bp_num;
+    uint64_t pc;
+    const bp_action_t *action;
+} trace_record_t;
+
+typedef struct {
+    uint32_t len;
+    uint32_t unused;
+} trace_slot_t;
+
+// Single producer (the debugger loop) and single consumer (the writer
+// thread). head and tail only ever grow; each side publishes its index
+// with a release store after it is done with the bytes.
+static unsigned char *ring;
+static uint64_t head;
+static uint64_t tail;
+static bool writer_started;
+static bool writer_stopping;
+static pthread_t writer;
+
+static FILE *trace_out;
+static bool trace_binary;
+
+
+static void pause_briefly(void) {
+    struct timespec ts = { 0, 100 * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static void print_value_spec(FILE *out, const char *spec, size_t spec_len, char conv, const trace_slot_t *slot) {
+    char fmt[32];
+    const void *data = slot + 1;
+    uint64_t val;
+
+    if (slot->len == ARG_ERROR) {
+        fputs("<unavailable>", out);
+        return;
+    }
+
+    if (spec_len > sizeof(fmt) - 4)
+        spec_len = sizeof(fmt) - 4;
+    memcpy(fmt, spec, spec_len);
+
+    switch (conv) {
+        case 's':
+            snprintf(fmt + spec_len, sizeof(fmt) - spec_len, "s");
+            fprintf(out, fmt, (const char *)data);
+            return;
+        case 'p':
+            snprintf(fmt + spec_len, sizeof(fmt) - spec_len, "p");
+            memcpy(&val, data, sizeof(val));
+            fprintf(out, fmt, (void *)val);
+            return;
+        case 'c':
+            snprintf(fmt + spec_len, sizeof(fmt) - spec_len, "c");
+            memcpy(&val, data, sizeof(val));
+            fprintf(out, fmt, (int)val);
+            return;
+        default:
+            snprintf(fmt + spec_len, sizeof(fmt) - spec_len, "ll%c", conv);
+            memcpy(&val, data, sizeof(val));
+            fprintf(out, fmt, (long long)val);
+            return;
+    }
+}
+
+static const trace_slot_t *next_slot(const trace_slot_t *slot) {
+    size_t len = slot->len == ARG_ERROR ? 0 : slot->len;
+    return (const trace_slot_t *)((const unsigned char *)(slot + 1) + ALIGN8(len));
+}
+
+// Conversions were checked against the arguments when the dprintf was set
+static void print_dprintf(FILE *out, const trace_record_t *rec) {
+    const char *fmt = rec->action->format;
+    const trace_slot_t *slot = (const trace_slot_t *)(rec + 1);
+
+    while (*fmt) {
+        if (*fmt != '%') {
+            fputc(*fmt++, out);
+            continue;
+        }
+        if (fmt[1] == '%') {
+            fputc('%', out);
+            fmt += 2;
+            continue;
+        }
+
+        // keep flags, width and precision, length modifiers are implied
+        const char *spec = fmt++;
+        while (*fmt && strchr("-+ #0123456789.", *fmt))
+            fmt++;
+        size_t spec_len = fmt - spec;
+        while (*fmt && strchr("hlzjt", *fmt))
+            fmt++;
+
+        print_value_spec(out, spec, spec_len, *fmt++, slot);
+        slot = next_slot(slot);
+    }
+}
+
+static void print_collect(FILE *out, const trace_record_t *rec) {
+    const trace_slot_t *slot = (const trace_slot_t *)(rec + 1);
+
+    fprintf(out, "Tracepoint %d, 0x%lx:", rec->bp_num, rec->pc);
+    for (size_t i = 0; i < rec->action->num_args; ++i) {
+        const trace_arg_t *arg = &rec->action->args[i];
+        fprintf(out, " %s=", arg->text);
+
+        if (slot->len == ARG_ERROR) {
+            fputs("<unavailable>", out);
+        }
+        else if (arg->kind == TRACE_ARG_VALUE) {
+            uint64_t val;
+            memcpy(&val, slot + 1, sizeof(val));
+            fprintf(out, "0x%lx", val);
+        }
+        else {
+            const unsigned char *bytes = (const unsigned char *)(slot + 1);
+            for (uint32_t j = 0; j < slot->len; ++j)
+                fprintf(out, "%02x", bytes[j]);
+        }
+
+        slot = next_slot(slot);
+    }
+    fputc('\n', out);
+}
+
+static void write_record(const trace_record_t *rec) {
+    if (trace_binary) {
+        // the action pointer means nothing outside this process
+        trace_record_t hdr = *rec;
+        hdr.action = NULL;
+        fwrite(&hdr, sizeof(hdr), 1, trace_out);
+        fwrite(rec + 1, rec->size - sizeof(hdr), 1, trace_out);
+    }
+    else if (rec->action->format) {
+        print_dprintf(trace_out, rec);
+    }
+    else {
+        print_collect(trace_out, rec);
+    }
+}
+
+// Drain everything published so far in one batch, then hand the space
+// back. Output is flushed before tail catches up with head so
+// trace_flush also means the output has been written.
+static void *writer_main(void *arg) {
+    (void)arg;
+
+    while (1) {
+        uint64_t t = tail;
+        uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+        if (t == h) {
+            if (__atomic_load_n(&writer_stopping, __ATOMIC_ACQUIRE))
+                break;
+            pause_briefly();
+            continue;
+        }
+
+        while (t != h) {
+            const trace_record_t *rec = (const trace_record_t *)(ring + (t & (TRACE_RING_SIZE - 1)));
+            if (rec->bp_num != 0)
+                write_record(rec);
+            t += rec->size;
+        }
+
+        if (t == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+            fflush(trace_out);
+        __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void start_writer(void) {
+    ring = malloc(TRACE_RING_SIZE);
+    if (trace_out == NULL)
+        trace_out = stdout;
+
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        perror("Error: ");
+        exit(EXIT_FAILURE);
+    }
+    writer_started = true;
+}
+
+// Contiguous space for len bytes, waiting for the writer if the ring is
+// full. A record never wraps, the rest of the ring is padded instead.
+static trace_record_t *ring_reserve(size_t len) {
+    if (!writer_started)
+        start_writer();
+
+    while (1) {
+        uint64_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        size_t off = head & (TRACE_RING_SIZE - 1);
+        size_t contig = TRACE_RING_SIZE - off;
+        size_t need = len <= contig ? len : contig + len;
+
+        if (head + need - t <= TRACE_RING_SIZE) {
+            if (len > contig) {
+                trace_record_t *pad = (trace_record_t *)(ring + off);
+                pad->size = contig;
+                pad->bp_num = 0;
+                __atomic_store_n(&head, head + contig, __ATOMIC_RELEASE);
+                off = 0;
+            }
+            return (trace_record_t *)(ring + off);
+        }
+
+        sched_yield();
+    }
+}
+
+void run_bp_action(const bp_action_t *action, reg_cache_t *regs, pid_t pid, int bp_num, uint64_t pc) {
+    trace_record_t *rec = ring_reserve(action->max_record);
+    trace_slot_t *slot = (trace_slot_t *)(rec + 1);
+
+    rec->bp_num = bp_num;
+    rec->pc = pc;
+    rec->action = action;
+
+    for (size_t i = 0; i < action->num_args; ++i) {
+        const trace_arg_t *arg = &action->args[i];
+        unsigned char *data = (unsigned char *)(slot + 1);
+        uint64_t val;
+        ssize_t got;
+
+        slot->len = ARG_ERROR;
+        if (!expr_eval(arg->expr, regs, pid, &val)) {
+            slot = (trace_slot_t *)data;
+            continue;
+        }
+
+        switch (arg->kind) {
+            case TRACE_ARG_VALUE:
+                memcpy(data, &val, sizeof(val));
+                slot->len = sizeof(val);
+                break;
+            case TRACE_ARG_STRING:
+                got = read_memory_range(pid, val, data, TRACE_STR_MAX - 1);
+                if (got > 0) {
+                    data[got] = '\0';
+                    slot->len = strlen((char *)data) + 1;
+                }
+                break;
+            case TRACE_ARG_MEMORY:
+                got = read_memory_range(pid, val, data, arg->len);
+                if (got > 0)
+                    slot->len = got;
+                break;
+        }
+
+        slot = (trace_slot_t *)(data + ALIGN8(slot->len == ARG_ERROR ? 0 : slot->len));
+    }
+
+    rec->size = (unsigned char *)slot - (unsigned char *)rec;
+    __atomic_store_n(&head, head + rec->size, __ATOMIC_RELEASE);
+}
+
+// Wait for the writer to catch up, e.g. before returning to the prompt
+void trace_flush(void) {
+    if (!writer_started)
+        return;
+
+    while (__atomic_load_n(&tail, __ATOMIC_ACQUIRE) != head)
+        pause_briefly();
+}
+
+void trace_stop(void) {
+    if (writer_started) {
+        __atomic_store_n(&writer_stopping, true, __ATOMIC_RELEASE);
+        pthread_join(writer, NULL);
+        free(ring);
+        writer_started = false;
+        writer_stopping = false;
+        ring = NULL;
+        head = tail = 0;
+    }
+
+    if (trace_out && trace_out != stdout)
+        fclose(trace_out);
+    trace_out = NULL;
+    trace_binary = false;
+}
+
+// NULL writes text to stdout, a path writes raw records to that file
+bool trace_set_output(const char *path) {
+    FILE *out = stdout;
+
+    if (path && (out = fopen(path, "wb")) == NULL) {
+        printf("Error opening %s\n", path);
+        return false;
+    }
+
+    // the writer is idle once the ring is drained
+    trace_flush();
+    if (trace_out && trace_out != stdout)
+        fclose(trace_out);
+
+    trace_out = out;
+    trace_binary = path != NULL;
+    return true;
+}
+
+
+static char *next_item(const char **text) {
+    const char *p = *text;
+    while (isspace(*p))
+        p++;
+
+    const char *end = strchr(p, ',');
+    if (end == NULL)
+        end = p + strlen(p);
+    *text = *end ? end + 1 : end;
+
+    while (end > p && isspace(end[-1]))
+        end--;
+    return strndup(p, end - p);
+}
+
+static bp_action_t *new_action(const char *text) {
+    bp_action_t *action = calloc(1, sizeof(bp_action_t));
+    action->text = strdup(text);
+    action->max_record = sizeof(trace_record_t);
+    return action;
+}
+
+static bool add_arg(bp_action_t *action, trace_arg_kind_t kind, char *text, const char *expr_text, size_t len, const char **error) {
+    expr_t *expr = expr_compile(expr_text, error);
+    if (expr == NULL) {
+        free(text);
+        return false;
+    }
+
+    action->args = realloc(action->args, (action->num_args + 1) * sizeof(trace_arg_t));
+    trace_arg_t *arg = &action->args[action->num_args++];
+    arg->kind = kind;
+    arg->expr = expr;
+    arg->len = len;
+    arg->text = text;
+
+    action->max_record += sizeof(trace_slot_t) + ALIGN8(len);
+    return true;
+}
+
+static char *parse_format_string(const char **text, const char **error) {
+    const char *p = *text;
+    while (isspace(*p))
+        p++;
+
+    if (*p++ != '"') {
+        *error = "format string expected";
+        return NULL;
+    }
+
+    char *format = malloc(strlen(p) + 1);
+    char *out = format;
+    while (*p && *p != '"') {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        switch (*++p) {
+            case 'n': *out++ = '\n'; break;
+            case 't': *out++ = '\t'; break;
+            case '\0': continue;
+            default: *out++ = *p; break;
+        }
+        p++;
+    }
+
+    if (*p != '"') {
+        *error = "unterminated format string";
+        free(format);
+        return NULL;
+    }
+
+    *out = '\0';
+    *text = p + 1;
+    return format;
+}
+
+// "fmt", arg, ... with one argument per conversion
+bp_action_t *parse_dprintf_action(const char *text, const char **error) {
+    const char *p = text;
+    char *format = parse_format_string(&p, error);
+    if (format == NULL)
+        return NULL;
+
+    bp_action_t *action = new_action(text);
+    action->format = format;
+
+    while (isspace(*p))
+        p++;
+    if (*p != '\0' && *p++ != ',') {
+        *error = "expected ',' after format string";
+        goto fail;
+    }
+
+    for (const char *f = format; *f; ++f) {
+        if (*f != '%')
+            continue;
+        if (f[1] == '%') {
+            f++;
+            continue;
+        }
+
+        f++;
+        while (*f && strchr("-+ #0123456789.hlzjt", *f))
+            f++;
+        if (*f == '\0' || !strchr("diouxXcsp", *f)) {
+            *error = "unsupported format conversion";
+            goto fail;
+        }
+
+        char *item = next_item(&p);
+        if (*item == '\0') {
+            free(item);
+            *error = "missing argument for format";
+            goto fail;
+        }
+        if (*f == 's') {
+            if (!add_arg(action, TRACE_ARG_STRING, item, item, TRACE_STR_MAX, error))
+                goto fail;
+        }
+        else if (!add_arg(action, TRACE_ARG_VALUE, item, item, sizeof(uint64_t), error)) {
+            goto fail;
+        }
+    }
+
+    while (isspace(*p))
+        p++;
+    if (*p != '\0') {
+        *error = "too many arguments for format";
+        goto fail;
+    }
+
+    return action;
+
+fail:
+    bp_action_free(action);
+    return NULL;
+}
+
+// Comma separated registers, expressions and *addr@len memory ranges
+bp_action_t *parse_collect_action(const char *text, const char **error) {
+    bp_action_t *action = new_action(text);
+    const char *p = text;
+
+    while (*p) {
+        char *item = next_item(&p);
+        char *at = strchr(item, '@');
+
+        if (*item == '\0') {
+            free(item);
+            *error = "empty collect item";
+            goto fail;
+        }
+
+        if (at == NULL) {
+            if (!add_arg(action, TRACE_ARG_VALUE, item, item, sizeof(uint64_t), error))
+                goto fail;
+            continue;
+        }
+
+        size_t len = strtoul(at + 1, NULL, 0);
+        if (item[0] != '*' || len == 0 || len > TRACE_MEM_MAX) {
+            free(item);
+            *error = "memory ranges are written *addr@len";
+            goto fail;
+        }
+
+        char *addr = strndup(item + 1, at - item - 1);
+        bool ok = add_arg(action, TRACE_ARG_MEMORY, item, addr, len, error);
+        free(addr);
+        if (!ok)
+            goto fail;
+    }
+
+    if (action->num_args == 0) {
+        *error = "nothing to collect";
+        goto fail;
+    }
+
+    return action;
+
+fail:
+    bp_action_free(action);
+    return NULL;
+}
+
+// Records still in the ring point at the action, so drain it first
+void bp_action_free(bp_action_t *action) {
+    if (action == NULL)
+        return;
+
+    trace_flush();
+
+    for (size_t i = 0; i < action->num_args; ++i) {
+        expr_free(action->args[i].expr);
+        free(action->args[i].text);
+    }
+    free(action->args);
+    free(action->format);
+    free(action->text);
+    free(action);
+}
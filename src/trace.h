@@ -0,0 +1,49 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "expr.h"
+#include "registers.h"
+
+#define TRACE_RING_SIZE     (4 << 20)
+#define TRACE_STR_MAX       256
+#define TRACE_MEM_MAX       4096
+
+
+typedef enum {
+    TRACE_ARG_VALUE,
+    TRACE_ARG_STRING,   // NUL terminated string at the value, for %s
+    TRACE_ARG_MEMORY,   // len bytes at the value, for *addr@len
+} trace_arg_kind_t;
+
+typedef struct {
+    trace_arg_kind_t kind;
+    expr_t *expr;
+    size_t len;
+    char *text;
+} trace_arg_t;
+
+// What a dprintf or tracepoint captures on every hit. Hits only copy
+// raw values into the ring, the writer thread does all formatting.
+typedef struct bp_action {
+    char *format;       // NULL for a tracepoint
+    char *text;         // as typed, for listing
+    size_t num_args;
+    trace_arg_t *args;
+    size_t max_record;
+} bp_action_t;
+
+
+bp_action_t *parse_dprintf_action(const char *text, const char **error);
+bp_action_t *parse_collect_action(const char *text, const char **error);
+void bp_action_free(bp_action_t *action);
+void run_bp_action(const bp_action_t *action, reg_cache_t *regs, pid_t pid, int bp_num, uint64_t pc);
+
+bool trace_set_output(const char *path);
+void trace_flush(void);
+void trace_stop(void);
+
+#endif
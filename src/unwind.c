@@ -0,0 +1,669 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "unwind.h"
+#include "memory.h"
+
+#define AARCH64_DWARF_FP    29
+#define AARCH64_DWARF_LR    30
+#define AARCH64_DWARF_SP    31
+
+#define DW_EH_PE_omit       0xff
+#define DW_EH_PE_absptr     0x00
+#define DW_EH_PE_uleb128    0x01
+#define DW_EH_PE_udata2     0x02
+#define DW_EH_PE_udata4     0x03
+#define DW_EH_PE_udata8     0x04
+#define DW_EH_PE_sleb128    0x09
+#define DW_EH_PE_sdata2     0x0a
+#define DW_EH_PE_sdata4     0x0b
+#define DW_EH_PE_sdata8     0x0c
+#define DW_EH_PE_pcrel      0x10
+
+
+// Bounds checked reader over a section
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t base_addr;     // address of the section start, for pc relative pointers
+    const unsigned char *start;
+    bool error;
+} reader_t;
+
+static uint64_t read_bytes(reader_t *r, size_t n) {
+    uint64_t val = 0;
+
+    if ((size_t)(r->end - r->p) < n) {
+        r->error = true;
+        r->p = r->end;
+        return 0;
+    }
+
+    memcpy(&val, r->p, n);
+    r->p += n;
+    return val;
+}
+
+static uint64_t read_uleb(reader_t *r) {
+    uint64_t val = 0;
+    int shift = 0;
+
+    while (r->p < r->end) {
+        unsigned char byte = *r->p++;
+        if (shift < 64)
+            val |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0)
+            return val;
+    }
+
+    r->error = true;
+    return val;
+}
+
+static int64_t read_sleb(reader_t *r) {
+    int64_t val = 0;
+    int shift = 0;
+
+    while (r->p < r->end) {
+        unsigned char byte = *r->p++;
+        if (shift < 64)
+            val |= (int64_t)(byte & 0x7f) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            if (shift < 64 && (byte & 0x40))
+                val |= -((int64_t)1 << shift);
+            return val;
+        }
+    }
+
+    r->error = true;
+    return val;
+}
+
+static uint64_t read_encoded(reader_t *r, uint8_t enc) {
+    uint64_t field_addr = r->base_addr + (r->p - r->start);
+    uint64_t val;
+
+    if (enc == DW_EH_PE_omit)
+        return 0;
+
+    switch (enc & 0x0f) {
+        case DW_EH_PE_absptr:  val = read_bytes(r, 8); break;
+        case DW_EH_PE_uleb128: val = read_uleb(r); break;
+        case DW_EH_PE_udata2:  val = read_bytes(r, 2); break;
+        case DW_EH_PE_udata4:  val = read_bytes(r, 4); break;
+        case DW_EH_PE_udata8:  val = read_bytes(r, 8); break;
+        case DW_EH_PE_sleb128: val = read_sleb(r); break;
+        case DW_EH_PE_sdata2:  val = (int16_t)read_bytes(r, 2); break;
+        case DW_EH_PE_sdata4:  val = (int32_t)read_bytes(r, 4); break;
+        case DW_EH_PE_sdata8:  val = read_bytes(r, 8); break;
+        default:
+            r->error = true;
+            return 0;
+    }
+
+    if ((enc & 0x70) == DW_EH_PE_pcrel)
+        val += field_addr;
+
+    return val;
+}
+
+void unwind_init(unwinder_t *uw) {
+    memset(uw, 0, sizeof(*uw));
+}
+
+void unwind_free(unwinder_t *uw) {
+    for (size_t i = 0; i < uw->num_fdes; ++i)
+        free(uw->fdes[i].rows);
+    free(uw->fdes);
+    free(uw->cies);
+    free(uw->window);
+    unwind_init(uw);
+}
+
+static bool parse_cie(unwinder_t *uw, reader_t *r, bool is_eh) {
+    cfi_cie_t cie = {};
+    const char *aug;
+    uint8_t version = read_bytes(r, 1);
+
+    aug = (const char *)r->p;
+    while (r->p < r->end && *r->p)
+        r->p++;
+    read_bytes(r, 1);
+
+    // DWARF 4 .debug_frame adds address and segment selector sizes
+    if (!is_eh && version >= 4)
+        read_bytes(r, 2);
+
+    cie.code_align = read_uleb(r);
+    cie.data_align = read_sleb(r);
+    cie.ra_reg = version == 1 ? read_bytes(r, 1) : read_uleb(r);
+    cie.fde_enc = is_eh ? DW_EH_PE_absptr : DW_EH_PE_udata8;
+
+    if (aug[0] == 'z') {
+        cie.augmented = true;
+        uint64_t aug_len = read_uleb(r);
+        const unsigned char *aug_end = r->p + aug_len;
+
+        for (const char *a = aug + 1; *a && !r->error; ++a) {
+            switch (*a) {
+                case 'R': cie.fde_enc = read_bytes(r, 1); break;
+                case 'L': read_bytes(r, 1); break;
+                case 'P': read_encoded(r, read_bytes(r, 1)); break;
+                default: break;
+            }
+        }
+
+        if (aug_end > r->end)
+            return false;
+        r->p = aug_end;
+    }
+    else if (aug[0] != '\0') {
+        // unknown augmentation, the rest of the CIE cannot be parsed
+        return false;
+    }
+
+    cie.insns = r->p;
+    cie.insns_len = r->end - r->p;
+
+    if (r->error)
+        return false;
+
+    if (uw->num_cies == uw->cies_cap) {
+        uw->cies_cap = uw->cies_cap ? uw->cies_cap * 2 : 16;
+        uw->cies = realloc(uw->cies, uw->cies_cap * sizeof(cfi_cie_t));
+    }
+    uw->cies[uw->num_cies++] = cie;
+
+    return true;
+}
+
+static void parse_fde(unwinder_t *uw, reader_t *r, uint32_t cie_idx) {
+    const cfi_cie_t *cie = &uw->cies[cie_idx];
+    cfi_fde_t fde = {};
+
+    fde.cie = cie_idx;
+    fde.pc_begin = read_encoded(r, cie->fde_enc);
+    // the range is never pc relative
+    fde.pc_end = fde.pc_begin + read_encoded(r, cie->fde_enc & 0x0f);
+
+    if (cie->augmented) {
+        uint64_t aug_len = read_uleb(r);
+        if (aug_len > (uint64_t)(r->end - r->p))
+            return;
+        r->p += aug_len;
+    }
+
+    fde.insns = r->p;
+    fde.insns_len = r->end - r->p;
+
+    if (r->error || fde.pc_begin == 0 || fde.pc_end <= fde.pc_begin)
+        return;
+
+    if (uw->num_fdes == uw->fdes_cap) {
+        uw->fdes_cap = uw->fdes_cap ? uw->fdes_cap * 2 : 256;
+        uw->fdes = realloc(uw->fdes, uw->fdes_cap * sizeof(cfi_fde_t));
+    }
+    uw->fdes[uw->num_fdes++] = fde;
+}
+
+// CIEs are found by their offset in the section, there are only a few
+typedef struct {
+    uint64_t offset;
+    uint32_t idx;
+} cie_ref_t;
+
+static void parse_frame_section(unwinder_t *uw, Elf_Data *data, uint64_t sh_addr, bool is_eh) {
+    const unsigned char *start = data->d_buf;
+    const unsigned char *end = start + data->d_size;
+    const unsigned char *p = start;
+    cie_ref_t *refs = NULL;
+    size_t num_refs = 0;
+
+    while (p + 4 <= end) {
+        reader_t r = { p, end, sh_addr, start, false };
+        uint64_t len = read_bytes(&r, 4);
+        bool is64 = false;
+
+        if (len == 0) {
+            // .eh_frame terminator
+            if (is_eh)
+                break;
+            p = r.p;
+            continue;
+        }
+        if (len == 0xffffffff) {
+            len = read_bytes(&r, 8);
+            is64 = true;
+        }
+        if (r.error || len > (uint64_t)(end - r.p))
+            break;
+
+        const unsigned char *entry_end = r.p + len;
+        const unsigned char *id_pos = r.p;
+        uint64_t id = read_bytes(&r, is64 ? 8 : 4);
+        r.end = entry_end;
+
+        bool is_cie = is_eh ? id == 0 : id == (is64 ? 0xffffffffffffffffULL : 0xffffffff);
+        uint64_t offset = p - start;
+
+        if (is_cie) {
+            if (parse_cie(uw, &r, is_eh)) {
+                refs = realloc(refs, (num_refs + 1) * sizeof(cie_ref_t));
+                refs[num_refs++] = (cie_ref_t){ offset, uw->num_cies - 1 };
+            }
+        }
+        else {
+            // .eh_frame points back from the id field, .debug_frame gives an offset
+            uint64_t cie_offset = is_eh ? (uint64_t)(id_pos - start) - id : id;
+            for (size_t i = num_refs; i-- > 0;) {
+                if (refs[i].offset == cie_offset) {
+                    parse_fde(uw, &r, refs[i].idx);
+                    break;
+                }
+            }
+        }
+
+        p = entry_end;
+    }
+
+    free(refs);
+}
+
+static int cmp_fde(const void *a, const void *b) {
+    const cfi_fde_t *fa = a, *fb = b;
+    if (fa->pc_begin < fb->pc_begin) return -1;
+    if (fa->pc_begin > fb->pc_begin) return 1;
+    return 0;
+}
+
+// Collect the FDEs of .eh_frame and .debug_frame into one table sorted
+// by address. Where both describe a function the first one found wins.
+void unwind_load(unwinder_t *uw, Elf *elf) {
+    size_t shstrndx;
+    Elf_Scn *scn = NULL;
+
+    uw->loaded = true;
+    if (elf == NULL || elf_getshdrstrndx(elf, &shstrndx) != 0)
+        return;
+
+    while ((scn = elf_nextscn(elf, scn)) != NULL) {
+        Elf64_Shdr *shdr = elf64_getshdr(scn);
+        if (shdr == NULL || shdr->sh_type == SHT_NOBITS)
+            continue;
+
+        const char *name = elf_strptr(elf, shstrndx, shdr->sh_name);
+        if (name == NULL)
+            continue;
+
+        bool is_eh = strcmp(name, ".eh_frame") == 0;
+        if (!is_eh && strcmp(name, ".debug_frame") != 0)
+            continue;
+
+        Elf_Data *data = elf_getdata(scn, NULL);
+        if (data && data->d_buf)
+            parse_frame_section(uw, data, shdr->sh_addr, is_eh);
+    }
+
+    qsort(uw->fdes, uw->num_fdes, sizeof(cfi_fde_t), cmp_fde);
+
+    // drop FDEs that start inside the previous one
+    size_t kept = 0;
+    for (size_t i = 0; i < uw->num_fdes; ++i) {
+        if (kept && uw->fdes[i].pc_begin < uw->fdes[kept - 1].pc_end)
+            continue;
+        uw->fdes[kept++] = uw->fdes[i];
+    }
+    uw->num_fdes = kept;
+}
+
+static void set_rule(cfi_row_t *row, uint64_t reg, cfi_rule_kind_t kind, int64_t value) {
+    if (reg >= UNWIND_NUM_REGS)
+        return;
+    row->rules[reg].kind = kind;
+    row->rules[reg].value = value;
+}
+
+static void push_row(cfi_fde_t *fde, size_t *cap, const cfi_row_t *row) {
+    // a row that covers no instructions is replaced by the next one
+    if (fde->num_rows && fde->rows[fde->num_rows - 1].loc == row->loc) {
+        fde->rows[fde->num_rows - 1] = *row;
+        return;
+    }
+
+    if (fde->num_rows == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        fde->rows = realloc(fde->rows, *cap * sizeof(cfi_row_t));
+    }
+    fde->rows[fde->num_rows++] = *row;
+}
+
+// Run a CFA program. With fde NULL only the initial row is built.
+static void run_cfa_program(const cfi_cie_t *cie, cfi_fde_t *fde, const unsigned char *insns, size_t len,
+                            cfi_row_t *row, const cfi_row_t *initial, size_t *cap) {
+    reader_t r = { insns, insns + len, 0, insns, false };
+    cfi_row_t stack[UNWIND_STATE_DEPTH];
+    int depth = 0;
+
+    while (r.p < r.end && !r.error) {
+        uint8_t op = read_bytes(&r, 1);
+        uint8_t low = op & 0x3f;
+        uint64_t reg, delta = 0;
+
+        switch (op & 0xc0) {
+            case 0x40:
+                delta = low * cie->code_align;
+                break;
+            case 0x80:
+                set_rule(row, low, RULE_OFFSET, read_uleb(&r) * cie->data_align);
+                continue;
+            case 0xc0:
+                if (low < UNWIND_NUM_REGS)
+                    row->rules[low] = initial ? initial->rules[low] : (cfi_rule_t){ RULE_SAME, 0 };
+                continue;
+        }
+
+        if ((op & 0xc0) == 0) {
+            switch (op) {
+                case 0x00:  // nop
+                    continue;
+                case 0x01:  // set_loc
+                    if (fde)
+                        delta = read_encoded(&r, cie->fde_enc) - row->loc;
+                    break;
+                case 0x02:  delta = read_bytes(&r, 1) * cie->code_align; break;
+                case 0x03:  delta = read_bytes(&r, 2) * cie->code_align; break;
+                case 0x04:  delta = read_bytes(&r, 4) * cie->code_align; break;
+                case 0x05:  // offset_extended
+                    reg = read_uleb(&r);
+                    set_rule(row, reg, RULE_OFFSET, read_uleb(&r) * cie->data_align);
+                    continue;
+                case 0x06:  // restore_extended
+                    reg = read_uleb(&r);
+                    if (reg < UNWIND_NUM_REGS)
+                        row->rules[reg] = initial ? initial->rules[reg] : (cfi_rule_t){ RULE_SAME, 0 };
+                    continue;
+                case 0x07:  // undefined
+                    set_rule(row, read_uleb(&r), RULE_UNDEFINED, 0);
+                    continue;
+                case 0x08:  // same_value
+                    set_rule(row, read_uleb(&r), RULE_SAME, 0);
+                    continue;
+                case 0x09:  // register
+                    reg = read_uleb(&r);
+                    set_rule(row, reg, RULE_REGISTER, read_uleb(&r));
+                    continue;
+                case 0x0a:  // remember_state
+                    if (depth < UNWIND_STATE_DEPTH)
+                        stack[depth++] = *row;
+                    continue;
+                case 0x0b:  // restore_state, the location is kept
+                    if (depth > 0) {
+                        uint64_t loc = row->loc;
+                        *row = stack[--depth];
+                        row->loc = loc;
+                    }
+                    continue;
+                case 0x0c:  // def_cfa
+                    row->cfa_reg = read_uleb(&r);
+                    row->cfa_offset = read_uleb(&r);
+                    continue;
+                case 0x0d:  // def_cfa_register
+                    row->cfa_reg = read_uleb(&r);
+                    continue;
+                case 0x0e:  // def_cfa_offset
+                    row->cfa_offset = read_uleb(&r);
+                    continue;
+                case 0x0f:  // def_cfa_expression, not evaluated
+                    delta = read_uleb(&r);
+                    r.p += delta <= (uint64_t)(r.end - r.p) ? delta : (uint64_t)(r.end - r.p);
+                    row->cfa_reg = UNWIND_NUM_REGS;
+                    continue;
+                case 0x10:  // expression
+                case 0x16:  // val_expression
+                    reg = read_uleb(&r);
+                    delta = read_uleb(&r);
+                    r.p += delta <= (uint64_t)(r.end - r.p) ? delta : (uint64_t)(r.end - r.p);
+                    set_rule(row, reg, RULE_UNDEFINED, 0);
+                    continue;
+                case 0x11:  // offset_extended_sf
+                    reg = read_uleb(&r);
+                    set_rule(row, reg, RULE_OFFSET, read_sleb(&r) * cie->data_align);
+                    continue;
+                case 0x12:  // def_cfa_sf
+                    row->cfa_reg = read_uleb(&r);
+                    row->cfa_offset = read_sleb(&r) * cie->data_align;
+                    continue;
+                case 0x13:  // def_cfa_offset_sf
+                    row->cfa_offset = read_sleb(&r) * cie->data_align;
+                    continue;
+                case 0x14:  // val_offset
+                    reg = read_uleb(&r);
+                    set_rule(row, reg, RULE_VAL_OFFSET, read_uleb(&r) * cie->data_align);
+                    continue;
+                case 0x15:  // val_offset_sf
+                    reg = read_uleb(&r);
+                    set_rule(row, reg, RULE_VAL_OFFSET, read_sleb(&r) * cie->data_align);
+                    continue;
+                case 0x2d:  // AArch64 negate_ra_state, addresses are masked anyway
+                    continue;
+                case 0x2e:  // GNU_args_size
+                    read_uleb(&r);
+                    continue;
+                case 0x2f:  // GNU_negative_offset_extended
+                    reg = read_uleb(&r);
+                    set_rule(row, reg, RULE_OFFSET, -(int64_t)read_uleb(&r) * cie->data_align);
+                    continue;
+                default:
+                    // unknown opcode, the operands cannot be skipped
+                    r.p = r.end;
+                    continue;
+            }
+        }
+
+        // an advance ends the current row
+        if (fde) {
+            push_row(fde, cap, row);
+            row->loc += delta;
+        }
+    }
+}
+
+static void decode_fde(const unwinder_t *uw, cfi_fde_t *fde) {
+    const cfi_cie_t *cie = &uw->cies[fde->cie];
+    cfi_row_t initial = {};
+    size_t cap = 0;
+
+    fde->decoded = true;
+
+    // the default rule for every register is same value, CFA is unknown
+    initial.cfa_reg = UNWIND_NUM_REGS;
+    initial.loc = fde->pc_begin;
+    run_cfa_program(cie, NULL, cie->insns, cie->insns_len, &initial, NULL, &cap);
+
+    cfi_row_t row = initial;
+    run_cfa_program(cie, fde, fde->insns, fde->insns_len, &row, &initial, &cap);
+    push_row(fde, &cap, &row);
+}
+
+static cfi_fde_t *find_fde(unwinder_t *uw, uint64_t pc) {
+    if (uw->last_fde < uw->num_fdes) {
+        cfi_fde_t *fde = &uw->fdes[uw->last_fde];
+        if (pc >= fde->pc_begin && pc < fde->pc_end)
+            return fde;
+    }
+
+    size_t lo = 0, hi = uw->num_fdes;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (uw->fdes[mid].pc_begin <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0 || pc >= uw->fdes[lo - 1].pc_end)
+        return NULL;
+
+    uw->last_fde = lo - 1;
+    return &uw->fdes[lo - 1];
+}
+
+static const cfi_row_t *find_row(unwinder_t *uw, uint64_t pc, uint32_t *ra_reg) {
+    cfi_fde_t *fde = find_fde(uw, pc);
+    if (fde == NULL)
+        return NULL;
+
+    if (!fde->decoded)
+        decode_fde(uw, fde);
+
+    size_t lo = 0, hi = fde->num_rows;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (fde->rows[mid].loc <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return NULL;
+
+    *ra_reg = uw->cies[fde->cie].ra_reg;
+    return &fde->rows[lo - 1];
+}
+
+static bool read_stack_word(unwinder_t *uw, pid_t pid, uint64_t addr, uint64_t *val) {
+    if (addr >= uw->window_base && addr + sizeof(*val) <= uw->window_base + uw->window_len) {
+        memcpy(val, uw->window + (addr - uw->window_base), sizeof(*val));
+        return true;
+    }
+
+    return read_memory_range(pid, addr, val, sizeof(*val)) == sizeof(*val);
+}
+
+// Apply the row of the frame at pc to get its caller's registers
+static bool unwind_cfi(unwinder_t *uw, pid_t pid, const cfi_row_t *row, uint32_t ra_reg,
+                       uint64_t *regs, uint64_t *known, uint64_t *caller_pc) {
+    uint64_t new_regs[UNWIND_NUM_REGS];
+    uint64_t new_known = 0;
+
+    if (row->cfa_reg >= UNWIND_NUM_REGS || !(*known & (1ULL << row->cfa_reg)) || ra_reg >= UNWIND_NUM_REGS)
+        return false;
+
+    uint64_t cfa = regs[row->cfa_reg] + row->cfa_offset;
+
+    for (int i = 0; i < UNWIND_NUM_REGS; ++i) {
+        const cfi_rule_t *rule = &row->rules[i];
+        uint64_t bit = 1ULL << i;
+
+        switch (rule->kind) {
+            case RULE_SAME:
+                new_regs[i] = regs[i];
+                new_known |= *known & bit;
+                break;
+            case RULE_UNDEFINED:
+                break;
+            case RULE_OFFSET:
+                if (read_stack_word(uw, pid, cfa + rule->value, &new_regs[i]))
+                    new_known |= bit;
+                break;
+            case RULE_VAL_OFFSET:
+                new_regs[i] = cfa + rule->value;
+                new_known |= bit;
+                break;
+            case RULE_REGISTER:
+                if (rule->value < UNWIND_NUM_REGS && (*known & (1ULL << rule->value))) {
+                    new_regs[i] = regs[rule->value];
+                    new_known |= bit;
+                }
+                break;
+        }
+    }
+
+    if (!(new_known & (1ULL << ra_reg)))
+        return false;
+
+    *caller_pc = new_regs[ra_reg] & UNWIND_ADDR_MASK;
+    new_regs[AARCH64_DWARF_SP] = cfa;
+    new_known |= 1ULL << AARCH64_DWARF_SP;
+
+    memcpy(regs, new_regs, sizeof(new_regs));
+    *known = new_known;
+    return true;
+}
+
+// Without CFI, x29 points at the frame record {caller x29, return address}
+static bool unwind_fp(unwinder_t *uw, pid_t pid, uint64_t *regs, uint64_t *known, uint64_t *caller_pc) {
+    uint64_t fp = regs[AARCH64_DWARF_FP];
+    uint64_t record[2];
+
+    if (!(*known & (1ULL << AARCH64_DWARF_FP)) || fp == 0 || (fp & 7))
+        return false;
+    if (!read_stack_word(uw, pid, fp, &record[0]) || !read_stack_word(uw, pid, fp + 8, &record[1]))
+        return false;
+
+    *caller_pc = record[1] & UNWIND_ADDR_MASK;
+    regs[AARCH64_DWARF_FP] = record[0];
+    regs[AARCH64_DWARF_SP] = fp + 16;
+    *known = (1ULL << AARCH64_DWARF_FP) | (1ULL << AARCH64_DWARF_SP);
+    return true;
+}
+
+// Walk the stack of a stopped thread starting from one register snapshot.
+// Frame 0 is the current pc, the others are return addresses. uw keeps
+// the copy of the stack, find gives the CFI for each frame's pc.
+size_t unwind_stack(unwinder_t *uw, unwind_find_fn_t find, void *arg, pid_t pid, reg_cache_t *cache,
+                    unwind_frame_t *frames, size_t max_frames) {
+    uint64_t regs[UNWIND_NUM_REGS];
+    uint64_t known = 0;
+    size_t depth = 0;
+
+    if (uw->window == NULL)
+        uw->window = malloc(UNWIND_STACK_WINDOW);
+
+    for (int i = 0; i <= AARCH64_DWARF_SP; ++i) {
+        regs[i] = get_register_value(cache, i);
+        known |= 1ULL << i;
+    }
+    uint64_t pc = get_register_value(cache, AARCH64_PC_REGNUM);
+
+    ssize_t got = read_memory_range(pid, regs[AARCH64_DWARF_SP], uw->window, UNWIND_STACK_WINDOW);
+    uw->window_base = regs[AARCH64_DWARF_SP];
+    uw->window_len = got > 0 ? got : 0;
+
+    while (depth < max_frames && pc != 0) {
+        uint64_t sp = regs[AARCH64_DWARF_SP];
+        uint64_t caller_pc;
+        uint32_t ra_reg;
+
+        frames[depth].pc = pc;
+        frames[depth].sp = sp;
+        depth++;
+
+        // a return address may be just past the end of a noreturn call's function
+        uint64_t lookup_pc = depth == 1 ? pc : pc - 1;
+        uint64_t load_bias;
+        unwinder_t *cfi = find(arg, lookup_pc, &load_bias);
+        const cfi_row_t *row = cfi ? find_row(cfi, lookup_pc - load_bias, &ra_reg) : NULL;
+
+        if (row == NULL && depth == 1) {
+            // with no CFI the innermost frame is taken to be a leaf, or a
+            // function not past its prologue: x29 is still the caller's
+            // and the return address is in x30
+            caller_pc = regs[AARCH64_DWARF_LR] & UNWIND_ADDR_MASK;
+        }
+        else if (!(row && unwind_cfi(uw, pid, row, ra_reg, regs, &known, &caller_pc)) &&
+                 !unwind_fp(uw, pid, regs, &known, &caller_pc)) {
+            break;
+        }
+
+        // the stack must unwind towards its base
+        if (regs[AARCH64_DWARF_SP] < sp || (regs[AARCH64_DWARF_SP] == sp && caller_pc == pc))
+            break;
+        pc = caller_pc;
+    }
+
+    return depth;
+}
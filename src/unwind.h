@@ -0,0 +1,98 @@
+#ifndef UNWIND_H
+#define UNWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <libelf.h>
+
+#include "registers.h"
+
+#define UNWIND_MAX_FRAMES   256
+#define UNWIND_STACK_WINDOW (64 << 10)
+#define UNWIND_NUM_REGS     33      // x0-x30, sp and one spare return address column
+#define UNWIND_STATE_DEPTH  8       // DW_CFA_remember_state nesting
+
+// Return addresses may carry a pointer authentication code in the top bits
+#define UNWIND_ADDR_MASK    0x0000FFFFFFFFFFFFULL
+
+
+typedef enum {
+    RULE_SAME,
+    RULE_UNDEFINED,
+    RULE_OFFSET,        // saved at CFA + value
+    RULE_VAL_OFFSET,    // is CFA + value
+    RULE_REGISTER,      // saved in register value
+} cfi_rule_kind_t;
+
+typedef struct {
+    uint8_t kind;
+    int32_t value;
+} cfi_rule_t;
+
+// Where the CFA and each register are for pcs from loc up to the next row.
+// A cfa_reg of UNWIND_NUM_REGS or above means the CFA cannot be computed.
+typedef struct {
+    uint64_t loc;
+    uint32_t cfa_reg;
+    int64_t cfa_offset;
+    cfi_rule_t rules[UNWIND_NUM_REGS];
+} cfi_row_t;
+
+typedef struct {
+    uint64_t code_align;
+    int64_t data_align;
+    uint32_t ra_reg;
+    uint8_t fde_enc;
+    bool augmented;     // FDEs carry augmentation data ('z')
+    const unsigned char *insns;
+    size_t insns_len;
+} cfi_cie_t;
+
+// The rows of an FDE are decoded the first time one of its pcs is
+// unwound and kept for later lookups
+typedef struct {
+    uint64_t pc_begin;
+    uint64_t pc_end;
+    uint32_t cie;
+    bool decoded;
+    const unsigned char *insns;
+    size_t insns_len;
+    cfi_row_t *rows;
+    size_t num_rows;
+} cfi_fde_t;
+
+typedef struct {
+    bool loaded;
+
+    cfi_cie_t *cies;
+    size_t num_cies;
+    size_t cies_cap;
+
+    cfi_fde_t *fdes;        // sorted by pc_begin
+    size_t num_fdes;
+    size_t fdes_cap;
+    size_t last_fde;
+
+    unsigned char *window;  // copy of the stack above sp
+    uint64_t window_base;
+    size_t window_len;
+} unwinder_t;
+
+typedef struct {
+    uint64_t pc;
+    uint64_t sp;
+} unwind_frame_t;
+
+// The CFI covering a pc, from the executable or the library mapped
+// there, and the load bias to apply to it; NULL if there is none
+typedef unwinder_t *(*unwind_find_fn_t)(void *arg, uint64_t pc, uint64_t *load_bias);
+
+
+void unwind_init(unwinder_t *uw);
+void unwind_free(unwinder_t *uw);
+void unwind_load(unwinder_t *uw, Elf *elf);
+size_t unwind_stack(unwinder_t *uw, unwind_find_fn_t find, void *arg, pid_t pid, reg_cache_t *regs,
+                    unwind_frame_t *frames, size_t max_frames);
+
+#endif
@@ -13,34 +13,42 @@ void trim_ends(char **s) {
     while (isspace(*beg)) {
         beg++;
     }
-    while (isspace(*end)) {
+    while (end >= beg && isspace(*end)) {
         *end = '\0';
         end--;
     }
     *s = beg;
 }
 
+// Split on whitespace. The array always has at least MAX_ARGS slots
+// after the arguments so callers can index optional arguments directly.
 char** split(char *s) {
-    // four arguments max, 32 characters each
-    char **split = calloc(MAX_ARGS, sizeof(char*));
-    int str_idx = 0;
-    int char_idx = 0;
-
-    split[0] = calloc(ARG_LEN, sizeof(char));
-
-    for (size_t i = 0; i < strlen(s); ) {
-        if (isspace(s[i])) {
-            // consume whitespace between arguments
-            while (isspace(s[i])) ++i;
-            split[++str_idx] = calloc(ARG_LEN, sizeof(char));
-            char_idx = 0;
-        }
-        else {
-            split[str_idx][char_idx] = s[i++];
-            char_idx++;
-        }
+    size_t num_args = 0;
+    char *p = s;
+
+    while (*p) {
+        while (isspace(*p)) ++p;
+        if (!*p) break;
+        num_args++;
+        while (*p && !isspace(*p)) ++p;
+    }
+
+    char **split = calloc(num_args + MAX_ARGS + 1, sizeof(char*));
+    size_t str_idx = 0;
+
+    p = s;
+    while (*p) {
+        while (isspace(*p)) ++p;
+        if (!*p) break;
+        char *beg = p;
+        while (*p && !isspace(*p)) ++p;
+        split[str_idx++] = strndup(beg, p - beg);
     }
 
+    // an empty line still yields an (empty) command
+    if (num_args == 0)
+        split[0] = calloc(1, sizeof(char));
+
     return split;
 }
 
@@ -100,18 +108,13 @@ bool bin_is_pie(Elf *elf) {
     return is_dyn;
 }
 
-char *loc_last_dir(char *str) {
-
-    size_t loc = 0, last_slash = 0;
+// Returns the last directory and file name of a path, e.g. "src/main.c"
+const char *loc_last_dir(const char *str) {
+    int slashes = 0;
     for (int i = strlen(str) - 1; i >= 0; --i) {
-        if (str[i] == '/' && last_slash == 0) {
-            last_slash = i;
-        }
-        else if (str[i] == '/' && last_slash != 0) {
-            loc = i;
-            break;
-        }
+        if (str[i] == '/' && ++slashes == 2)
+            return str + i + 1;
     }
 
-    return str + loc + 1;
-} 
\ No newline at end of file
+    return str;
+}
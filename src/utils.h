@@ -6,7 +6,6 @@
 #include <libelf.h>
 
 #define MAX_ARGS 4
-#define ARG_LEN 32
 
 #define GRN   "\x1B[32m"
 #define BLU   "\x1B[34m"
@@ -20,6 +19,6 @@ uint64_t convert_val_radix(const char *val);
 void free_args(char **args);
 bool is_symbol(const char *loc);
 bool bin_is_pie(Elf *elf);
-char *loc_last_dir(char *str);
+const char *loc_last_dir(const char *str);
 
 #endif
\ No newline at end of file
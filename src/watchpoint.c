@@ -0,0 +1,424 @@
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "watchpoint.h"
+#include "debugger.h"
+#include "inject.h"
+#include "utils.h"
+
+
+void watch_table_init(watch_table_t *table) {
+    memset(table, 0, sizeof(*table));
+}
+
+void watch_table_free(watch_table_t *table) {
+    while (table->head)
+        watch_remove(table, table->head);
+    free(table->pages);
+    watch_table_init(table);
+}
+
+watchpoint_t *watch_add(watch_table_t *table, int num, uint64_t addr, size_t len, const char *expr) {
+    watchpoint_t *wp = calloc(1, sizeof(watchpoint_t));
+    wp->num = num;
+    wp->addr = addr;
+    wp->len = len;
+    wp->expr = strdup(expr);
+    wp->value = calloc(1, len);
+
+    // listed in the order they were set
+    watchpoint_t **tail = &table->head;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = wp;
+
+    return wp;
+}
+
+watchpoint_t *watch_find(const watch_table_t *table, int num) {
+    for (watchpoint_t *wp = table->head; wp; wp = wp->next) {
+        if (wp->num == num)
+            return wp;
+    }
+    return NULL;
+}
+
+// Only the watchpoint; references it holds on pages are dropped separately
+void watch_remove(watch_table_t *table, watchpoint_t *wp) {
+    for (watchpoint_t **p = &table->head; *p; p = &(*p)->next) {
+        if (*p == wp) {
+            *p = wp->next;
+            break;
+        }
+    }
+    free(wp->expr);
+    free(wp->value);
+    free(wp);
+}
+
+watch_page_t *watch_page_find(const watch_table_t *table, uint64_t addr) {
+    for (size_t i = 0; i < table->num_pages; ++i) {
+        if (table->pages[i].addr == addr)
+            return &table->pages[i];
+    }
+    return NULL;
+}
+
+watch_page_t *watch_page_ref(watch_table_t *table, uint64_t addr, int prot) {
+    watch_page_t *page = watch_page_find(table, addr);
+    if (page) {
+        page->refs++;
+        return page;
+    }
+
+    if (table->num_pages == table->pages_cap) {
+        table->pages_cap = table->pages_cap ? table->pages_cap * 2 : 4;
+        table->pages = realloc(table->pages, table->pages_cap * sizeof(watch_page_t));
+    }
+    page = &table->pages[table->num_pages++];
+    *page = (watch_page_t) { .addr = addr, .prot = prot, .refs = 1 };
+    return page;
+}
+
+// Returns true once no watchpoint covers the page; it is then gone from
+// the table
+bool watch_page_unref(watch_table_t *table, watch_page_t *page) {
+    if (--page->refs > 0)
+        return false;
+
+    *page = table->pages[--table->num_pages];
+    return true;
+}
+
+static uint64_t page_size(void) {
+    return sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t page_of(uint64_t addr) {
+    return addr & ~(page_size() - 1);
+}
+
+// Protection of the mapping holding addr, -1 if there is none
+static int mapping_prot(pid_t pid, uint64_t addr) {
+    char path[32], line[PATH_MAX + 128];
+    int prot = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    FILE *maps = fopen(path, "r");
+    if (maps == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), maps)) {
+        uint64_t start, end;
+        char perms[5];
+        if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3 || addr < start || addr >= end)
+            continue;
+
+        prot = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) |
+               (perms[2] == 'x' ? PROT_EXEC : 0);
+        break;
+    }
+    fclose(maps);
+
+    return prot;
+}
+
+// Data objects are not in the symbol index, which holds functions only;
+// a watch command is rare enough to scan the ELF symbol tables
+static bool find_data_symbol(Elf *elf, const char *name, uint64_t *addr, uint64_t *size) {
+    for (Elf_Scn *scn = elf_nextscn(elf, NULL); scn; scn = elf_nextscn(elf, scn)) {
+        Elf64_Shdr *shdr = elf64_getshdr(scn);
+        if (shdr == NULL || (shdr->sh_type != SHT_SYMTAB && shdr->sh_type != SHT_DYNSYM))
+            continue;
+
+        Elf_Data *data = elf_getdata(scn, NULL);
+        if (data == NULL || shdr->sh_entsize != sizeof(Elf64_Sym))
+            continue;
+
+        const Elf64_Sym *syms = data->d_buf;
+        for (size_t i = 0; i < data->d_size / sizeof(Elf64_Sym); ++i) {
+            if (ELF64_ST_TYPE(syms[i].st_info) != STT_OBJECT || syms[i].st_shndx == SHN_UNDEF)
+                continue;
+
+            const char *sym_name = elf_strptr(elf, shdr->sh_link, syms[i].st_name);
+            if (sym_name && strcmp(sym_name, name) == 0) {
+                *addr = syms[i].st_value;
+                *size = syms[i].st_size;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Drop the references on the pages of [addr, addr + len); pages no
+// longer watched get their protection back
+static void unprotect_range(dbg_ctx *ctx, uint64_t addr, size_t len) {
+    for (uint64_t page = page_of(addr); page < addr + len; page += page_size()) {
+        watch_page_t *wpage = watch_page_find(&ctx->watch, page);
+        if (wpage == NULL)
+            continue;
+
+        int prot = wpage->prot;
+        if (watch_page_unref(&ctx->watch, wpage) && !ctx->exited)
+            inject_mprotect(ctx, page, page_size(), prot);
+    }
+}
+
+// Take a reference on every page of [addr, addr + len), making the ones
+// not watched yet read-only. Nothing is left changed on failure.
+static bool protect_range(dbg_ctx *ctx, uint64_t addr, size_t len) {
+    uint64_t first = page_of(addr);
+
+    for (uint64_t page = first; page < addr + len; page += page_size()) {
+        watch_page_t *wpage = watch_page_find(&ctx->watch, page);
+        int prot = wpage ? wpage->prot : mapping_prot(ctx->pid, page);
+
+        if (prot < 0 || !(prot & PROT_WRITE)) {
+            printf("Cannot watch 0x%lx: not writable memory\n", page < addr ? addr : page);
+            unprotect_range(ctx, first, page - first);
+            return false;
+        }
+        if (wpage == NULL && inject_mprotect(ctx, page, page_size(), prot & ~PROT_WRITE) < 0) {
+            printf("Cannot protect the page at 0x%lx\n", page);
+            unprotect_range(ctx, first, page - first);
+            return false;
+        }
+        watch_page_ref(&ctx->watch, page, prot);
+    }
+    return true;
+}
+
+// Page protections can only be changed from a stopped thread
+static bool watch_thread_stopped(dbg_ctx *ctx) {
+    if (ctx->thread->state == THREAD_STOPPED)
+        return true;
+    printf("Cannot change watchpoints while the selected thread is running.\n");
+    return false;
+}
+
+// A variable is watched over its whole size unless len says otherwise,
+// an address ("*0x...") needs len
+void set_watchpoint(dbg_ctx *ctx, const char *loc, const char *len_text) {
+    uint64_t addr, size = 0;
+
+    if (is_symbol(loc)) {
+        if (!find_data_symbol(ctx->bin->elf, loc, &addr, &size)) {
+            printf("No variable \"%s\".\n", loc);
+            return;
+        }
+        addr = add_load_addr(ctx, addr);
+    }
+    else {
+        addr = convert_val_radix(loc + 1);
+    }
+    if (len_text)
+        size = strtoul(len_text, NULL, 0);
+
+    if (size == 0 || size > WATCH_MAX_LEN) {
+        printf("Length of watched memory must be 1 to %d bytes\n", WATCH_MAX_LEN);
+        return;
+    }
+    if (!watch_thread_stopped(ctx))
+        return;
+
+    uint8_t *value = malloc(size);
+    if (read_memory_range(ctx->pid, addr, value, size) != (ssize_t)size) {
+        printf("Error: cannot access memory at 0x%lx\n", addr);
+        free(value);
+        return;
+    }
+
+    // the syscalls that follow run from the scratch page, never from code
+    // other threads might be executing
+    if (get_scratch_page(ctx) == 0 || !protect_range(ctx, addr, size)) {
+        free(value);
+        return;
+    }
+
+    watchpoint_t *wp = watch_add(&ctx->watch, ctx->breakpoints.next_num++, addr, size, loc);
+    memcpy(wp->value, value, size);
+    free(value);
+
+    printf("Watchpoint %d: %s (%zu bytes at 0x%lx)\n", wp->num, wp->expr, wp->len, wp->addr);
+}
+
+void list_watchpoints(const dbg_ctx *ctx) {
+    if (ctx->watch.head == NULL) {
+        printf("No watchpoints.\n");
+        return;
+    }
+
+    printf("Num     Address            Len   Hits  What\n");
+    for (watchpoint_t *wp = ctx->watch.head; wp; wp = wp->next)
+        printf("%-7d 0x%016lx %-5zu %-5lu %s\n", wp->num, wp->addr, wp->len, wp->hit_count, wp->expr);
+    printf("%zu page(s) watched, %lu store(s) to them stepped\n", ctx->watch.num_pages, ctx->watch.faults);
+}
+
+static void remove_watchpoint(dbg_ctx *ctx, watchpoint_t *wp) {
+    unprotect_range(ctx, wp->addr, wp->len);
+    watch_remove(&ctx->watch, wp);
+}
+
+// Returns false if num is not a watchpoint
+bool delete_watchpoint(dbg_ctx *ctx, int num) {
+    watchpoint_t *wp = watch_find(&ctx->watch, num);
+    if (wp == NULL)
+        return false;
+
+    if (watch_thread_stopped(ctx))
+        remove_watchpoint(ctx, wp);
+    return true;
+}
+
+void delete_watchpoints(dbg_ctx *ctx) {
+    if (ctx->watch.head == NULL || !watch_thread_stopped(ctx))
+        return;
+
+    while (ctx->watch.head)
+        remove_watchpoint(ctx, ctx->watch.head);
+}
+
+// A forked child inherits the read-only pages, and nobody would let its
+// stores through. They are made writable again in the child, stopped at
+// its first stop, from a stand-in context: the scratch page is at the
+// same address in its copy of the memory.
+void unwatch_fork(dbg_ctx *ctx, pid_t child) {
+    if (ctx->watch.num_pages == 0)
+        return;
+
+    dbg_ctx child_ctx = { .pid = child, .scratch_addr = ctx->scratch_addr };
+    thread_t thread = { .tid = child, .state = THREAD_STOPPED };
+    reg_cache_init(&thread.regs, child);
+    child_ctx.thread = &thread;
+
+    for (size_t i = 0; i < ctx->watch.num_pages; ++i) {
+        const watch_page_t *page = &ctx->watch.pages[i];
+        if (inject_mprotect(&child_ctx, page->addr, page_size(), page->prot) < 0)
+            printf("Cannot unprotect the page at 0x%lx in process %d\n", page->addr, child);
+    }
+    flush_registers(&thread.regs);
+}
+
+// A write to a page made read-only for watchpoints
+bool is_watch_fault(const dbg_ctx *ctx, const siginfo_t *info) {
+    return info->si_signo == SIGSEGV && info->si_code == SEGV_ACCERR &&
+           watch_page_find(&ctx->watch, page_of((uint64_t)info->si_addr)) != NULL;
+}
+
+// Step the faulting store with its page writable. Returns false with
+// info holding the new fault if it faulted elsewhere, or with no signal
+// in it if the process is gone.
+static bool step_store(dbg_ctx *ctx, siginfo_t *info) {
+    thread_t *thread = ctx->thread;
+    int status;
+
+    flush_registers(&thread->regs);
+    invalidate_registers(&thread->regs);
+    info->si_signo = 0;
+
+    while (1) {
+        if (ptrace(PTRACE_SINGLESTEP, thread->tid, NULL, NULL) < 0 ||
+            waitpid(thread->tid, &status, __WALL) < 0)
+            return false;
+        if (!WIFSTOPPED(status)) {
+            if (thread->tid == ctx->pid)
+                check_if_exit(ctx, status);
+            return false;
+        }
+
+        // signals that came in the way are delivered at the next resume,
+        // event stops (group stops, interrupts) are not signals
+        int sig = WSTOPSIG(status);
+        if (status >> 16 != 0)
+            continue;
+        if (sig == SIGTRAP)
+            return true;
+        if (sig == SIGSEGV) {
+            ptrace(PTRACE_GETSIGINFO, thread->tid, NULL, info);
+            return false;
+        }
+        thread->pending_sig = sig;
+    }
+}
+
+static void print_watch_value(const uint8_t *value, size_t len) {
+    if (len == 1 || len == 2 || len == 4 || len == 8) {
+        uint64_t val = 0;
+        memcpy(&val, value, len);
+        printf("%lu (0x%lx)\n", val, val);
+        return;
+    }
+
+    for (size_t i = 0; i < len && i < 32; ++i)
+        printf("%02x ", value[i]);
+    printf(len > 32 ? "...\n" : "\n");
+}
+
+// Report every watchpoint whose value changed. Other threads may have
+// written while the page was writable; their changes show up here too.
+static bool check_watchpoints(dbg_ctx *ctx) {
+    bool changed = false;
+
+    for (watchpoint_t *wp = ctx->watch.head; wp; wp = wp->next) {
+        uint8_t value[WATCH_MAX_LEN];
+        if (read_memory_range(ctx->pid, wp->addr, value, wp->len) != (ssize_t)wp->len ||
+            memcmp(value, wp->value, wp->len) == 0)
+            continue;
+
+        wp->hit_count++;
+        printf("\nWatchpoint %d: %s\n\nOld value = ", wp->num, wp->expr);
+        print_watch_value(wp->value, wp->len);
+        printf("New value = ");
+        print_watch_value(value, wp->len);
+        memcpy(wp->value, value, wp->len);
+        changed = true;
+    }
+
+    return changed;
+}
+
+// A store to a watched page: its page is made writable for the one
+// instruction, then read-only again. Unless a watched value changed the
+// thread goes on as if nothing happened. Returns false, with info
+// describing the fault to report, if it was not for a watchpoint.
+bool watch_fault(dbg_ctx *ctx, siginfo_t *info) {
+    uint64_t pages[2];
+    size_t num_pages = 0;
+    bool stepped = false;
+
+    // a store across a page boundary can fault on both pages
+    while (num_pages < 2 && is_watch_fault(ctx, info)) {
+        uint64_t page = page_of((uint64_t)info->si_addr);
+        if (inject_mprotect(ctx, page, page_size(), watch_page_find(&ctx->watch, page)->prot) < 0) {
+            printf("Cannot unprotect the watched page at 0x%lx\n", page);
+            break;
+        }
+        pages[num_pages++] = page;
+        if ((stepped = step_store(ctx, info)))
+            break;
+    }
+    if (num_pages == 0)
+        return info->si_signo != SIGSEGV;
+    if (ctx->exited)
+        return true;
+
+    for (size_t i = 0; i < num_pages; ++i)
+        inject_mprotect(ctx, pages[i], page_size(), watch_page_find(&ctx->watch, pages[i])->prot & ~PROT_WRITE);
+
+    if (!stepped)
+        return info->si_signo != SIGSEGV;
+
+    ctx->watch.faults++;
+    if (!check_watchpoints(ctx))
+        ctx->auto_resume = true;
+    return true;
+}
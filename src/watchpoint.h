@@ -0,0 +1,51 @@
+#ifndef WATCHPOINT_H
+#define WATCHPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WATCH_MAX_LEN   4096
+
+
+// A range of inferior memory reported whenever a store changes it.
+// Watchpoints share their numbers with breakpoints.
+typedef struct watchpoint {
+    int num;
+    uint64_t addr;
+    size_t len;
+    char *expr;             // as given to the watch command
+    uint8_t *value;         // contents when last checked
+    unsigned long hit_count;
+    struct watchpoint *next;
+} watchpoint_t;
+
+// A page made read-only because watchpoints cover it. Every store to it
+// faults, and is let through one instruction at a time.
+typedef struct {
+    uint64_t addr;
+    int prot;               // protection to give back once unwatched
+    int refs;               // watchpoints covering the page
+} watch_page_t;
+
+typedef struct {
+    watchpoint_t *head;
+    watch_page_t *pages;
+    size_t num_pages;
+    size_t pages_cap;
+    unsigned long faults;   // stores to watched pages, changing a value or not
+} watch_table_t;
+
+
+void watch_table_init(watch_table_t *table);
+void watch_table_free(watch_table_t *table);
+
+watchpoint_t *watch_add(watch_table_t *table, int num, uint64_t addr, size_t len, const char *expr);
+watchpoint_t *watch_find(const watch_table_t *table, int num);
+void watch_remove(watch_table_t *table, watchpoint_t *wp);
+
+watch_page_t *watch_page_find(const watch_table_t *table, uint64_t addr);
+watch_page_t *watch_page_ref(watch_table_t *table, uint64_t addr, int prot);
+bool watch_page_unref(watch_table_t *table, watch_page_t *page);
+
+#endif